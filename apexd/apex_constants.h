@@ -44,6 +44,9 @@ static constexpr const char* kStagedSessionsDir = "/data/app-staging";
 static constexpr const char* kApexDataSubDir = "apexdata";
 static constexpr const char* kApexSharedLibsSubDir = "sharedlibs";
 static constexpr const char* kApexSnapshotSubDir = "apexrollback";
+// Holds an empty /apex/.mounted/<name> file for every APEX whose
+// /apex/<name> mount is ready.
+static constexpr const char* kApexMountedSubDir = ".mounted";
 static constexpr const char* kPreRestoreSuffix = "-prerestore";
 
 static constexpr const char* kDeSysDataDir = "/data/misc";
@@ -238,6 +238,24 @@ Result<MountedApexData> ResolveMountInfo(
   }
 }
 
+// erofs APEXes can be mounted straight from the APEX file, which then shows up
+// as the source of the mount.
+Result<MountedApexData> ResolveFileMountInfo(const fs::path& file,
+                                             const std::string& mount_point) {
+  std::error_code ec;
+  if (!fs::is_regular_file(file, ec)) {
+    return Error() << file.string()
+                   << " is neither a block device nor an APEX file";
+  }
+  auto result = MountedApexData(/* loop_name= */ "", file, mount_point,
+                                /* device_name= */ "",
+                                /* hashtree_loop_name= */ "",
+                                /* is_temp_mount= */
+                                EndsWith(mount_point, ".tmp"));
+  NormalizeIfDeleted(&result);
+  return result;
+}
+
 }  // namespace
 
 // On startup, APEX database is populated from /proc/mounts.
@@ -245,6 +263,7 @@ Result<MountedApexData> ResolveMountInfo(
 // /apex/<package-id> can be mounted from
 // - /dev/block/loopX : loop device
 // - /dev/block/dm-X : dm-verity
+// - /system/apex/X.apex : the APEX file itself, for erofs
 
 // In case of loop device, it is from a non-flattened
 // APEX file. This original APEX file can be tracked
@@ -282,8 +301,11 @@ void MountedApexDatabase::PopulateFromMounts(
     }
 
     auto mount_data =
-        ResolveMountInfo(BlockDevice(block), mount_point, active_apex_dir,
-                         decompression_dir, apex_hash_tree_dir);
+        block.parent_path() == kDevBlock
+            ? ResolveMountInfo(BlockDevice(block), mount_point,
+                               active_apex_dir, decompression_dir,
+                               apex_hash_tree_dir)
+            : ResolveFileMountInfo(block, mount_point);
     if (!mount_data.ok()) {
       LOG(WARNING) << "Can't resolve mount info " << mount_data.error();
       continue;
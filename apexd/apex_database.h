@@ -18,6 +18,7 @@
 #define ANDROID_APEXD_APEX_DATABASE_H_
 
 #include <map>
+#include <memory>
 #include <mutex>
 #include <optional>
 #include <string>
@@ -27,13 +28,16 @@
 #include <android-base/result.h>
 #include <android-base/thread_annotations.h>
 
+#include "apex_file.h"
+
 namespace android {
 namespace apex {
 
 class MountedApexDatabase {
  public:
-  // Stores associated low-level data for a mounted APEX. To conserve memory,
-  // the APEX file isn't stored, but must be opened to retrieve specific data.
+  // Stores associated low-level data for a mounted APEX. Mounts created by this
+  // process also keep an immutable snapshot of the APEX file they were created
+  // from, so that queries don't need to open and parse it again.
   struct MountedApexData {
     std::string loop_name;  // Loop device used (fs path).
     std::string full_path;  // Full path to the apex file.
@@ -46,6 +50,9 @@ class MountedApexDatabase {
     bool deleted;
     // Whether the mount is a temp mount or not.
     bool is_temp_mount;
+    // The APEX file this mount was created from, or nullptr if the mount was
+    // discovered by PopulateFromMounts. Not taken into account for ordering.
+    std::shared_ptr<const ApexFile> apex_file;
 
     MountedApexData() {}
     MountedApexData(const std::string& loop_name, const std::string& full_path,
@@ -27,12 +27,20 @@
 #include <sys/types.h>
 #include <unistd.h>
 #include <ziparchive/zip_archive.h>
+#include <zstd.h>
 
+#include <algorithm>
+#include <array>
+#include <chrono>
 #include <filesystem>
 #include <fstream>
+#include <future>
+#include <limits>
+#include <mutex>
 #include <span>
 
 #include "apex_constants.h"
+#include "apexd_executor.h"
 #include "apexd_utils.h"
 #include "apexd_verity.h"
 
@@ -51,6 +59,9 @@ namespace {
 
 constexpr const char* kImageFilename = "apex_payload.img";
 constexpr const char* kCompressedApexFilename = "original_apex";
+// Alternative to kCompressedApexFilename: original_apex compressed into a
+// seekable zstd stream, stored without compression in the zip.
+constexpr const char* kZstdCompressedApexFilename = "original_apex.zst";
 constexpr const char* kBundledPublicKeyFilename = "apex_pubkey";
 
 struct FsMagic {
@@ -63,19 +74,283 @@ constexpr const FsMagic kFsType[] = {{"f2fs", 1024, 4, "\x10\x20\xf5\xf2"},
                                      {"ext4", 1024 + 0x38, 2, "\123\357"},
                                      {"erofs", 1024, 4, "\xe2\xe1\xf5\xe0"}};
 
+// Range of the image that covers the magic of all filesystems in kFsType, so
+// that it can be fetched with a single read.
+constexpr int32_t FsMagicStart() {
+  int32_t start = kFsType[0].offset;
+  for (const auto& fs : kFsType) {
+    start = std::min(start, fs.offset);
+  }
+  return start;
+}
+
+constexpr int32_t FsMagicEnd() {
+  int32_t end = 0;
+  for (const auto& fs : kFsType) {
+    end = std::max(end, fs.offset + fs.len);
+  }
+  return end;
+}
+
+constexpr int32_t kFsMagicStart = FsMagicStart();
+constexpr int32_t kFsMagicEnd = FsMagicEnd();
+
 Result<std::string> RetrieveFsType(borrowed_fd fd, uint32_t image_offset) {
+  std::array<char, kFsMagicEnd - kFsMagicStart> buf;
+  if (!ReadFullyAtOffset(fd, buf.data(), buf.size(),
+                         image_offset + kFsMagicStart)) {
+    return ErrnoError() << "Couldn't read filesystem magic";
+  }
   for (const auto& fs : kFsType) {
-    char buf[fs.len];
-    if (!ReadFullyAtOffset(fd, buf, fs.len, image_offset + fs.offset)) {
-      return ErrnoError() << "Couldn't read filesystem magic";
-    }
-    if (memcmp(buf, fs.magic, fs.len) == 0) {
+    const char* magic = buf.data() + (fs.offset - kFsMagicStart);
+    if (memcmp(magic, fs.magic, fs.len) == 0) {
       return std::string(fs.type);
     }
   }
   return Error() << "Couldn't find filesystem magic";
 }
 
+// A frame of a seekable zstd stream, see
+// https://github.com/facebook/zstd/blob/dev/contrib/seekable_format/zstd_seekable_compression_format.md
+struct ZstdFrame {
+  // Absolute offset in the file holding the stream.
+  uint64_t compressed_offset;
+  uint32_t compressed_size;
+  uint64_t decompressed_offset;
+  uint32_t decompressed_size;
+};
+
+constexpr uint32_t kZstdSkippableMagic = 0x184D2A5E;
+constexpr uint32_t kZstdSeekableMagic = 0x8F92EAB1;
+constexpr size_t kZstdSkippableHeaderSize = 8;
+constexpr size_t kZstdSeekTableFooterSize = 9;
+constexpr uint8_t kZstdSeekTableChecksumFlag = 1 << 7;
+// Limits of the seekable format, ZSTD_SEEKABLE_MAXFRAMES and
+// ZSTD_SEEKABLE_MAX_FRAME_DECOMPRESSED_SIZE in zstd_seekable.h.
+constexpr uint64_t kZstdSeekableMaxFrames = 0x8000000;
+constexpr uint32_t kZstdSeekableMaxFrameSize = 0x40000000;
+
+uint32_t ReadLE32(const uint8_t* p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<uint32_t>(p[3]) << 24);
+}
+
+// Parses the seek table at the end of the seekable zstd stream found at
+// [offset, offset + length) of |fd|.
+Result<std::vector<ZstdFrame>> ReadZstdSeekTable(borrowed_fd fd,
+                                                 uint64_t offset,
+                                                 uint64_t length) {
+  if (length < kZstdSkippableHeaderSize + kZstdSeekTableFooterSize) {
+    return Error() << "zstd stream is too short";
+  }
+  std::array<uint8_t, kZstdSeekTableFooterSize> footer;
+  if (!ReadFullyAtOffset(fd, footer.data(), footer.size(),
+                         offset + length - footer.size())) {
+    return ErrnoError() << "Failed to read zstd seek table footer";
+  }
+  if (ReadLE32(footer.data() + 5) != kZstdSeekableMagic) {
+    return Error() << "zstd stream is not seekable";
+  }
+  const uint64_t num_frames = ReadLE32(footer.data());
+  if (num_frames > kZstdSeekableMaxFrames) {
+    return Error() << "zstd seek table has too many frames: " << num_frames;
+  }
+  const uint8_t descriptor = footer[4];
+  if ((descriptor & 0x7c) != 0) {
+    return Error() << "Invalid zstd seek table descriptor " << +descriptor;
+  }
+  const size_t entry_size =
+      (descriptor & kZstdSeekTableChecksumFlag) != 0 ? 12 : 8;
+  const uint64_t table_size = kZstdSkippableHeaderSize +
+                              num_frames * entry_size +
+                              kZstdSeekTableFooterSize;
+  if (table_size > length) {
+    return Error() << "zstd seek table is larger than the stream";
+  }
+
+  std::vector<uint8_t> table(table_size - kZstdSeekTableFooterSize);
+  if (!ReadFullyAtOffset(fd, table.data(), table.size(),
+                         offset + length - table_size)) {
+    return ErrnoError() << "Failed to read zstd seek table";
+  }
+  if (ReadLE32(table.data()) != kZstdSkippableMagic ||
+      ReadLE32(table.data() + 4) != table_size - kZstdSkippableHeaderSize) {
+    return Error() << "Invalid zstd seek table header";
+  }
+
+  std::vector<ZstdFrame> frames;
+  frames.reserve(num_frames);
+  uint64_t compressed_offset = offset;
+  uint64_t decompressed_offset = 0;
+  for (uint64_t i = 0; i < num_frames; i++) {
+    const uint8_t* entry =
+        table.data() + kZstdSkippableHeaderSize + i * entry_size;
+    ZstdFrame frame{.compressed_offset = compressed_offset,
+                    .compressed_size = ReadLE32(entry),
+                    .decompressed_offset = decompressed_offset,
+                    .decompressed_size = ReadLE32(entry + 4)};
+    // Bounds what DecompressZstdFrames() allocates for a frame.
+    if (frame.decompressed_size > kZstdSeekableMaxFrameSize) {
+      return Error() << "zstd frame " << i << " is too large: "
+                     << frame.decompressed_size << " bytes";
+    }
+    compressed_offset += frame.compressed_size;
+    decompressed_offset += frame.decompressed_size;
+    frames.push_back(frame);
+  }
+  if (compressed_offset != offset + length - table_size) {
+    return Error() << "zstd seek table doesn't match the size of the stream";
+  }
+  return frames;
+}
+
+Result<uint64_t> GetZstdDecompressedSize(borrowed_fd fd, uint64_t offset,
+                                         uint64_t length) {
+  auto frames = ReadZstdSeekTable(fd, offset, length);
+  if (!frames.ok()) {
+    return frames.error();
+  }
+  if (frames->empty()) {
+    return 0;
+  }
+  return frames->back().decompressed_offset + frames->back().decompressed_size;
+}
+
+Result<void> DecompressZstdFrames(borrowed_fd src, borrowed_fd dest,
+                                  std::span<const ZstdFrame> frames) {
+  std::unique_ptr<ZSTD_DCtx, decltype(&ZSTD_freeDCtx)> dctx(ZSTD_createDCtx(),
+                                                            ZSTD_freeDCtx);
+  if (dctx == nullptr) {
+    return Error() << "Failed to create zstd context";
+  }
+  std::vector<uint8_t> in;
+  std::vector<uint8_t> out;
+  for (const ZstdFrame& frame : frames) {
+    in.resize(frame.compressed_size);
+    if (!ReadFullyAtOffset(src, in.data(), in.size(),
+                           frame.compressed_offset)) {
+      return ErrnoError() << "Failed to read zstd frame at "
+                          << frame.compressed_offset;
+    }
+    // The frame header is optional, but must agree with the seek table.
+    unsigned long long content_size =
+        ZSTD_getFrameContentSize(in.data(), in.size());
+    if (content_size == ZSTD_CONTENTSIZE_ERROR) {
+      return Error() << "Invalid zstd frame header at "
+                     << frame.compressed_offset;
+    }
+    if (content_size != ZSTD_CONTENTSIZE_UNKNOWN &&
+        content_size != frame.decompressed_size) {
+      return Error() << "zstd frame at " << frame.compressed_offset
+                     << " has content size " << content_size
+                     << ", seek table says " << frame.decompressed_size;
+    }
+    out.resize(frame.decompressed_size);
+    size_t ret = ZSTD_decompressDCtx(dctx.get(), out.data(), out.size(),
+                                     in.data(), in.size());
+    if (ZSTD_isError(ret)) {
+      return Error() << "Failed to decompress zstd frame at "
+                     << frame.compressed_offset << ": "
+                     << ZSTD_getErrorName(ret);
+    }
+    if (ret != out.size()) {
+      return Error() << "zstd frame at " << frame.compressed_offset
+                     << " decompressed to " << ret << " bytes, expected "
+                     << out.size();
+    }
+    for (size_t written = 0; written < out.size();) {
+      ssize_t n = TEMP_FAILURE_RETRY(
+          pwrite(dest.get(), out.data() + written, out.size() - written,
+                 frame.decompressed_offset + written));
+      if (n <= 0) {
+        return ErrnoError() << "Failed to write decompressed data";
+      }
+      written += n;
+    }
+  }
+  return {};
+}
+
+// Decompresses the seekable zstd stream found at [offset, offset + length) of
+// |src| into |dest|, which must come to |expected_size| bytes. Frames are
+// independent, so they are decompressed in parallel on the executor. Their
+// checksums, if any, are not verified: the decompressed APEX is verified
+// against the root digest in the CAPEX anyway.
+Result<void> DecompressZstdSeekable(borrowed_fd src, uint64_t offset,
+                                    uint64_t length, uint64_t expected_size,
+                                    borrowed_fd dest) {
+  auto frames = ReadZstdSeekTable(src, offset, length);
+  if (!frames.ok()) {
+    return frames.error();
+  }
+  const uint64_t size =
+      frames->empty()
+          ? 0
+          : frames->back().decompressed_offset + frames->back().decompressed_size;
+  if (size != expected_size) {
+    return Error() << "zstd seek table adds up to " << size
+                   << " bytes, expected " << expected_size;
+  }
+  // Allocate the whole file upfront, so that running out of space is detected
+  // before doing any work.
+  if (size > 0 && fallocate(dest.get(), 0, 0, size) != 0) {
+    if (errno != EOPNOTSUPP || ftruncate(dest.get(), size) != 0) {
+      return ErrnoError() << "Failed to allocate " << size << " bytes";
+    }
+  }
+
+  ApexdExecutor& executor = ApexdExecutor::GetInstance();
+  const size_t num_tasks = std::min(frames->size(), executor.GetNumThreads());
+  std::vector<std::future<Result<void>>> tasks;
+  tasks.reserve(num_tasks);
+  std::span<const ZstdFrame> all_frames(*frames);
+  for (size_t i = 0; i < num_tasks; i++) {
+    const size_t begin = all_frames.size() * i / num_tasks;
+    const size_t end = all_frames.size() * (i + 1) / num_tasks;
+    auto group = all_frames.subspan(begin, end - begin);
+    tasks.push_back(executor.Submit("DecompressZstdFrames", [=]() {
+      return DecompressZstdFrames(src, dest, group);
+    }));
+  }
+  Result<void> result;
+  for (auto& task : tasks) {
+    auto task_result = executor.Wait(std::move(task));
+    if (!task_result.ok() && result.ok()) {
+      result = std::move(task_result);
+    }
+  }
+  return result;
+}
+
+// Extracts the deflated (or stored) original_apex of |src| into |dest|.
+Result<void> ExtractOriginalApex(borrowed_fd src, const std::string& src_path,
+                                 borrowed_fd dest) {
+  // Open it as a zip file
+  ZipArchiveHandle handle;
+  int ret = OpenArchiveFd(src.get(), src_path.c_str(), &handle,
+                          /*assume_ownership=*/false);
+  if (ret < 0) {
+    return Error() << "Failed to open package " << src_path << ": "
+                   << ErrorCodeString(ret);
+  }
+  auto handle_guard =
+      android::base::make_scope_guard([&handle] { CloseArchive(handle); });
+
+  // Find the original apex file inside the zip and extract to dest
+  ZipEntry entry;
+  ret = FindEntry(handle, kCompressedApexFilename, &entry);
+  if (ret < 0) {
+    return Error() << "Could not find entry \"" << kCompressedApexFilename
+                   << "\" in package " << src_path << ": "
+                   << ErrorCodeString(ret);
+  }
+
+  ret = ExtractEntryToFile(handle, &entry, dest.get());
+  if (ret < 0) {
+    return Error() << ErrorCodeString(ret);
+  }
+  return {};
+}
+
 }  // namespace
 
 Result<ApexFile> ApexFile::Open(const std::string& path) {
@@ -92,6 +367,14 @@ Result<ApexFile> ApexFile::Open(const std::string& path) {
                         << "I/O error";
   }
 
+  // b/179211712 the stored path should be the realpath, otherwise the path we
+  // get by scanning the directory would be different from the path we get
+  // by reading /proc/mounts, if the apex file is on a symlink dir.
+  std::string realpath;
+  if (!android::base::Realpath(path, &realpath)) {
+    return ErrnoError() << "can't get realpath of " << path;
+  }
+
   ZipArchiveHandle handle;
   auto handle_guard =
       android::base::make_scope_guard([&handle] { CloseArchive(handle); });
@@ -103,8 +386,31 @@ Result<ApexFile> ApexFile::Open(const std::string& path) {
   }
 
   bool is_compressed = true;
-  ret = FindEntry(handle, kCompressedApexFilename, &entry);
-  if (ret < 0) {
+  std::optional<size_t> decompressed_size;
+  std::optional<uint32_t> stored_original_apex_offset;
+  std::optional<ZstdOriginalApex> zstd_original_apex;
+  if (FindEntry(handle, kCompressedApexFilename, &entry) >= 0) {
+    decompressed_size = entry.uncompressed_length;
+    if (entry.method == kCompressStored) {
+      stored_original_apex_offset = entry.offset;
+    }
+  } else if (FindEntry(handle, kZstdCompressedApexFilename, &entry) >= 0) {
+    if (entry.method != kCompressStored) {
+      return Error() << "\"" << kZstdCompressedApexFilename
+                     << "\" must be stored uncompressed in package " << path;
+    }
+    zstd_original_apex = ZstdOriginalApex{
+        .offset = entry.offset,
+        .length = entry.uncompressed_length,
+    };
+    auto size = GetZstdDecompressedSize(fd, zstd_original_apex->offset,
+                                        zstd_original_apex->length);
+    if (!size.ok()) {
+      return Error() << "Invalid \"" << kZstdCompressedApexFilename
+                     << "\" in package " << path << ": " << size.error();
+    }
+    decompressed_size = *size;
+  } else {
     is_compressed = false;
   }
 
@@ -165,16 +471,42 @@ Result<ApexFile> ApexFile::Open(const std::string& path) {
     return Error() << "Apex providing sharedlibs shouldn't be compressed";
   }
 
-  // b/179211712 the stored path should be the realpath, otherwise the path we
-  // get by scanning the directory would be different from the path we get
-  // by reading /proc/mounts, if the apex file is on a symlink dir.
-  std::string realpath;
-  if (!android::base::Realpath(path, &realpath)) {
-    return ErrnoError() << "can't get realpath of " << path;
+  struct stat st;
+  if (fstat(fd.get(), &st) != 0) {
+    return ErrnoError() << "Failed to stat " << path;
   }
+  auto file = std::make_shared<FileState>();
+  file->fd = std::make_shared<const unique_fd>(std::move(fd));
+  file->dev = st.st_dev;
+  file->ino = st.st_ino;
+  return ApexFile(realpath, std::move(file), image_offset, image_size,
+                  std::move(*manifest), pubkey, fs_type, is_compressed,
+                  decompressed_size, stored_original_apex_offset,
+                  zstd_original_apex);
+}
 
-  return ApexFile(realpath, image_offset, image_size, std::move(*manifest),
-                  pubkey, fs_type, is_compressed);
+ApexFile::HeldFd ApexFile::GetFd() const {
+  std::lock_guard lock(file_->mutex);
+  if (file_->fd == nullptr) {
+    unique_fd fd(TEMP_FAILURE_RETRY(
+        open(GetPath().c_str(), O_RDONLY | O_BINARY | O_CLOEXEC)));
+    struct stat st;
+    if (fd.get() == -1 || fstat(fd.get(), &st) != 0) {
+      PLOG(ERROR) << "Failed to reopen " << GetPath();
+      return HeldFd(nullptr);
+    }
+    if (st.st_dev != file_->dev || st.st_ino != file_->ino) {
+      LOG(ERROR) << GetPath() << " was replaced since it was opened";
+      return HeldFd(nullptr);
+    }
+    file_->fd = std::make_shared<const unique_fd>(std::move(fd));
+  }
+  return HeldFd(file_->fd);
+}
+
+void ApexFile::ReleaseFd() const {
+  std::lock_guard lock(file_->mutex);
+  file_->fd.reset();
 }
 
 // AVB-related code.
@@ -182,6 +514,9 @@ Result<ApexFile> ApexFile::Open(const std::string& path) {
 namespace {
 
 static constexpr int kVbMetaMaxSize = 64 * 1024;
+// Size of the read at the end of the image that is expected to cover both the
+// AVB footer and vbmeta. See ReadAvbTail.
+static constexpr int kAvbTailReadSize = 16 * 1024;
 
 std::string GetSalt(const AvbHashtreeDescriptor& desc,
                     const uint8_t* trailing_data) {
@@ -198,34 +533,59 @@ std::string GetDigest(const AvbHashtreeDescriptor& desc,
   return BytesToHex(desc_digest, desc.root_digest_len);
 }
 
-Result<std::unique_ptr<AvbFooter>> GetAvbFooter(const ApexFile& apex,
-                                                const unique_fd& fd) {
-  std::array<uint8_t, AVB_FOOTER_SIZE> footer_data;
-  auto footer = std::make_unique<AvbFooter>();
+// AVB footer and vbmeta of an image, read from the tail of the image.
+struct AvbTail {
+  AvbFooter footer;
+  std::unique_ptr<uint8_t[]> vbmeta;
+};
 
+// Reads the AVB footer and the vbmeta it points to. avbtool places vbmeta right
+// before the last block of the image (which holds the footer), so a single read
+// of the last kAvbTailReadSize bytes almost always covers both. A second read
+// is only issued if vbmeta turns out to be outside of that window.
+Result<AvbTail> ReadAvbTail(const ApexFile& apex, borrowed_fd fd) {
   // The AVB footer is located in the last part of the image
   if (!apex.GetImageOffset() || !apex.GetImageSize()) {
     return Error() << "Cannot check avb footer without image offset and size";
   }
-  off_t offset = apex.GetImageSize().value() + apex.GetImageOffset().value() -
-                 AVB_FOOTER_SIZE;
-  int ret = lseek(fd, offset, SEEK_SET);
-  if (ret == -1) {
-    return ErrnoError() << "Couldn't seek to AVB footer";
-  }
-
-  ret = read(fd, footer_data.data(), AVB_FOOTER_SIZE);
-  if (ret != AVB_FOOTER_SIZE) {
+  const uint64_t image_offset = apex.GetImageOffset().value();
+  const uint64_t image_size = apex.GetImageSize().value();
+  if (image_size < AVB_FOOTER_SIZE) {
+    return Error() << "Image is too small to contain an AVB footer";
+  }
+  const uint64_t tail_size =
+      std::min(image_size, static_cast<uint64_t>(kAvbTailReadSize));
+  const uint64_t tail_offset = image_size - tail_size;
+  std::vector<uint8_t> tail(tail_size);
+  if (!ReadFullyAtOffset(fd, tail.data(), tail_size,
+                         image_offset + tail_offset)) {
     return ErrnoError() << "Couldn't read AVB footer";
   }
 
-  if (!avb_footer_validate_and_byteswap((const AvbFooter*)footer_data.data(),
-                                        footer.get())) {
+  AvbTail result;
+  if (!avb_footer_validate_and_byteswap(
+          (const AvbFooter*)(tail.data() + tail_size - AVB_FOOTER_SIZE),
+          &result.footer)) {
     return Error() << "AVB footer verification failed.";
   }
-
   LOG(VERBOSE) << "AVB footer verification successful.";
-  return footer;
+
+  const AvbFooter& footer = result.footer;
+  if (footer.vbmeta_size > kVbMetaMaxSize) {
+    return Errorf("VbMeta size in footer exceeds kVbMetaMaxSize.");
+  }
+  result.vbmeta.reset(new uint8_t[footer.vbmeta_size]);
+  if (footer.vbmeta_offset >= tail_offset &&
+      footer.vbmeta_offset <= image_size &&
+      footer.vbmeta_size <= image_size - footer.vbmeta_offset) {
+    memcpy(result.vbmeta.get(),
+           tail.data() + (footer.vbmeta_offset - tail_offset),
+           footer.vbmeta_size);
+  } else if (!ReadFullyAtOffset(fd, result.vbmeta.get(), footer.vbmeta_size,
+                                image_offset + footer.vbmeta_offset)) {
+    return ErrnoError() << "Couldn't read AVB meta-data";
+  }
+  return result;
 }
 
 bool CompareKeys(const uint8_t* key, size_t length,
@@ -264,27 +624,10 @@ Result<std::span<const uint8_t>> VerifyVbMetaSignature(const ApexFile& apex,
   return std::span<const uint8_t>(pk, pk_len);
 }
 
-Result<std::unique_ptr<uint8_t[]>> VerifyVbMeta(const ApexFile& apex,
-                                                const unique_fd& fd,
-                                                const AvbFooter& footer,
-                                                const std::string& public_key) {
-  if (footer.vbmeta_size > kVbMetaMaxSize) {
-    return Errorf("VbMeta size in footer exceeds kVbMetaMaxSize.");
-  }
-
-  if (!apex.GetImageOffset()) {
-    return Error() << "Cannot check VbMeta size without image offset";
-  }
-
-  off_t offset = apex.GetImageOffset().value() + footer.vbmeta_offset;
-  std::unique_ptr<uint8_t[]> vbmeta_buf(new uint8_t[footer.vbmeta_size]);
-
-  if (!ReadFullyAtOffset(fd, vbmeta_buf.get(), footer.vbmeta_size, offset)) {
-    return ErrnoError() << "Couldn't read AVB meta-data";
-  }
-
-  Result<std::span<const uint8_t>> st =
-      VerifyVbMetaSignature(apex, vbmeta_buf.get(), footer.vbmeta_size);
+Result<void> VerifyVbMeta(const ApexFile& apex, const AvbTail& tail,
+                          const std::string& public_key) {
+  Result<std::span<const uint8_t>> st = VerifyVbMetaSignature(
+      apex, tail.vbmeta.get(), tail.footer.vbmeta_size);
   if (!st.ok()) {
     return st.error();
   }
@@ -294,7 +637,7 @@ Result<std::unique_ptr<uint8_t[]>> VerifyVbMeta(const ApexFile& apex,
                    << "public key doesn't match the pre-installed one";
   }
 
-  return vbmeta_buf;
+  return {};
 }
 
 Result<const AvbHashtreeDescriptor*> FindDescriptor(uint8_t* vbmeta_data,
@@ -343,6 +686,15 @@ Result<std::unique_ptr<AvbHashtreeDescriptor>> VerifyDescriptor(
   return verified_desc;
 }
 
+ApexVerityData CopyVerityData(const ApexVerityData& data) {
+  return ApexVerityData{
+      .desc = std::make_unique<AvbHashtreeDescriptor>(*data.desc),
+      .hash_algorithm = data.hash_algorithm,
+      .salt = data.salt,
+      .root_digest = data.root_digest,
+  };
+}
+
 }  // namespace
 
 Result<ApexVerityData> ApexFile::VerifyApexVerity(
@@ -351,26 +703,39 @@ Result<ApexVerityData> ApexFile::VerifyApexVerity(
     return Error() << "Cannot verify ApexVerity of compressed APEX";
   }
 
-  ApexVerityData verity_data;
+  HeldFd fd = GetFd();
 
-  unique_fd fd(open(GetPath().c_str(), O_RDONLY | O_CLOEXEC));
-  if (fd.get() == -1) {
-    return ErrnoError() << "Failed to open " << GetPath();
+  struct stat st;
+  if (fstat(fd.get(), &st) != 0) {
+    return ErrnoError() << "Failed to stat " << GetPath();
   }
+  {
+    std::lock_guard lock(verity_cache_->mutex);
+    auto it = verity_cache_->entries.find(public_key);
+    if (it != verity_cache_->entries.end()) {
+      if (it->second.size == st.st_size &&
+          it->second.mtime.tv_sec == st.st_mtim.tv_sec &&
+          it->second.mtime.tv_nsec == st.st_mtim.tv_nsec) {
+        return CopyVerityData(it->second.data);
+      }
+      // The file was modified in place since it was verified.
+      verity_cache_->entries.erase(it);
+    }
+  }
+
+  ApexVerityData verity_data;
 
-  Result<std::unique_ptr<AvbFooter>> footer = GetAvbFooter(*this, fd);
-  if (!footer.ok()) {
-    return footer.error();
+  Result<AvbTail> tail = ReadAvbTail(*this, fd);
+  if (!tail.ok()) {
+    return tail.error();
   }
 
-  Result<std::unique_ptr<uint8_t[]>> vbmeta_data =
-      VerifyVbMeta(*this, fd, **footer, public_key);
-  if (!vbmeta_data.ok()) {
-    return vbmeta_data.error();
+  if (auto verified = VerifyVbMeta(*this, *tail, public_key); !verified.ok()) {
+    return verified.error();
   }
 
   Result<const AvbHashtreeDescriptor*> descriptor =
-      FindDescriptor(vbmeta_data->get(), (*footer)->vbmeta_size);
+      FindDescriptor(tail->vbmeta.get(), tail->footer.vbmeta_size);
   if (!descriptor.ok()) {
     return descriptor.error();
   }
@@ -390,6 +755,11 @@ Result<ApexVerityData> ApexFile::VerifyApexVerity(
   verity_data.salt = GetSalt(*verity_data.desc, trailing_data);
   verity_data.root_digest = GetDigest(*verity_data.desc, trailing_data);
 
+  std::lock_guard lock(verity_cache_->mutex);
+  verity_cache_->entries.insert_or_assign(
+      public_key, VerifiedVerityData{.data = CopyVerityData(verity_data),
+                                     .size = st.st_size,
+                                     .mtime = st.st_mtim});
   return verity_data;
 }
 
@@ -403,31 +773,6 @@ Result<void> ApexFile::Decompress(const std::string& dest_path) const {
     return ErrnoError() << "Cannot decompress an uncompressed APEX";
   }
 
-  // Get file descriptor of the compressed apex file
-  unique_fd src_fd(open(src_path.c_str(), O_RDONLY | O_CLOEXEC));
-  if (src_fd.get() == -1) {
-    return ErrnoError() << "Failed to open compressed APEX " << GetPath();
-  }
-
-  // Open it as a zip file
-  ZipArchiveHandle handle;
-  int ret = OpenArchiveFd(src_fd.get(), src_path.c_str(), &handle, false);
-  if (ret < 0) {
-    return Error() << "Failed to open package " << src_path << ": "
-                   << ErrorCodeString(ret);
-  }
-  auto handle_guard =
-      android::base::make_scope_guard([&handle] { CloseArchive(handle); });
-
-  // Find the original apex file inside the zip and extract to dest
-  ZipEntry entry;
-  ret = FindEntry(handle, kCompressedApexFilename, &entry);
-  if (ret < 0) {
-    return Error() << "Could not find entry \"" << kCompressedApexFilename
-                   << "\" in package " << src_path << ": "
-                   << ErrorCodeString(ret);
-  }
-
   // Open destination file descriptor
   unique_fd dest_fd(
       open(dest_path.c_str(), O_WRONLY | O_CLOEXEC | O_CREAT | O_EXCL, 0644));
@@ -440,19 +785,132 @@ Result<void> ApexFile::Decompress(const std::string& dest_path) const {
   auto decompressed_guard = android::base::make_scope_guard(
       [&dest_path] { RemoveFileIfExists(dest_path); });
 
-  // Extract the original_apex to dest_path
-  ret = ExtractEntryToFile(handle, &entry, dest_fd.get());
-  if (ret < 0) {
+  const auto time_started = std::chrono::steady_clock::now();
+  Result<void> result;
+  if (zstd_original_apex_.has_value()) {
+    result = DecompressZstdSeekable(
+        GetFd(), zstd_original_apex_->offset, zstd_original_apex_->length,
+        decompressed_size_.value_or(0), dest_fd);
+  } else {
+    result = ExtractOriginalApex(GetFd(), src_path, dest_fd);
+  }
+  if (!result.ok()) {
     return Error() << "Could not decompress to file " << dest_path << " "
-                   << ErrorCodeString(ret);
+                   << result.error();
   }
 
   // Verification complete. Accept the decompressed file
   decompressed_guard.Disable();
-  LOG(VERBOSE) << "Decompressed " << src_path << " to " << dest_path;
+  const auto elapsed_us =
+      std::chrono::duration_cast<std::chrono::microseconds>(
+          std::chrono::steady_clock::now() - time_started)
+          .count();
+  const uint64_t size = decompressed_size_.value_or(0);
+  LOG(INFO) << "Decompressed " << src_path << " to " << dest_path << " in "
+            << elapsed_us / 1000 << "ms ("
+            << (elapsed_us > 0 ? size / elapsed_us : 0) << " MB/s)";
 
   return {};
 }
 
+Result<ApexFile> ApexFile::OpenStoredOriginalApex() const {
+  const std::string& path = GetPath();
+  if (!stored_original_apex_offset_.has_value() ||
+      !decompressed_size_.has_value()) {
+    return Error() << "\"" << kCompressedApexFilename
+                   << "\" is not stored uncompressed in " << path;
+  }
+  const uint32_t base = *stored_original_apex_offset_;
+
+  // original_apex is a zip archive of its own, starting at |base|.
+  // The archive reads from the descriptor until it is closed.
+  HeldFd fd = GetFd();
+  ZipArchiveHandle handle;
+  auto handle_guard =
+      android::base::make_scope_guard([&handle] { CloseArchive(handle); });
+  int ret = OpenArchiveFdRange(fd.get(), path.c_str(), &handle,
+                               *decompressed_size_, base,
+                               /*assume_ownership=*/false);
+  if (ret < 0) {
+    return Error() << "Failed to open \"" << kCompressedApexFilename
+                   << "\" in package " << path << ": " << ErrorCodeString(ret);
+  }
+
+  ZipEntry entry;
+  ret = FindEntry(handle, kImageFilename, &entry);
+  if (ret < 0) {
+    return Error() << "Could not find entry \"" << kImageFilename << "\" in \""
+                   << kCompressedApexFilename << "\" of package " << path
+                   << ": " << ErrorCodeString(ret);
+  }
+  if (entry.method != kCompressStored) {
+    return Error() << "\"" << kImageFilename << "\" is compressed in \""
+                   << kCompressedApexFilename << "\" of package " << path;
+  }
+  // Offsets of entries are relative to the start of original_apex.
+  const uint64_t image_offset = static_cast<uint64_t>(base) + entry.offset;
+  if (image_offset > std::numeric_limits<uint32_t>::max()) {
+    return Error() << "Nested image of " << path << " is out of range";
+  }
+  // Loop devices are configured for direct I/O with 4K blocks.
+  if (image_offset % 4096 != 0) {
+    return Error() << "Nested image of " << path << " is not 4K-aligned";
+  }
+  const size_t image_size = entry.uncompressed_length;
+
+  auto fs_type = RetrieveFsType(GetFd(), image_offset);
+  if (!fs_type.ok()) {
+    return Error() << "Failed to retrieve filesystem type for nested image of "
+                   << path << ": " << fs_type.error();
+  }
+
+  ret = FindEntry(handle, kManifestFilenamePb, &entry);
+  if (ret < 0) {
+    return Error() << "Could not find entry \"" << kManifestFilenamePb
+                   << "\" in \"" << kCompressedApexFilename << "\" of package "
+                   << path << ": " << ErrorCodeString(ret);
+  }
+  std::string manifest_content(entry.uncompressed_length, '\0');
+  ret = ExtractToMemory(handle, &entry,
+                        reinterpret_cast<uint8_t*>(manifest_content.data()),
+                        manifest_content.size());
+  if (ret != 0) {
+    return Error() << "Failed to extract nested manifest from package " << path
+                   << ": " << ErrorCodeString(ret);
+  }
+  Result<ApexManifest> manifest = ParseManifest(manifest_content);
+  if (!manifest.ok()) {
+    return manifest.error();
+  }
+
+  std::string pubkey;
+  ret = FindEntry(handle, kBundledPublicKeyFilename, &entry);
+  if (ret >= 0) {
+    pubkey.resize(entry.uncompressed_length, '\0');
+    ret = ExtractToMemory(handle, &entry,
+                          reinterpret_cast<uint8_t*>(pubkey.data()),
+                          pubkey.size());
+    if (ret != 0) {
+      return Error() << "Failed to extract nested public key from package "
+                     << path << ": " << ErrorCodeString(ret);
+    }
+  }
+
+  // Shares the file descriptor, but not the verity cache: it describes a
+  // different image.
+  ApexFile original = *this;
+  original.verity_cache_ = std::make_shared<VerityCache>();
+  original.image_offset_ = static_cast<uint32_t>(image_offset);
+  original.image_size_ = image_size;
+  original.manifest_ = std::move(*manifest);
+  original.apex_pubkey_ = std::move(pubkey);
+  original.fs_type_ = std::move(*fs_type);
+  original.is_compressed_ = false;
+  original.decompressed_size_.reset();
+  original.stored_original_apex_offset_.reset();
+  original.zstd_original_apex_.reset();
+  return original;
+}
+
 }  // namespace apex
 }  // namespace android
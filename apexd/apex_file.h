@@ -17,12 +17,17 @@
 #ifndef ANDROID_APEXD_APEX_FILE_H_
 #define ANDROID_APEXD_APEX_FILE_H_
 
+#include <map>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <vector>
 
 #include <android-base/result.h>
+#include <android-base/thread_annotations.h>
+#include <android-base/unique_fd.h>
 #include <libavb/libavb.h>
+#include <sys/types.h>
 
 #include "apex_manifest.h"
 
@@ -41,9 +46,27 @@ struct ApexVerityData {
 // the content.
 class ApexFile {
  public:
+  // Descriptor returned by GetFd(). Keeps it open for as long as it lives,
+  // even if ReleaseFd() is called in the meantime.
+  class HeldFd {
+   public:
+    int get() const { return fd_ != nullptr ? fd_->get() : -1; }
+    operator android::base::borrowed_fd() const { return get(); }
+
+   private:
+    friend class ApexFile;
+    explicit HeldFd(std::shared_ptr<const android::base::unique_fd> fd)
+        : fd_(std::move(fd)) {}
+    std::shared_ptr<const android::base::unique_fd> fd_;
+  };
+
   static android::base::Result<ApexFile> Open(const std::string& path);
 
   ApexFile() = delete;
+  // Copies are cheap: they share the underlying file descriptor and the
+  // verity cache with the original.
+  ApexFile(const ApexFile&) = default;
+  ApexFile& operator=(const ApexFile&) = default;
   ApexFile(ApexFile&&) = default;
   ApexFile& operator=(ApexFile&&) = default;
 
@@ -55,32 +78,108 @@ class ApexFile {
   const ::apex::proto::ApexManifest& GetManifest() const { return manifest_; }
   const std::string& GetBundledPublicKey() const { return apex_pubkey_; }
   const std::optional<std::string>& GetFsType() const { return fs_type_; }
+  // Returns a read-only descriptor of the file this ApexFile was opened from,
+  // which guarantees that all reads go to the same file even if |GetPath()| is
+  // replaced in the meantime. Callers must only use positional reads (e.g.
+  // pread) on it, since it can be shared between threads, and must keep the
+  // returned HeldFd for as long as they use it.
+  //
+  // After ReleaseFd(), the file is opened again by path. If |GetPath()| no
+  // longer refers to the same file, the returned descriptor is -1, so that
+  // reads fail instead of going to a different file.
+  HeldFd GetFd() const;
+  // Closes the descriptor kept since Open(), once no HeldFd uses it anymore,
+  // for this ApexFile and all its copies. For long-lived ApexFiles that would
+  // otherwise keep a descriptor open for every APEX on the device.
+  void ReleaseFd() const;
+  // Verifies the vbmeta of this APEX against |public_key| and returns the
+  // hashtree descriptor it contains. Successful results are memoized per
+  // public key for as long as the underlying file is unchanged, so that
+  // repeated calls during the same activation don't redo the I/O and the
+  // signature check.
   android::base::Result<ApexVerityData> VerifyApexVerity(
       const std::string& public_key) const;
   bool IsCompressed() const { return is_compressed_; }
+  // Size of the APEX that Decompress() produces. Only set for compressed
+  // APEXes.
+  const std::optional<size_t>& GetDecompressedSize() const {
+    return decompressed_size_;
+  }
   android::base::Result<void> Decompress(const std::string& output_path) const;
+  // Whether this compressed APEX stores original_apex without compression, so
+  // that its payload can be mounted in place instead of being decompressed.
+  bool HasStoredOriginalApex() const {
+    return stored_original_apex_offset_.has_value();
+  }
+  // Opens the original_apex stored in this compressed APEX. The returned
+  // ApexFile has the same path and reads from the same file, with its image
+  // pointing at the apex_payload.img nested in original_apex.
+  android::base::Result<ApexFile> OpenStoredOriginalApex() const;
 
  private:
-  ApexFile(const std::string& apex_path,
+  // Location of original_apex.zst, which replaces original_apex in compressed
+  // APEXes compressed with zstd.
+  struct ZstdOriginalApex {
+    uint32_t offset;
+    uint64_t length;
+  };
+
+  struct VerifiedVerityData {
+    ApexVerityData data;
+    // Size and mtime of the file at the time |data| was verified.
+    off_t size;
+    struct timespec mtime;
+  };
+
+  struct VerityCache {
+    std::mutex mutex;
+    // Keyed by the public key |data| was verified with.
+    std::map<std::string, VerifiedVerityData> entries GUARDED_BY(mutex);
+  };
+
+  // The file this ApexFile was opened from, shared between copies.
+  struct FileState {
+    std::mutex mutex;
+    // Null after ReleaseFd(), until GetFd() opens the file again.
+    std::shared_ptr<const android::base::unique_fd> fd GUARDED_BY(mutex);
+    // Identify the file, to tell whether |GetPath()| still refers to it.
+    dev_t dev;
+    ino_t ino;
+  };
+
+  ApexFile(const std::string& apex_path, std::shared_ptr<FileState> file,
            const std::optional<uint32_t>& image_offset,
            const std::optional<size_t>& image_size,
            ::apex::proto::ApexManifest manifest, const std::string& apex_pubkey,
-           const std::optional<std::string>& fs_type, bool is_compressed)
+           const std::optional<std::string>& fs_type, bool is_compressed,
+           const std::optional<size_t>& decompressed_size,
+           const std::optional<uint32_t>& stored_original_apex_offset,
+           const std::optional<ZstdOriginalApex>& zstd_original_apex)
       : apex_path_(apex_path),
+        file_(std::move(file)),
+        verity_cache_(std::make_shared<VerityCache>()),
         image_offset_(image_offset),
         image_size_(image_size),
         manifest_(std::move(manifest)),
         apex_pubkey_(apex_pubkey),
         fs_type_(fs_type),
-        is_compressed_(is_compressed) {}
+        is_compressed_(is_compressed),
+        decompressed_size_(decompressed_size),
+        stored_original_apex_offset_(stored_original_apex_offset),
+        zstd_original_apex_(zstd_original_apex) {}
 
   std::string apex_path_;
+  std::shared_ptr<FileState> file_;
+  std::shared_ptr<VerityCache> verity_cache_;
   std::optional<uint32_t> image_offset_;
   std::optional<size_t> image_size_;
   ::apex::proto::ApexManifest manifest_;
   std::string apex_pubkey_;
   std::optional<std::string> fs_type_;
   bool is_compressed_;
+  std::optional<size_t> decompressed_size_;
+  std::optional<uint32_t> stored_original_apex_offset_;
+  std::optional<ZstdOriginalApex> zstd_original_apex_;
 };
 
 }  // namespace apex
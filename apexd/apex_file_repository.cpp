@@ -23,10 +23,15 @@
 #include <android-base/strings.h>
 #include <microdroid/metadata.h>
 
+#include <algorithm>
+#include <atomic>
+#include <future>
+#include <optional>
 #include <unordered_map>
 
 #include "apex_constants.h"
 #include "apex_file.h"
+#include "apexd_executor.h"
 #include "apexd_utils.h"
 #include "apexd_verity.h"
 
@@ -56,6 +61,48 @@ std::string GetApexSelectFilenameFromProp(
   return "";
 }
 
+namespace {
+
+// Opens all |paths| using up to |max_threads| threads. Results are returned in
+// the same order as |paths|, so that callers can process them exactly as if
+// they were opened one after another.
+std::vector<Result<ApexFile>> OpenApexFiles(
+    const std::vector<std::string>& paths, size_t max_threads) {
+  std::vector<std::optional<Result<ApexFile>>> results(paths.size());
+  std::atomic<size_t> next_index = 0;
+  auto worker = [&]() {
+    while (true) {
+      size_t i = next_index.fetch_add(1);
+      if (i >= paths.size()) {
+        break;
+      }
+      results[i].emplace(ApexFile::Open(paths[i]));
+    }
+  };
+
+  ApexdExecutor& executor = ApexdExecutor::GetInstance();
+  size_t worker_num = std::min(max_threads, paths.size());
+  std::vector<std::future<void>> futures;
+  futures.reserve(worker_num);
+  // The calling thread is one of the workers.
+  for (size_t i = 1; i < worker_num; i++) {
+    futures.push_back(executor.Submit("OpenApexFiles", worker));
+  }
+  worker();
+  for (auto& future : futures) {
+    executor.Wait(std::move(future));
+  }
+
+  std::vector<Result<ApexFile>> ret;
+  ret.reserve(paths.size());
+  for (auto& result : results) {
+    ret.push_back(std::move(*result));
+  }
+  return ret;
+}
+
+}  // namespace
+
 Result<void> ApexFileRepository::ScanBuiltInDir(const std::string& dir) {
   LOG(INFO) << "Scanning " << dir << " for pre-installed ApexFiles";
   if (access(dir.c_str(), F_OK) != 0 && errno == ENOENT) {
@@ -69,10 +116,22 @@ Result<void> ApexFileRepository::ScanBuiltInDir(const std::string& dir) {
     return all_apex_files.error();
   }
 
-  // TODO(b/179248390): scan parallelly if possible
-  for (const auto& file : *all_apex_files) {
+  // Opening APEX files is what takes time, so it is done in parallel. The
+  // results are then merged into the store sequentially in a fixed order, so
+  // that duplicate detection, multi-install selection and error reporting
+  // don't depend on the order in which the files were opened.
+  std::sort(all_apex_files->begin(), all_apex_files->end());
+  size_t threads = scan_threads_;
+  if (threads == 0) {
+    threads = ApexdExecutor::GetInstance().GetNumThreads();
+  }
+  std::vector<Result<ApexFile>> opened_apex_files =
+      OpenApexFiles(*all_apex_files, threads);
+
+  for (size_t i = 0; i < all_apex_files->size(); i++) {
+    const std::string& file = (*all_apex_files)[i];
     LOG(INFO) << "Found pre-installed APEX " << file;
-    Result<ApexFile> apex_file = ApexFile::Open(file);
+    Result<ApexFile>& apex_file = opened_apex_files[i];
     if (!apex_file.ok()) {
       return Error() << "Failed to open " << file << " : " << apex_file.error();
     }
@@ -514,5 +573,14 @@ ApexFileRef ApexFileRepository::GetPreInstalledApex(
   return std::cref(it->second);
 }
 
+void ApexFileRepository::ReleaseFds() const {
+  for (const auto& [_, apex] : pre_installed_store_) {
+    apex.ReleaseFd();
+  }
+  for (const auto& [_, apex] : data_store_) {
+    apex.ReleaseFd();
+  }
+}
+
 }  // namespace apex
 }  // namespace android
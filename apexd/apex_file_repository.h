@@ -152,6 +152,17 @@ class ApexFileRepository final {
   // using |HasDataVersion| function.
   ApexFileRef GetDataApex(const std::string& name) const;
 
+  // Sets the maximum number of threads used to open pre-installed APEX files.
+  // 0 (the default) means the size of the ApexdExecutor, 1 means opening them
+  // sequentially. Exposed for testing.
+  void SetScanThreads(size_t threads) { scan_threads_ = threads; }
+
+  // Closes the descriptors kept open by the ApexFiles in this repository.
+  // They are opened again by path on the next GetFd(). Called once APEXes are
+  // activated, so that apexd doesn't keep a descriptor per APEX open for the
+  // rest of the boot.
+  void ReleaseFds() const;
+
   // Clears ApexFileRepostiry.
   // Only use in tests.
   void Reset(const std::string& decompression_dir = kApexDecompressedDir) {
@@ -196,6 +207,9 @@ class ApexFileRepository final {
   // decompressed or not
   std::string decompression_dir_;
 
+  // Maximum number of threads used by ScanBuiltInDir(). See SetScanThreads().
+  size_t scan_threads_ = 0;
+
   // Disk path where block apexes are read from. AddBlockApex() sets this.
   std::optional<std::string> block_disk_path_;
 
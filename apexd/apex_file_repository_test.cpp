@@ -20,6 +20,7 @@
 #include <android-base/logging.h>
 #include <android-base/properties.h>
 #include <android-base/stringprintf.h>
+#include <android-base/strings.h>
 #include <errno.h>
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
@@ -27,6 +28,7 @@
 #include <sys/stat.h>
 
 #include <filesystem>
+#include <iterator>
 #include <string>
 
 #include "apex_file.h"
@@ -162,6 +164,81 @@ TEST(ApexFileRepositoryTest, InitializeSameNameDifferentPathAborts) {
       "");
 }
 
+TEST(ApexFileRepositoryTest, ParallelScanMatchesSequentialScan) {
+  // Prepare a directory with lots of APEXes, including duplicates of the same
+  // module, so that the outcome depends on the order in which they are merged.
+  TemporaryDir built_in_dir, decompression_dir;
+  const std::vector<std::string> test_apexes = {
+      "apex.apexd_test.apex",
+      "apex.apexd_test_different_app.apex",
+      "com.android.apex.compressed.v1.capex",
+      "apex.apexd_test_nocode.apex",
+      "com.android.apex.compressed.v2.capex",
+      "apex.apexd_test_v2.apex",
+  };
+  for (size_t i = 0; i < 96; i++) {
+    const std::string& name = test_apexes[(i * 7) % test_apexes.size()];
+    const char* suffix = android::base::EndsWith(name, ".capex")
+                             ? kCompressedApexPackageSuffix
+                             : kApexPackageSuffix;
+    fs::copy(GetTestFile(name),
+             StringPrintf("%s/test_%02zu%s", built_in_dir.path, i, suffix));
+  }
+
+  ApexFileRepository sequential(decompression_dir.path,
+                                /* ignore_duplicate_apex_definitions= */ true);
+  sequential.SetScanThreads(1);
+  ASSERT_TRUE(IsOk(sequential.AddPreInstalledApex({built_in_dir.path})));
+
+  ApexFileRepository parallel(decompression_dir.path,
+                              /* ignore_duplicate_apex_definitions= */ true);
+  parallel.SetScanThreads(8);
+  ASSERT_TRUE(IsOk(parallel.AddPreInstalledApex({built_in_dir.path})));
+
+  auto sequential_apexes = sequential.GetPreInstalledApexFiles();
+  auto parallel_apexes = parallel.GetPreInstalledApexFiles();
+  ASSERT_EQ(3u, sequential_apexes.size());
+  ASSERT_EQ(sequential_apexes.size(), parallel_apexes.size());
+  for (const ApexFile& apex : sequential_apexes) {
+    const std::string& name = apex.GetManifest().name();
+    ASSERT_TRUE(parallel.HasPreInstalledVersion(name)) << name;
+    ApexFileRef other = parallel.GetPreInstalledApex(name);
+    ASSERT_THAT(other.get(), ApexFileEq(ByRef(apex)));
+    ASSERT_EQ(apex.GetManifest().version(),
+              other.get().GetManifest().version());
+  }
+}
+
+TEST(ApexFileRepositoryTest, ParallelScanReportsSameErrorAsSequentialScan) {
+  TemporaryDir built_in_dir;
+  for (size_t i = 0; i < 32; i++) {
+    fs::copy(GetTestFile("apex.apexd_test.apex"),
+             StringPrintf("%s/test_%02zu.apex", built_in_dir.path, i));
+  }
+  // Two broken APEXes; the first one in the directory order must be reported.
+  fs::copy(GetTestFile("com.android.apex.compressed.v1_without_apex.capex"),
+           StringPrintf("%s/test_07_broken.capex", built_in_dir.path));
+  fs::copy(GetTestFile("com.android.apex.compressed.v1_without_apex.capex"),
+           StringPrintf("%s/test_23_broken.capex", built_in_dir.path));
+
+  ApexFileRepository sequential(/* enforce_multi_install_partition= */ false,
+                                /* multi_install_select_prop_prefixes= */ {});
+  sequential.SetScanThreads(1);
+  auto sequential_result = sequential.AddPreInstalledApex({built_in_dir.path});
+  ASSERT_FALSE(IsOk(sequential_result));
+
+  ApexFileRepository parallel(/* enforce_multi_install_partition= */ false,
+                              /* multi_install_select_prop_prefixes= */ {});
+  parallel.SetScanThreads(8);
+  auto parallel_result = parallel.AddPreInstalledApex({built_in_dir.path});
+  ASSERT_FALSE(IsOk(parallel_result));
+
+  ASSERT_EQ(sequential_result.error().message(),
+            parallel_result.error().message());
+  ASSERT_THAT(parallel_result.error().message(),
+              ::testing::HasSubstr("test_07_broken.capex"));
+}
+
 TEST(ApexFileRepositoryTest, InitializeMultiInstalledSuccess) {
   // Prepare test data.
   TemporaryDir td;
@@ -411,6 +488,30 @@ TEST(ApexFileRepositoryTest, AddAndGetDataApex) {
               UnorderedElementsAre(ApexFileEq(ByRef(*normal_apex))));
 }
 
+TEST(ApexFileRepositoryTest, ReleaseFdsClosesDescriptorsOfAllApexes) {
+  TemporaryDir built_in_dir, data_dir, decompression_dir;
+  fs::copy(GetTestFile("apex.apexd_test.apex"), built_in_dir.path);
+  fs::copy(GetTestFile("apex.apexd_test_v2.apex"), data_dir.path);
+
+  ApexFileRepository instance(decompression_dir.path);
+  ASSERT_TRUE(IsOk(instance.AddPreInstalledApex({built_in_dir.path})));
+  ASSERT_TRUE(IsOk(instance.AddDataApex(data_dir.path)));
+
+  auto count_fds = [] {
+    auto it = fs::directory_iterator("/proc/self/fd");
+    return std::distance(fs::begin(it), fs::end(it));
+  };
+  const auto fds_before_release = count_fds();
+  instance.ReleaseFds();
+  ASSERT_EQ(fds_before_release - 2, count_fds());
+
+  // The APEXes can still be read afterwards.
+  const ApexFile& data_apex =
+      instance.GetDataApex("com.android.apex.test_package");
+  ASSERT_TRUE(
+      IsOk(data_apex.VerifyApexVerity(data_apex.GetBundledPublicKey())));
+}
+
 TEST(ApexFileRepositoryTest, AddDataApexIgnoreCompressedApex) {
   // Prepare test data.
   TemporaryDir data_dir, decompression_dir;
@@ -14,6 +14,11 @@
  * limitations under the License.
  */
 
+#include <fcntl.h>
+
+#include <cstring>
+#include <filesystem>
+#include <fstream>
 #include <limits>
 #include <string>
 
@@ -33,6 +38,8 @@
 using android::base::GetExecutableDirectory;
 using android::base::Result;
 
+namespace fs = std::filesystem;
+
 static const std::string kTestDataDir = GetExecutableDirectory() + "/";
 
 namespace android {
@@ -146,6 +153,35 @@ TEST_P(ApexFileTest, VerifyApexVerityWrongKey) {
   ASSERT_FALSE(verity_or.ok());
 }
 
+TEST_P(ApexFileTest, VerifyApexVerityIsMemoized) {
+  TemporaryDir tmp_dir;
+  const std::string file_path = std::string(tmp_dir.path) + "/test.apex";
+  ASSERT_TRUE(fs::copy_file(kTestDataDir + GetParam().prefix + ".apex",
+                            file_path));
+  Result<ApexFile> apex_file = ApexFile::Open(file_path);
+  ASSERT_RESULT_OK(apex_file);
+
+  auto first = apex_file->VerifyApexVerity(apex_file->GetBundledPublicKey());
+  ASSERT_RESULT_OK(first);
+  auto second = apex_file->VerifyApexVerity(apex_file->GetBundledPublicKey());
+  ASSERT_RESULT_OK(second);
+  // Each caller gets its own copy of the descriptor.
+  ASSERT_NE(first->desc.get(), second->desc.get());
+  ASSERT_EQ(0, memcmp(first->desc.get(), second->desc.get(),
+                      sizeof(AvbHashtreeDescriptor)));
+  ASSERT_EQ(first->hash_algorithm, second->hash_algorithm);
+  ASSERT_EQ(first->salt, second->salt);
+  ASSERT_EQ(first->root_digest, second->root_digest);
+
+  // A different key is still rejected.
+  ASSERT_FALSE(apex_file->VerifyApexVerity("wrong-key").ok());
+
+  // Modifying the file in place invalidates the memoized result.
+  ASSERT_EQ(0, truncate(file_path.c_str(), fs::file_size(file_path) / 2));
+  ASSERT_FALSE(
+      apex_file->VerifyApexVerity(apex_file->GetBundledPublicKey()).ok());
+}
+
 TEST_P(ApexFileTest, GetBundledPublicKey) {
   const std::string file_path = kTestDataDir + GetParam().prefix + ".apex";
   Result<ApexFile> apex_file = ApexFile::Open(file_path);
@@ -274,6 +310,107 @@ TEST(ApexFileTest, DecompressCompressedApex) {
   auto verity_status = decompressed_apex_file->VerifyApexVerity(
       decompressed_apex_file->GetBundledPublicKey());
   ASSERT_RESULT_OK(verity_status);
+
+  ASSERT_TRUE(apex_file->GetDecompressedSize().has_value());
+  ASSERT_EQ(std::filesystem::file_size(decompression_file_path),
+            *apex_file->GetDecompressedSize());
+  ASSERT_FALSE(decompressed_apex_file->GetDecompressedSize().has_value());
+}
+
+TEST(ApexFileTest, DecompressZstdCompressedApex) {
+  const std::string file_path =
+      kTestDataDir + "com.android.apex.compressed.v1_zstd.capex";
+  Result<ApexFile> apex_file = ApexFile::Open(file_path);
+  ASSERT_RESULT_OK(apex_file);
+  ASSERT_TRUE(apex_file->IsCompressed());
+  ASSERT_FALSE(apex_file->HasStoredOriginalApex());
+
+  TemporaryDir tmp_dir;
+  const std::string decompression_file_path =
+      std::string(tmp_dir.path) + "/decompressed.apex";
+  ASSERT_RESULT_OK(apex_file->Decompress(decompression_file_path));
+
+  // The frames are put back together into the original APEX.
+  std::string original;
+  ASSERT_TRUE(android::base::ReadFileToString(
+      kTestDataDir + "com.android.apex.compressed.v1_original.apex",
+      &original));
+  std::string decompressed;
+  ASSERT_TRUE(android::base::ReadFileToString(decompression_file_path,
+                                              &decompressed));
+  ASSERT_EQ(original, decompressed);
+  ASSERT_EQ(original.size(), *apex_file->GetDecompressedSize());
+}
+
+TEST(ApexFileTest, RejectsOversizedZstdFrame) {
+  TemporaryDir tmp_dir;
+  const std::string file_path = std::string(tmp_dir.path) + "/test.capex";
+  ASSERT_TRUE(fs::copy_file(
+      kTestDataDir + "com.android.apex.compressed.v1_zstd.capex", file_path));
+
+  uint64_t stream_end;
+  {
+    ZipArchiveHandle handle;
+    ASSERT_EQ(0, OpenArchive(file_path.c_str(), &handle));
+    auto close_guard =
+        android::base::make_scope_guard([&handle]() { CloseArchive(handle); });
+    ZipEntry entry;
+    ASSERT_EQ(0, FindEntry(handle, "original_apex.zst", &entry));
+    stream_end = entry.offset + entry.uncompressed_length;
+  }
+
+  // Make the last frame of the seek table claim 4 GiB - 1.
+  std::fstream file(file_path,
+                    std::ios::in | std::ios::out | std::ios::binary);
+  ASSERT_TRUE(file.is_open());
+  char descriptor;
+  file.seekg(stream_end - 5);
+  file.read(&descriptor, 1);
+  const uint64_t entry_size = (descriptor & 0x80) != 0 ? 12 : 8;
+  file.seekp(stream_end - 9 - entry_size + 4);
+  file.write("\xff\xff\xff\xff", 4);
+  file.close();
+
+  Result<ApexFile> apex_file = ApexFile::Open(file_path);
+  ASSERT_FALSE(apex_file.ok());
+  ASSERT_THAT(apex_file.error().message(), ::testing::HasSubstr("too large"));
+}
+
+TEST(ApexFileTest, OpenStoredOriginalApex) {
+  const std::string file_path =
+      kTestDataDir + "com.android.apex.compressed.v1_stored.capex";
+  Result<ApexFile> apex_file = ApexFile::Open(file_path);
+  ASSERT_RESULT_OK(apex_file);
+  ASSERT_TRUE(apex_file->IsCompressed());
+  ASSERT_TRUE(apex_file->HasStoredOriginalApex());
+
+  auto original = apex_file->OpenStoredOriginalApex();
+  ASSERT_RESULT_OK(original);
+  ASSERT_FALSE(original->IsCompressed());
+  ASSERT_EQ(file_path, original->GetPath());
+  ASSERT_EQ(apex_file->GetManifest().name(), original->GetManifest().name());
+  ASSERT_EQ(apex_file->GetManifest().version(),
+            original->GetManifest().version());
+  ASSERT_EQ(apex_file->GetBundledPublicKey(),
+            original->GetBundledPublicKey());
+  ASSERT_TRUE(original->GetImageOffset().has_value());
+  ASSERT_EQ(0u, *original->GetImageOffset() % 4096);
+
+  // The nested image is the one that would have been decompressed.
+  auto verity_data =
+      original->VerifyApexVerity(original->GetBundledPublicKey());
+  ASSERT_RESULT_OK(verity_data);
+  ASSERT_EQ(apex_file->GetManifest().capexmetadata().originalapexdigest(),
+            verity_data->root_digest);
+}
+
+TEST(ApexFileTest, OpenStoredOriginalApexFailsForDeflatedCapex) {
+  const std::string file_path =
+      kTestDataDir + "com.android.apex.compressed.v1.capex";
+  Result<ApexFile> apex_file = ApexFile::Open(file_path);
+  ASSERT_RESULT_OK(apex_file);
+  ASSERT_FALSE(apex_file->HasStoredOriginalApex());
+  ASSERT_FALSE(apex_file->OpenStoredOriginalApex().ok());
 }
 
 TEST(ApexFileTest, DecompressFailForNormalApex) {
@@ -307,6 +444,99 @@ TEST(ApexFileTest, DecompressFailIfDecompressionPathExists) {
               ::testing::HasSubstr("Failed to open decompression destination"));
 }
 
+TEST(ApexFileTest, ReadsFromOpenedFileEvenIfPathIsReplaced) {
+  TemporaryDir tmp_dir;
+  const std::string apex_path = std::string(tmp_dir.path) + "/test.apex";
+  const std::string capex_path = std::string(tmp_dir.path) + "/test.capex";
+  ASSERT_TRUE(fs::copy_file(kTestDataDir + "apex.apexd_test.apex", apex_path));
+  ASSERT_TRUE(fs::copy_file(
+      kTestDataDir + "com.android.apex.compressed.v1.capex", capex_path));
+
+  Result<ApexFile> apex = ApexFile::Open(apex_path);
+  ASSERT_RESULT_OK(apex);
+  Result<ApexFile> capex = ApexFile::Open(capex_path);
+  ASSERT_RESULT_OK(capex);
+
+  // Replace both files with different content under the same names.
+  ASSERT_EQ(0, unlink(apex_path.c_str()));
+  ASSERT_TRUE(fs::copy_file(
+      kTestDataDir + "apex.apexd_test_different_app.apex", apex_path));
+  ASSERT_EQ(0, unlink(capex_path.c_str()));
+  ASSERT_TRUE(fs::copy_file(kTestDataDir + "apex.apexd_test.apex", capex_path));
+
+  // Both objects keep reading the files they were opened from.
+  ASSERT_RESULT_OK(apex->VerifyApexVerity(apex->GetBundledPublicKey()));
+  const std::string decompressed_path =
+      std::string(tmp_dir.path) + "/decompressed.apex";
+  ASSERT_RESULT_OK(capex->Decompress(decompressed_path));
+  auto decompressed = ApexFile::Open(decompressed_path);
+  ASSERT_RESULT_OK(decompressed);
+  ASSERT_EQ(capex->GetManifest().name(), decompressed->GetManifest().name());
+  ASSERT_RESULT_OK(
+      decompressed->VerifyApexVerity(decompressed->GetBundledPublicKey()));
+}
+
+size_t CountOpenFds() {
+  size_t count = 0;
+  for ([[maybe_unused]] const auto& entry :
+       fs::directory_iterator("/proc/self/fd")) {
+    count++;
+  }
+  return count;
+}
+
+TEST(ApexFileTest, ReleaseFdClosesDescriptorUntilNextRead) {
+  const size_t fds_before_open = CountOpenFds();
+  Result<ApexFile> apex =
+      ApexFile::Open(kTestDataDir + "apex.apexd_test.apex");
+  ASSERT_RESULT_OK(apex);
+  ASSERT_EQ(fds_before_open + 1, CountOpenFds());
+
+  // Copies share the descriptor, so releasing it from one closes it for all.
+  const ApexFile copy = *apex;
+  copy.ReleaseFd();
+  ASSERT_EQ(fds_before_open, CountOpenFds());
+
+  // Reads open the file again and keep it open until the next release.
+  ASSERT_RESULT_OK(apex->VerifyApexVerity(apex->GetBundledPublicKey()));
+  ASSERT_EQ(fds_before_open + 1, CountOpenFds());
+  apex->ReleaseFd();
+  ASSERT_EQ(fds_before_open, CountOpenFds());
+}
+
+TEST(ApexFileTest, HeldFdStaysOpenAfterReleaseFd) {
+  Result<ApexFile> apex =
+      ApexFile::Open(kTestDataDir + "apex.apexd_test.apex");
+  ASSERT_RESULT_OK(apex);
+
+  const size_t fds_before_release = CountOpenFds();
+  {
+    const ApexFile::HeldFd fd = apex->GetFd();
+    apex->ReleaseFd();
+    ASSERT_EQ(fds_before_release, CountOpenFds());
+    ASSERT_NE(-1, fcntl(fd.get(), F_GETFD));
+  }
+  ASSERT_EQ(fds_before_release - 1, CountOpenFds());
+}
+
+TEST(ApexFileTest, ReadsFailAfterReleaseFdIfPathIsReplaced) {
+  TemporaryDir tmp_dir;
+  const std::string apex_path = std::string(tmp_dir.path) + "/test.apex";
+  ASSERT_TRUE(fs::copy_file(kTestDataDir + "apex.apexd_test.apex", apex_path));
+
+  Result<ApexFile> apex = ApexFile::Open(apex_path);
+  ASSERT_RESULT_OK(apex);
+  apex->ReleaseFd();
+
+  ASSERT_EQ(0, unlink(apex_path.c_str()));
+  ASSERT_TRUE(fs::copy_file(
+      kTestDataDir + "apex.apexd_test_different_app.apex", apex_path));
+
+  // The file can't be opened again, rather than reading the new one.
+  ASSERT_EQ(-1, apex->GetFd().get());
+  ASSERT_FALSE(apex->VerifyApexVerity(apex->GetBundledPublicKey()).ok());
+}
+
 TEST(ApexFileTest, GetPathReturnsRealpath) {
   const std::string real_path = kTestDataDir + "apex.apexd_test.apex";
   const std::string symlink_path =
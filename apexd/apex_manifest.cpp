@@ -16,12 +16,17 @@
 
 #include "apex_manifest.h"
 #include <android-base/file.h>
+#include <android-base/parseint.h>
+#include <android-base/strings.h>
 
 #include <memory>
 #include <string>
 
 using android::base::Error;
+using android::base::ParseInt;
 using android::base::Result;
+using android::base::Split;
+using android::base::Trim;
 using ::apex::proto::ApexManifest;
 
 namespace android {
@@ -59,5 +64,35 @@ Result<ApexManifest> ReadManifest(const std::string& path) {
   return ParseManifest(content);
 }
 
+Result<std::unordered_map<std::string, int32_t>>
+ParseActivationPriorityOverrides(const std::string& overrides) {
+  std::unordered_map<std::string, int32_t> result;
+  for (const auto& entry : Split(overrides, ",")) {
+    std::string trimmed = Trim(entry);
+    if (trimmed.empty()) {
+      continue;
+    }
+    auto parts = Split(trimmed, "=");
+    int32_t priority;
+    if (parts.size() != 2 || Trim(parts[0]).empty() ||
+        !ParseInt(Trim(parts[1]), &priority)) {
+      return Error() << "Invalid activation priority override \"" << trimmed
+                     << "\"";
+    }
+    result[Trim(parts[0])] = priority;
+  }
+  return result;
+}
+
+int32_t GetActivationPriority(
+    const ApexManifest& apex_manifest,
+    const std::unordered_map<std::string, int32_t>& overrides) {
+  auto it = overrides.find(apex_manifest.name());
+  if (it != overrides.end()) {
+    return it->second;
+  }
+  return apex_manifest.activationpriority();
+}
+
 }  // namespace apex
 }  // namespace android
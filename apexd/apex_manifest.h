@@ -21,7 +21,9 @@
 
 #include "apex_manifest.pb.h"
 
+#include <cstdint>
 #include <string>
+#include <unordered_map>
 
 namespace android {
 namespace apex {
@@ -33,6 +35,14 @@ std::string GetPackageId(const ::apex::proto::ApexManifest& apex_manifest);
 // Reads and parses APEX manifest from the file on disk.
 android::base::Result<::apex::proto::ApexManifest> ReadManifest(
     const std::string& path);
+// Parses a comma-separated list of <apex name>=<priority> entries overriding
+// the activationPriority of APEX manifests.
+android::base::Result<std::unordered_map<std::string, int32_t>>
+ParseActivationPriorityOverrides(const std::string& overrides);
+// Returns the activation priority of an APEX, taking |overrides| into account.
+int32_t GetActivationPriority(
+    const ::apex::proto::ApexManifest& apex_manifest,
+    const std::unordered_map<std::string, int32_t>& overrides);
 }  // namespace apex
 }  // namespace android
 
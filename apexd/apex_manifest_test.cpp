@@ -126,5 +126,36 @@ TEST(ApexManifestTest, NoCode) {
   EXPECT_TRUE(apex_manifest->nocode());
 }
 
+TEST(ApexManifestTest, ActivationPriority) {
+  ApexManifest manifest;
+  manifest.set_name("com.android.example.apex");
+  manifest.set_version(1);
+  auto apex_manifest = ParseManifest(ToString(manifest));
+  ASSERT_RESULT_OK(apex_manifest);
+  EXPECT_EQ(0, GetActivationPriority(*apex_manifest, {}));
+
+  manifest.set_activationpriority(10);
+  apex_manifest = ParseManifest(ToString(manifest));
+  ASSERT_RESULT_OK(apex_manifest);
+  EXPECT_EQ(10, GetActivationPriority(*apex_manifest, {}));
+  EXPECT_EQ(-5, GetActivationPriority(*apex_manifest,
+                                      {{"com.android.example.apex", -5}}));
+  EXPECT_EQ(10, GetActivationPriority(*apex_manifest, {{"com.other", -5}}));
+}
+
+TEST(ApexManifestTest, ParseActivationPriorityOverrides) {
+  auto overrides =
+      ParseActivationPriorityOverrides(" com.android.art=100, com.foo=-1,");
+  ASSERT_RESULT_OK(overrides);
+  EXPECT_EQ(2u, overrides->size());
+  EXPECT_EQ(100, overrides->at("com.android.art"));
+  EXPECT_EQ(-1, overrides->at("com.foo"));
+
+  ASSERT_RESULT_OK(ParseActivationPriorityOverrides(""));
+  EXPECT_FALSE(ParseActivationPriorityOverrides("com.foo").ok());
+  EXPECT_FALSE(ParseActivationPriorityOverrides("com.foo=high").ok());
+  EXPECT_FALSE(ParseActivationPriorityOverrides("=1").ok());
+}
+
 }  // namespace apex
 }  // namespace android
@@ -20,19 +20,26 @@
 #include <android-base/logging.h>
 #include <android-base/stringprintf.h>
 #include <android-base/strings.h>
+#include <android-base/unique_fd.h>
+#include <fcntl.h>
 #include <openssl/sha.h>
+#include <unistd.h>
+
 #include <filesystem>
-#include <fstream>
+#include <iomanip>
 #include <sstream>
 #include <unordered_set>
+#include <vector>
 
 #include "apex_constants.h"
 #include "apex_file.h"
 #include "string_log.h"
 
+using android::base::borrowed_fd;
 using android::base::ErrnoError;
 using android::base::Error;
 using android::base::Result;
+using android::base::unique_fd;
 using ::apex::proto::ApexManifest;
 
 namespace android {
@@ -45,7 +52,7 @@ namespace {
 
 static constexpr const char* kApexCtsShimPackage = "com.android.apex.cts.shim";
 static constexpr const char* kHashFilePath = "etc/hash.txt";
-static constexpr const int kBufSize = 1024;
+static constexpr const size_t kBufSize = 64 * 1024;
 static constexpr const fs::perms kForbiddenFilePermissions =
     fs::perms::owner_exec | fs::perms::group_exec | fs::perms::others_exec;
 static constexpr const char* kExpectedCtsShimFiles[] = {
@@ -72,22 +79,23 @@ static constexpr const char* kExpectedCtsShimFiles[] = {
     "priv-app/CtsShimPriv@MASTER/CtsShimPriv.apk",
 };
 
-Result<std::string> CalculateSha512(const std::string& path) {
+Result<std::string> CalculateSha512(borrowed_fd fd, const std::string& path) {
   LOG(DEBUG) << "Calculating SHA512 of " << path;
   SHA512_CTX ctx;
   SHA512_Init(&ctx);
-  std::ifstream apex(path, std::ios::binary);
-  if (apex.bad()) {
-    return Error() << "Failed to open " << path;
-  }
-  char buf[kBufSize];
-  while (!apex.eof()) {
-    apex.read(buf, kBufSize);
-    if (apex.bad()) {
-      return Error() << "Failed to read " << path;
+  std::vector<uint8_t> buf(kBufSize);
+  off_t offset = 0;
+  while (true) {
+    ssize_t bytes_read =
+        TEMP_FAILURE_RETRY(pread(fd.get(), buf.data(), buf.size(), offset));
+    if (bytes_read < 0) {
+      return ErrnoError() << "Failed to read " << path;
     }
-    int bytes_read = apex.gcount();
-    SHA512_Update(&ctx, buf, bytes_read);
+    if (bytes_read == 0) {
+      break;
+    }
+    SHA512_Update(&ctx, buf.data(), bytes_read);
+    offset += bytes_read;
   }
   uint8_t hash[SHA512_DIGEST_LENGTH];
   SHA512_Final(hash, &ctx);
@@ -110,8 +118,14 @@ Result<std::vector<std::string>> GetAllowedHashes(const std::string& path) {
     return ErrnoError() << "Failed to read " << file_path;
   }
   std::vector<std::string> allowed_hashes = android::base::Split(hash, "\n");
-  auto system_shim_hash = CalculateSha512(
-      StringPrintf("%s/%s", kApexPackageSystemDir, shim::kSystemShimApexName));
+  const std::string system_shim_path =
+      StringPrintf("%s/%s", kApexPackageSystemDir, shim::kSystemShimApexName);
+  unique_fd system_shim_fd(
+      open(system_shim_path.c_str(), O_RDONLY | O_CLOEXEC));
+  if (system_shim_fd.get() == -1) {
+    return ErrnoError() << "Failed to open " << system_shim_path;
+  }
+  auto system_shim_hash = CalculateSha512(system_shim_fd, system_shim_path);
   if (!system_shim_hash.ok()) {
     return system_shim_hash.error();
   }
@@ -179,14 +193,15 @@ Result<void> ValidateShimApex(const std::string& mount_point,
 }
 
 Result<void> ValidateUpdate(const std::string& system_apex_path,
-                            const std::string& new_apex_path) {
+                            const ApexFile& new_apex) {
+  const std::string& new_apex_path = new_apex.GetPath();
   LOG(DEBUG) << "Validating update of shim apex to " << new_apex_path
              << " using system shim apex " << system_apex_path;
   auto allowed = GetAllowedHashes(system_apex_path);
   if (!allowed.ok()) {
     return allowed.error();
   }
-  auto actual = CalculateSha512(new_apex_path);
+  auto actual = CalculateSha512(new_apex.GetFd(), new_apex_path);
   if (!actual.ok()) {
     return actual.error();
   }
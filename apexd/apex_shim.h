@@ -30,7 +30,7 @@ android::base::Result<void> ValidateShimApex(const std::string& mount_point,
                                              const ApexFile& apex_file);
 
 android::base::Result<void> ValidateUpdate(const std::string& system_apex_path,
-                                           const std::string& new_apex_path);
+                                           const ApexFile& new_apex);
 
 }  // namespace shim
 }  // namespace apex
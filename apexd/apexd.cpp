@@ -44,24 +44,26 @@
 #include <sys/ioctl.h>
 #include <sys/mount.h>
 #include <sys/stat.h>
-#include <sys/sysinfo.h>
+#include <sys/statvfs.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <utils/Trace.h>
 
 #include <algorithm>
 #include <array>
+#include <atomic>
 #include <chrono>
 #include <cstdlib>
+#include <deque>
 #include <filesystem>
 #include <fstream>
+#include <functional>
 #include <future>
 #include <iomanip>
 #include <iterator>
 #include <memory>
 #include <mutex>
 #include <optional>
-#include <queue>
 #include <sstream>
 #include <string>
 #include <string_view>
@@ -77,6 +79,7 @@
 #include "apex_manifest.h"
 #include "apex_shim.h"
 #include "apexd_checkpoint.h"
+#include "apexd_executor.h"
 #include "apexd_lifecycle.h"
 #include "apexd_loop.h"
 #include "apexd_private.h"
@@ -93,6 +96,7 @@ using android::base::Error;
 using android::base::GetProperty;
 using android::base::Join;
 using android::base::ParseUint;
+using android::base::ReadFileToString;
 using android::base::RemoveFileIfExists;
 using android::base::Result;
 using android::base::SetProperty;
@@ -137,9 +141,19 @@ bool gInFsCheckpointMode = false;
 //  3. We failed to activate APEX from /data/apex/active and fallback to the
 //  pre-installed APEX.
 std::set<std::string> gChangedActiveApexes;
+// Only needed while compressed APEXes are processed in parallel, everything
+// else updates gChangedActiveApexes from a single thread.
+std::mutex gChangedActiveApexesMutex;
 
 static constexpr size_t kLoopDeviceSetupAttempts = 3u;
 
+// erofs rejects an fsoffset= that isn't a multiple of its block size.
+static constexpr uint32_t kFileBackedErofsBlockSize = 4096;
+
+// Total size of the hashtrees of APEXes that are no longer in use that are kept
+// around, in case these APEXes come back. See RemoveObsoleteHashTrees().
+static constexpr uint64_t kDefaultHashTreeCacheQuotaMb = 32;
+
 // Please DO NOT add new modules to this list without contacting mainline-modularization@ first.
 static const std::vector<std::string> kBootstrapApexes = ([]() {
   std::vector<std::string> ret = {
@@ -191,17 +205,16 @@ void ReleaseF2fsCompressedBlocks(const std::string& file_path) {
             << file_path;
 }
 
+// |hash_offset| is where the hashtree starts on |hash_device|.
 std::unique_ptr<DmTable> CreateVerityTable(const ApexVerityData& verity_data,
                                            const std::string& block_device,
                                            const std::string& hash_device,
+                                           uint64_t hash_offset,
                                            bool restart_on_corruption) {
   AvbHashtreeDescriptor* desc = verity_data.desc.get();
   auto table = std::make_unique<DmTable>();
 
-  uint32_t hash_start_block = 0;
-  if (hash_device == block_device) {
-    hash_start_block = desc->tree_offset / desc->hash_block_size;
-  }
+  const uint32_t hash_start_block = hash_offset / desc->hash_block_size;
 
   auto target = std::make_unique<DmTargetVerity>(
       0, desc->image_size / 512, desc->dm_verity_version, block_device,
@@ -389,31 +402,6 @@ Result<void> RemovePreviouslyActiveApexFiles(
   return {};
 }
 
-// Reads the entire device to verify the image is authenticatic
-Result<void> ReadVerityDevice(const std::string& verity_device,
-                              uint64_t device_size) {
-  static constexpr int kBlockSize = 4096;
-  static constexpr size_t kBufSize = 1024 * kBlockSize;
-  std::vector<uint8_t> buffer(kBufSize);
-
-  unique_fd fd(
-      TEMP_FAILURE_RETRY(open(verity_device.c_str(), O_RDONLY | O_CLOEXEC)));
-  if (fd.get() == -1) {
-    return ErrnoError() << "Can't open " << verity_device;
-  }
-
-  size_t bytes_left = device_size;
-  while (bytes_left > 0) {
-    size_t to_read = std::min(bytes_left, kBufSize);
-    if (!android::base::ReadFully(fd.get(), buffer.data(), to_read)) {
-      return ErrnoError() << "Can't verify " << verity_device << "; corrupted?";
-    }
-    bytes_left -= to_read;
-  }
-
-  return {};
-}
-
 Result<void> VerifyMountedImage(const ApexFile& apex,
                                 const std::string& mount_point) {
   // Verify that apex_manifest.pb inside mounted image matches the one in the
@@ -433,69 +421,99 @@ Result<void> VerifyMountedImage(const ApexFile& apex,
   return {};
 }
 
-Result<MountedApexData> MountPackageImpl(const ApexFile& apex,
-                                         const std::string& mount_point,
-                                         const std::string& device_name,
-                                         const std::string& hashtree_file,
-                                         bool verify_image, bool reuse_device,
-                                         bool temp_mount = false) {
-  auto tag = "MountPackageImpl: " + apex.GetManifest().name();
+// Block devices backing an APEX that is about to be mounted. Until the mount
+// succeeds, destroying this deletes the devices again.
+struct ApexDevices {
+  loop::LoopbackDeviceUniqueFd loopback_device;
+  DmVerityDevice verity_dev;
+  loop::LoopbackDeviceUniqueFd loop_for_hash;
+  // Device to mount: either the dm-verity device, the loop device or, see
+  // CanMountFromFile, the APEX file itself.
+  std::string block_device;
+  // Data passed to mount(2), if any.
+  std::string mount_options;
+  bool mount_on_verity = false;
+  MountedApexData apex_data;
+  boot_clock::time_point time_started;
+};
+
+// Hashtrees are stored by root digest rather than by package id, so that any
+// version of an APEX that comes back (rollback, revert, reinstall) finds its
+// hashtree ready. Unused ones are garbage collected in BootCompletedCleanup().
+std::string GetHashTreeFileName(const ApexVerityData& verity_data) {
+  return StringPrintf("%s/%s", gConfig->apex_hash_tree_dir,
+                      verity_data.root_digest.c_str());
+}
+
+// For APEXes in immutable partitions, we don't need to mount them on
+// dm-verity because they are already in the dm-verity protected partition;
+// system. However, note that we don't skip verification to ensure that APEXes
+// are correctly signed.
+bool IsMountedOnVerity(const ApexFile& apex) {
+  const auto& instance = ApexFileRepository::GetInstance();
+  return !instance.IsPreInstalledApex(apex) ||
+         // decompressed apexes are on /data
+         instance.IsDecompressedApex(apex) ||
+         // block apexes are from host
+         instance.IsBlockApex(apex);
+}
+
+// Mounting erofs straight from a regular file needs both file-backed mount
+// support and the fsoffset= option in the kernel. Neither is advertised to
+// userspace. A kernel without file-backed mounts rejects the file with
+// ENOTBLK, which turns this off for the rest of the process.
+std::atomic<bool> gFileBackedErofsUnsupported = false;
+
+// Whether a mount from the APEX file that failed with |err| should be retried
+// on a loop device. EINVAL might just be about this image, e.g. a superblock
+// that doesn't match the offset, so it doesn't disable file-backed mounts for
+// the other APEXes.
+bool ShouldRetryMountOnLoopDevice(int err) {
+  if (err == ENOTBLK) {
+    gFileBackedErofsUnsupported = true;
+    return true;
+  }
+  return err == EINVAL;
+}
+
+// Whether |apex| can be mounted from its file at the payload offset, without a
+// loop device. Only for erofs payloads that aren't mounted on dm-verity.
+bool CanMountFromFile(const ApexFile& apex) {
+  static const bool erofs_supported = []() {
+    std::string filesystems;
+    return ReadFileToString("/proc/filesystems", &filesystems) &&
+           filesystems.find("\terofs\n") != std::string::npos;
+  }();
+  return erofs_supported && !gFileBackedErofsUnsupported &&
+         !apex.IsCompressed() && !IsMountedOnVerity(apex) &&
+         apex.GetFsType() == "erofs" && apex.GetImageOffset().has_value() &&
+         *apex.GetImageOffset() % kFileBackedErofsBlockSize == 0;
+}
+
+// First half of MountPackageImpl: sets up the loop and (if needed) dm-verity
+// devices for |apex|. Split from the mount so that ActivationPipeline can run
+// the two as separate stages. See MountApexDevices.
+Result<ApexDevices> CreateApexDevices(const ApexFile& apex,
+                                      const std::string& device_name,
+                                      bool verify_image, bool reuse_device,
+                                      bool temp_mount) {
+  auto tag = "CreateApexDevices: " + apex.GetManifest().name();
   ATRACE_NAME(tag.c_str());
   if (apex.IsCompressed()) {
     return Error() << "Cannot directly mount compressed APEX "
                    << apex.GetPath();
   }
 
-  LOG(VERBOSE) << "Creating mount point: " << mount_point;
-  auto time_started = boot_clock::now();
-  // Note: the mount point could exist in case when the APEX was activated
-  // during the bootstrap phase (e.g., the runtime or tzdata APEX).
-  // Although we have separate mount namespaces to separate the early activated
-  // APEXes from the normally activate APEXes, the mount points themselves
-  // are shared across the two mount namespaces because /apex (a tmpfs) itself
-  // mounted at / which is (and has to be) a shared mount. Therefore, if apexd
-  // finds an empty directory under /apex, it's not a problem and apexd can use
-  // it.
-  auto exists = PathExists(mount_point);
-  if (!exists.ok()) {
-    return exists.error();
-  }
-  if (!*exists && mkdir(mount_point.c_str(), kMkdirMode) != 0) {
-    return ErrnoError() << "Could not create mount point " << mount_point;
-  }
-  auto deleter = [&mount_point]() {
-    if (rmdir(mount_point.c_str()) != 0) {
-      PLOG(WARNING) << "Could not rmdir " << mount_point;
-    }
-  };
-  auto scope_guard = android::base::make_scope_guard(deleter);
-  if (!IsEmptyDirectory(mount_point)) {
-    return ErrnoError() << mount_point << " is not empty";
-  }
+  ApexDevices devices;
+  devices.time_started = boot_clock::now();
 
   const std::string& full_path = apex.GetPath();
 
   if (!apex.GetImageOffset() || !apex.GetImageSize()) {
     return Error() << "Cannot create mount point without image offset and size";
   }
-  loop::LoopbackDeviceUniqueFd loopback_device;
-  for (size_t attempts = 1;; ++attempts) {
-    Result<loop::LoopbackDeviceUniqueFd> ret =
-        loop::CreateAndConfigureLoopDevice(full_path,
-                                           apex.GetImageOffset().value(),
-                                           apex.GetImageSize().value());
-    if (ret.ok()) {
-      loopback_device = std::move(*ret);
-      break;
-    }
-    if (attempts >= kLoopDeviceSetupAttempts) {
-      return Error() << "Could not create loop device for " << full_path << ": "
-                     << ret.error();
-    }
-  }
-  LOG(VERBOSE) << "Loopback device created: " << loopback_device.name;
-
   auto& instance = ApexFileRepository::GetInstance();
+  devices.mount_on_verity = IsMountedOnVerity(apex);
 
   auto public_key = instance.GetPublicKey(apex.GetManifest().name());
   if (!public_key.ok()) {
@@ -518,27 +536,62 @@ Result<MountedApexData> MountPackageImpl(const ApexFile& apex,
     }
   }
 
-  std::string block_device = loopback_device.name;
-  MountedApexData apex_data(loopback_device.name, apex.GetPath(), mount_point,
-                            /* device_name = */ "",
-                            /* hashtree_loop_name = */ "",
-                            /* is_temp_mount */ temp_mount);
-
-  // for APEXes in immutable partitions, we don't need to mount them on
-  // dm-verity because they are already in the dm-verity protected partition;
-  // system. However, note that we don't skip verification to ensure that APEXes
-  // are correctly signed.
-  const bool mount_on_verity = !instance.IsPreInstalledApex(apex) ||
-                               // decompressed apexes are on /data
-                               instance.IsDecompressedApex(apex) ||
-                               // block apexes are from host
-                               instance.IsBlockApex(apex);
-
-  DmVerityDevice verity_dev;
-  loop::LoopbackDeviceUniqueFd loop_for_hash;
-  if (mount_on_verity) {
-    std::string hash_device = loopback_device.name;
-    if (verity_data->desc->tree_size == 0) {
+  // A hashtree stored in the file by StoreSidecarHashTree() is read through
+  // the payload's loop device, which then has to extend up to the hashtree's
+  // end.
+  const uint32_t image_offset = apex.GetImageOffset().value();
+  uint64_t mapped_size = apex.GetImageSize().value();
+  std::optional<SidecarHashTree> sidecar;
+  if (devices.mount_on_verity && verity_data->desc->tree_size == 0) {
+    auto found = FindSidecarHashTree(apex, *verity_data);
+    if (!found.ok()) {
+      LOG(WARNING) << found.error();
+    } else if (found->has_value()) {
+      sidecar = **found;
+      mapped_size = std::max(mapped_size,
+                             sidecar->offset + sidecar->size - image_offset);
+    }
+  }
+
+  std::string data_device;
+  if (CanMountFromFile(apex)) {
+    data_device = full_path;
+    devices.mount_options = StringPrintf("fsoffset=%u", image_offset);
+  }
+  if (data_device.empty()) {
+    for (size_t attempts = 1;; ++attempts) {
+      Result<loop::LoopbackDeviceUniqueFd> ret =
+          loop::CreateAndConfigureLoopDevice(apex.GetFd(), full_path,
+                                             image_offset, mapped_size);
+      if (ret.ok()) {
+        devices.loopback_device = std::move(*ret);
+        break;
+      }
+      if (attempts >= kLoopDeviceSetupAttempts) {
+        return Error() << "Could not create loop device for " << full_path
+                       << ": " << ret.error();
+      }
+    }
+    data_device = devices.loopback_device.name;
+    LOG(VERBOSE) << "Loopback device created: " << data_device;
+  }
+
+  devices.block_device = data_device;
+  MountedApexData& apex_data = devices.apex_data;
+  apex_data = MountedApexData(devices.loopback_device.name, apex.GetPath(),
+                              /* mount_point = */ "",
+                              /* device_name = */ "",
+                              /* hashtree_loop_name = */ "",
+                              /* is_temp_mount */ temp_mount);
+  apex_data.apex_file = std::make_shared<const ApexFile>(apex);
+
+  if (devices.mount_on_verity) {
+    std::string hash_device = data_device;
+    uint64_t hash_offset = verity_data->desc->tree_offset;
+    if (sidecar.has_value()) {
+      hash_offset = sidecar->offset - image_offset;
+    } else if (verity_data->desc->tree_size == 0) {
+      const std::string hashtree_file = GetHashTreeFileName(*verity_data);
       if (auto st = PrepareHashTree(apex, *verity_data, hashtree_file);
           !st.ok()) {
         return st.error();
@@ -550,12 +603,13 @@ Result<MountedApexData> MountPackageImpl(const ApexFile& apex,
       if (!create_loop_status.ok()) {
         return create_loop_status.error();
       }
-      loop_for_hash = std::move(*create_loop_status);
-      hash_device = loop_for_hash.name;
+      devices.loop_for_hash = std::move(*create_loop_status);
+      hash_device = devices.loop_for_hash.name;
+      hash_offset = 0;
       apex_data.hashtree_loop_name = hash_device;
     }
     auto verity_table =
-        CreateVerityTable(*verity_data, loopback_device.name, hash_device,
+        CreateVerityTable(*verity_data, data_device, hash_device, hash_offset,
                           /* restart_on_corruption = */ !verify_image);
     Result<DmVerityDevice> verity_dev_res =
         CreateVerityDevice(device_name, *verity_table, reuse_device);
@@ -563,25 +617,56 @@ Result<MountedApexData> MountPackageImpl(const ApexFile& apex,
       return Error() << "Failed to create Apex Verity device " << full_path
                      << ": " << verity_dev_res.error();
     }
-    verity_dev = std::move(*verity_dev_res);
+    devices.verity_dev = std::move(*verity_dev_res);
     apex_data.device_name = device_name;
-    block_device = verity_dev.GetDevPath();
+    devices.block_device = devices.verity_dev.GetDevPath();
 
     Result<void> read_ahead_status =
-        loop::ConfigureReadAhead(verity_dev.GetDevPath());
+        loop::ConfigureReadAhead(devices.verity_dev.GetDevPath());
     if (!read_ahead_status.ok()) {
       return read_ahead_status.error();
     }
   }
-  // TODO(b/158467418): consider moving this inside RunVerifyFnInsideTempMount.
-  if (mount_on_verity && verify_image) {
-    Result<void> verity_status =
-        ReadVerityDevice(block_device, (*verity_data).desc->image_size);
-    if (!verity_status.ok()) {
-      return verity_status.error();
+  return devices;
+}
+
+// Second half of MountPackageImpl: mounts |devices| created by
+// CreateApexDevices on |mount_point| and verifies the result.
+Result<MountedApexData> MountApexDevices(const ApexFile& apex,
+                                         ApexDevices devices,
+                                         const std::string& mount_point) {
+  auto tag = "MountApexDevices: " + apex.GetManifest().name();
+  ATRACE_NAME(tag.c_str());
+  LOG(VERBOSE) << "Creating mount point: " << mount_point;
+  // Note: the mount point could exist in case when the APEX was activated
+  // during the bootstrap phase (e.g., the runtime or tzdata APEX).
+  // Although we have separate mount namespaces to separate the early activated
+  // APEXes from the normally activate APEXes, the mount points themselves
+  // are shared across the two mount namespaces because /apex (a tmpfs) itself
+  // mounted at / which is (and has to be) a shared mount. Therefore, if apexd
+  // finds an empty directory under /apex, it's not a problem and apexd can use
+  // it.
+  auto exists = PathExists(mount_point);
+  if (!exists.ok()) {
+    return exists.error();
+  }
+  if (!*exists && mkdir(mount_point.c_str(), kMkdirMode) != 0) {
+    return ErrnoError() << "Could not create mount point " << mount_point;
+  }
+  auto deleter = [&mount_point]() {
+    if (rmdir(mount_point.c_str()) != 0) {
+      PLOG(WARNING) << "Could not rmdir " << mount_point;
     }
+  };
+  auto scope_guard = android::base::make_scope_guard(deleter);
+  if (!IsEmptyDirectory(mount_point)) {
+    return ErrnoError() << mount_point << " is not empty";
   }
 
+  const std::string& full_path = apex.GetPath();
+  MountedApexData apex_data = std::move(devices.apex_data);
+  apex_data.mount_point = mount_point;
+
   uint32_t mount_flags = MS_NOATIME | MS_NODEV | MS_DIRSYNC | MS_RDONLY;
   if (apex.GetManifest().nocode()) {
     mount_flags |= MS_NOEXEC;
@@ -590,10 +675,34 @@ Result<MountedApexData> MountPackageImpl(const ApexFile& apex,
   if (!apex.GetFsType()) {
     return Error() << "Cannot mount package without FsType";
   }
-  if (mount(block_device.c_str(), mount_point.c_str(),
-            apex.GetFsType().value().c_str(), mount_flags, nullptr) == 0) {
+  auto do_mount = [&]() {
+    return mount(devices.block_device.c_str(), mount_point.c_str(),
+                 apex.GetFsType().value().c_str(), mount_flags,
+                 devices.mount_options.empty()
+                     ? nullptr
+                     : devices.mount_options.c_str());
+  };
+  int ret = do_mount();
+  if (ret != 0 && !devices.mount_options.empty() &&
+      ShouldRetryMountOnLoopDevice(errno)) {
+    PLOG(WARNING) << "Can't mount " << full_path
+                  << " without a loop device, falling back";
+    auto loop_device = loop::CreateAndConfigureLoopDevice(
+        apex.GetFd(), full_path, apex.GetImageOffset().value(),
+        apex.GetImageSize().value());
+    if (!loop_device.ok()) {
+      return Error() << "Could not create loop device for " << full_path
+                     << ": " << loop_device.error();
+    }
+    devices.loopback_device = std::move(*loop_device);
+    devices.block_device = devices.loopback_device.name;
+    devices.mount_options.clear();
+    apex_data.loop_name = devices.loopback_device.name;
+    ret = do_mount();
+  }
+  if (ret == 0) {
     auto time_elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
-        boot_clock::now() - time_started).count();
+        boot_clock::now() - devices.time_started).count();
     LOG(INFO) << "Successfully mounted package " << full_path << " on "
               << mount_point << " duration=" << time_elapsed;
     auto status = VerifyMountedImage(apex, mount_point);
@@ -605,9 +714,9 @@ Result<MountedApexData> MountPackageImpl(const ApexFile& apex,
                      << status.error();
     }
     // Time to accept the temporaries as good.
-    verity_dev.Release();
-    loopback_device.CloseGood();
-    loop_for_hash.CloseGood();
+    devices.verity_dev.Release();
+    devices.loopback_device.CloseGood();
+    devices.loop_for_hash.CloseGood();
 
     scope_guard.Disable();  // Accept the mount.
     return apex_data;
@@ -616,11 +725,29 @@ Result<MountedApexData> MountPackageImpl(const ApexFile& apex,
   }
 }
 
-std::string GetHashTreeFileName(const ApexFile& apex, bool is_new) {
-  const std::string& id = GetPackageId(apex.GetManifest());
-  std::string ret =
-      StringPrintf("%s/%s", gConfig->apex_hash_tree_dir, id.c_str());
-  return is_new ? ret + ".new" : ret;
+Result<MountedApexData> MountPackageImpl(const ApexFile& apex,
+                                         const std::string& mount_point,
+                                         const std::string& device_name,
+                                         bool verify_image, bool reuse_device,
+                                         bool temp_mount = false) {
+  auto tag = "MountPackageImpl: " + apex.GetManifest().name();
+  ATRACE_NAME(tag.c_str());
+  auto devices = CreateApexDevices(apex, device_name, verify_image,
+                                   reuse_device, temp_mount);
+  if (!devices.ok()) {
+    return devices.error();
+  }
+  return MountApexDevices(apex, std::move(*devices), mount_point);
+}
+
+// Removes |hashtree_file| and its stamp, see GetHashTreeStampPath().
+void RemoveHashTree(const std::string& hashtree_file) {
+  for (const std::string& path :
+       {hashtree_file, GetHashTreeStampPath(hashtree_file)}) {
+    if (TEMP_FAILURE_RETRY(unlink(path.c_str())) != 0 && errno != ENOENT) {
+      PLOG(ERROR) << "Failed to unlink " << path;
+    }
+  }
 }
 
 Result<MountedApexData> VerifyAndTempMountPackage(
@@ -628,25 +755,47 @@ Result<MountedApexData> VerifyAndTempMountPackage(
   const std::string& package_id = GetPackageId(apex.GetManifest());
   LOG(DEBUG) << "Temp mounting " << package_id << " to " << mount_point;
   const std::string& temp_device_name = package_id + ".tmp";
-  std::string hashtree_file = GetHashTreeFileName(apex, /* is_new = */ true);
-  if (access(hashtree_file.c_str(), F_OK) == 0) {
-    LOG(DEBUG) << hashtree_file << " already exists. Deleting it";
-    if (TEMP_FAILURE_RETRY(unlink(hashtree_file.c_str())) != 0) {
-      return ErrnoError() << "Failed to unlink " << hashtree_file;
+
+  auto public_key =
+      ApexFileRepository::GetInstance().GetPublicKey(apex.GetManifest().name());
+  if (!public_key.ok()) {
+    return public_key.error();
+  }
+  auto verity_data = apex.VerifyApexVerity(*public_key);
+  if (!verity_data.ok()) {
+    return Error() << "Failed to verify Apex Verity data for "
+                   << apex.GetPath() << ": " << verity_data.error();
+  }
+  // The hashtree may be shared with an active or a previously seen version of
+  // the APEX, in which case it is left alone on failure.
+  const std::string hashtree_file = GetHashTreeFileName(*verity_data);
+  const bool new_hashtree = verity_data->desc->tree_size == 0 &&
+                            access(hashtree_file.c_str(), F_OK) != 0;
+  auto cleanup = android::base::make_scope_guard([&]() {
+    if (new_hashtree) {
+      LOG(DEBUG) << "Cleaning up " << hashtree_file;
+      RemoveHashTree(hashtree_file);
+    }
+  });
+
+  // Check the whole payload from userspace before creating any device, rather
+  // than reading it back through the temp dm-verity device. This also leaves
+  // the hashtree ready for CreateApexDevices().
+  if (IsMountedOnVerity(apex)) {
+    if (auto st = VerifyApexPayload(apex, *verity_data, hashtree_file);
+        !st.ok()) {
+      return st.error();
     }
   }
-  auto ret =
-      MountPackageImpl(apex, mount_point, temp_device_name, hashtree_file,
-                       /* verify_image = */ true, /* reuse_device= */ false,
-                       /* temp_mount = */ true);
+  auto ret = MountPackageImpl(apex, mount_point, temp_device_name,
+                              /* verify_image = */ true,
+                              /* reuse_device= */ false,
+                              /* temp_mount = */ true);
   if (!ret.ok()) {
-    LOG(DEBUG) << "Cleaning up " << hashtree_file;
-    if (TEMP_FAILURE_RETRY(unlink(hashtree_file.c_str())) != 0) {
-      PLOG(ERROR) << "Failed to unlink " << hashtree_file;
-    }
-  } else {
-    gMountedApexes.AddMountedApex(apex.GetManifest().name(), false, *ret);
+    return ret.error();
   }
+  cleanup.Disable();
+  gMountedApexes.AddMountedApex(apex.GetManifest().name(), false, *ret);
   return ret;
 }
 
@@ -788,8 +937,8 @@ Result<void> RunVerifyFnInsideTempMount(const ApexFile& apex,
                                         const VerifyFn& verify_fn,
                                         bool unmount_during_cleanup) {
   // Temp mount image of this apex to validate it was properly signed;
-  // this will also read the entire block device through dm-verity, so
-  // we can be sure there is no corruption.
+  // this will also check every block of its payload, so we can be sure
+  // there is no corruption.
   const std::string& temp_mount_point =
       apexd_private::GetPackageTempMountPoint(apex.GetManifest());
 
@@ -848,7 +997,7 @@ Result<void> ValidateStagingShimApex(const ApexFile& to) {
     return system_shim.error();
   }
   auto verify_fn = [&](const std::string& system_apex_path) {
-    return shim::ValidateUpdate(system_apex_path, to.GetPath());
+    return shim::ValidateUpdate(system_apex_path, to);
   };
   return RunVerifyFnInsideTempMount(*system_shim, verify_fn, true);
 }
@@ -924,7 +1073,7 @@ static constexpr auto kSepolicyApexName = "com.android.sepolicy.apex";
 
 // A version of apex verification that happens on SubmitStagedSession.
 // This function contains checks that might be expensive to perform, e.g. temp
-// mounting a package and reading entire dm-verity device, and shouldn't be run
+// mounting a package and hashing its entire payload, and shouldn't be run
 // during boot.
 Result<void> VerifyPackageStagedInstall(const ApexFile& apex_file) {
   const auto& verify_package_boot_status = VerifyPackageBoot(apex_file);
@@ -1099,6 +1248,11 @@ Result<void> RestoreActivePackages() {
   return {};
 }
 
+std::string GetMountedMarkerPath(const ApexManifest& manifest) {
+  return StringPrintf("%s/%s/%s", kApexRoot, kApexMountedSubDir,
+                      manifest.name().c_str());
+}
+
 Result<void> UnmountPackage(const ApexFile& apex, bool allow_latest,
                             bool deferred) {
   LOG(INFO) << "Unmounting " << GetPackageId(apex.GetManifest());
@@ -1127,6 +1281,10 @@ Result<void> UnmountPackage(const ApexFile& apex, bool allow_latest,
       return Error() << "Package " << apex.GetPath() << " is active";
     }
     std::string mount_point = apexd_private::GetActiveMountPoint(manifest);
+    std::string marker = GetMountedMarkerPath(manifest);
+    if (unlink(marker.c_str()) != 0 && errno != ENOENT) {
+      PLOG(ERROR) << "Failed to remove " << marker;
+    }
     LOG(INFO) << "Unmounting " << mount_point;
     if (umount2(mount_point.c_str(), UMOUNT_NOFOLLOW) != 0) {
       return ErrnoError() << "Failed to unmount " << mount_point;
@@ -1144,6 +1302,32 @@ Result<void> UnmountPackage(const ApexFile& apex, bool allow_latest,
   return Unmount(*data, deferred);
 }
 
+// Opens the APEX mounted from |full_path|. A compressed APEX can only be
+// mounted in place, from the original APEX stored in it: decompressed ones are
+// mounted from the decompression directory instead.
+Result<ApexFile> OpenMountedApex(const std::string& full_path) {
+  Result<ApexFile> apex_file = ApexFile::Open(full_path);
+  if (!apex_file.ok() || !apex_file->IsCompressed()) {
+    return apex_file;
+  }
+  return apex_file->OpenStoredOriginalApex();
+}
+
+// Returns the APEX file |data| was mounted from. Mounts created by this process
+// carry a snapshot of it, only the ones discovered by PopulateFromMounts
+// require opening the file again.
+Result<std::shared_ptr<const ApexFile>> GetMountedApexFile(
+    const MountedApexData& data) {
+  if (data.apex_file != nullptr) {
+    return data.apex_file;
+  }
+  Result<ApexFile> apex_file = OpenMountedApex(data.full_path);
+  if (!apex_file.ok()) {
+    return apex_file.error();
+  }
+  return std::make_shared<const ApexFile>(std::move(*apex_file));
+}
+
 }  // namespace
 
 void SetConfig(const ApexdConfig& config) { gConfig = config; }
@@ -1151,10 +1335,9 @@ void SetConfig(const ApexdConfig& config) { gConfig = config; }
 Result<void> MountPackage(const ApexFile& apex, const std::string& mount_point,
                           const std::string& device_name, bool reuse_device,
                           bool temp_mount) {
-  auto ret =
-      MountPackageImpl(apex, mount_point, device_name,
-                       GetHashTreeFileName(apex, /* is_new= */ false),
-                       /* verify_image = */ false, reuse_device, temp_mount);
+  auto ret = MountPackageImpl(apex, mount_point, device_name,
+                              /* verify_image = */ false, reuse_device,
+                              temp_mount);
   if (!ret.ok()) {
     return ret.error();
   }
@@ -1342,26 +1525,59 @@ bool IsValidPackageName(const std::string& package_name) {
   return kBannedApexName.count(package_name) == 0;
 }
 
-// Activates given APEX file.
-//
-// In a nutshel activation of an APEX consist of the following steps:
-//   1. Create loop devices that is backed by the given apex_file
-//   2. If apex_file resides on /data partition then create a dm-verity device
-//    backed by the loop device created in step (1).
-//   3. Create a mount point under /apex for this APEX.
-//   4. Mount the dm-verity device on that mount point.
-//     4.1 In case APEX file comes from a partition that is already
-//       dm-verity protected (e.g. /system) then we mount the loop device.
-//
-//
-// Note: this function only does the job to activate this single APEX.
-// In case this APEX file contributes to the /apex/sharedlibs mount point, then
-// you must also call ContributeToSharedLibs after finishing activating all
-// APEXes. See ActivateApexPackages for more context.
-Result<void> ActivatePackageImpl(const ApexFile& apex_file,
-                                 const std::string& device_name,
-                                 bool reuse_device) {
-  ATRACE_NAME("ActivatePackageImpl");
+namespace {
+
+// What is already mounted for the package of an APEX that is being activated.
+struct MountedVersions {
+  // Whether no higher version of the package is mounted.
+  bool is_newest_version = true;
+  // Whether the same version of the package is mounted.
+  bool version_found_mounted = false;
+  // Whether the same version of the package is mounted and active.
+  bool version_found_active = false;
+};
+
+MountedVersions GetMountedVersions(const ApexManifest& manifest) {
+  MountedVersions result;
+  uint64_t new_version = manifest.version();
+  // Don't open files while holding the database lock.
+  std::vector<std::pair<MountedApexData, bool>> mounted;
+  gMountedApexes.ForallMountedApexes(
+      manifest.name(), [&](const MountedApexData& data, bool latest) {
+        mounted.emplace_back(data, latest);
+      });
+  for (const auto& [data, latest] : mounted) {
+    auto other_apex = GetMountedApexFile(data);
+    if (!other_apex.ok()) {
+      continue;
+    }
+    uint64_t other_version = (*other_apex)->GetManifest().version();
+    if (other_version == new_version) {
+      result.version_found_mounted = true;
+      result.version_found_active = latest;
+    }
+    if (other_version > new_version) {
+      result.is_newest_version = false;
+    }
+  }
+  return result;
+}
+
+// An APEX half-way through activation. See PrepareActivation.
+struct PreparedActivation {
+  const ApexFile* apex = nullptr;
+  // Set if the APEX still needs to be mounted.
+  std::optional<ApexDevices> devices;
+  // Whether the same version is already active and there is nothing left to do.
+  bool already_active = false;
+};
+
+// First half of ActivatePackageImpl: validates |apex_file| and creates the
+// block devices it is going to be mounted from.
+Result<PreparedActivation> PrepareActivation(const ApexFile& apex_file,
+                                             const std::string& device_name,
+                                             bool reuse_device) {
+  ATRACE_NAME("PrepareActivation");
   const ApexManifest& manifest = apex_file.GetManifest();
 
   if (!IsValidPackageName(manifest.name())) {
@@ -1376,57 +1592,65 @@ Result<void> ActivatePackageImpl(const ApexFile& apex_file,
     Result<void> result = VerifyPackageBoot(apex_file);
     if (!result.ok()) {
       LOG(ERROR) << "Failed to validate shim apex: " << apex_file.GetPath();
-      return result;
+      return result.error();
     }
   }
 
+  PreparedActivation prepared;
+  prepared.apex = &apex_file;
+
   // See whether we think it's active, and do not allow to activate the same
-  // version. Also detect whether this is the highest version.
-  // We roll this into a single check.
-  bool is_newest_version = true;
-  bool version_found_mounted = false;
-  {
-    uint64_t new_version = manifest.version();
-    bool version_found_active = false;
-    gMountedApexes.ForallMountedApexes(
-        manifest.name(), [&](const MountedApexData& data, bool latest) {
-          Result<ApexFile> other_apex = ApexFile::Open(data.full_path);
-          if (!other_apex.ok()) {
-            return;
-          }
-          if (static_cast<uint64_t>(other_apex->GetManifest().version()) ==
-              new_version) {
-            version_found_mounted = true;
-            version_found_active = latest;
-          }
-          if (static_cast<uint64_t>(other_apex->GetManifest().version()) >
-              new_version) {
-            is_newest_version = false;
-          }
-        });
-    // If the package provides shared libraries to other APEXs, we need to
-    // activate all versions available (i.e. preloaded on /system/apex and
-    // available on /data/apex/active). The reason is that there might be some
-    // APEXs loaded from /system/apex that reference the libraries contained on
-    // the preloaded version of the apex providing shared libraries.
-    if (version_found_active && !manifest.providesharedapexlibs()) {
-      LOG(DEBUG) << "Package " << manifest.name() << " with version "
-                 << manifest.version() << " already active";
-      return {};
-    }
-  }
+  // version.
+  MountedVersions versions = GetMountedVersions(manifest);
+  // If the package provides shared libraries to other APEXs, we need to
+  // activate all versions available (i.e. preloaded on /system/apex and
+  // available on /data/apex/active). The reason is that there might be some
+  // APEXs loaded from /system/apex that reference the libraries contained on
+  // the preloaded version of the apex providing shared libraries.
+  if (versions.version_found_active && !manifest.providesharedapexlibs()) {
+    LOG(DEBUG) << "Package " << manifest.name() << " with version "
+               << manifest.version() << " already active";
+    prepared.already_active = true;
+    return prepared;
+  }
+
+  if (!versions.version_found_mounted) {
+    auto devices = CreateApexDevices(apex_file, device_name,
+                                     /* verify_image = */ false, reuse_device,
+                                     /* temp_mount = */ false);
+    if (!devices.ok()) {
+      return devices.error();
+    }
+    prepared.devices = std::move(*devices);
+  }
+  return prepared;
+}
 
+// Second half of ActivatePackageImpl: mounts the APEX prepared by
+// PrepareActivation and makes it active if it is the newest version.
+Result<void> FinishActivation(PreparedActivation prepared) {
+  ATRACE_NAME("FinishActivation");
+  if (prepared.already_active) {
+    return {};
+  }
+  const ApexFile& apex_file = *prepared.apex;
+  const ApexManifest& manifest = apex_file.GetManifest();
   const std::string& mount_point =
       apexd_private::GetPackageMountPoint(manifest);
 
-  if (!version_found_mounted) {
-    auto mount_status = MountPackage(apex_file, mount_point, device_name,
-                                     reuse_device, /*temp_mount=*/false);
+  if (prepared.devices.has_value()) {
+    auto mount_status =
+        MountApexDevices(apex_file, std::move(*prepared.devices), mount_point);
     if (!mount_status.ok()) {
-      return mount_status;
+      return mount_status.error();
     }
+    gMountedApexes.AddMountedApex(manifest.name(), false, *mount_status);
   }
 
+  // Other versions of the package might have been mounted since
+  // PrepareActivation, so check again.
+  const bool is_newest_version = GetMountedVersions(manifest).is_newest_version;
+
   // For packages providing shared libraries, avoid creating a bindmount since
   // there is no use for the /apex/<package_name> directory. However, mark the
   // highest version as latest so that the latest version of the package can be
@@ -1460,6 +1684,37 @@ Result<void> ActivatePackageImpl(const ApexFile& apex_file,
   return {};
 }
 
+}  // namespace
+
+// Activates given APEX file.
+//
+// In a nutshel activation of an APEX consist of the following steps:
+//   1. Create loop devices that is backed by the given apex_file
+//   2. If apex_file resides on /data partition then create a dm-verity device
+//    backed by the loop device created in step (1).
+//   3. Create a mount point under /apex for this APEX.
+//   4. Mount the dm-verity device on that mount point.
+//     4.1 In case APEX file comes from a partition that is already
+//       dm-verity protected (e.g. /system) then we mount the loop device.
+//
+// Steps 1-2 are done by PrepareActivation and steps 3-4 by FinishActivation,
+// which lets ActivateApexPackages run them as separate pipeline stages.
+//
+// Note: this function only does the job to activate this single APEX.
+// In case this APEX file contributes to the /apex/sharedlibs mount point, then
+// you must also call ContributeToSharedLibs after finishing activating all
+// APEXes. See ActivateApexPackages for more context.
+Result<void> ActivatePackageImpl(const ApexFile& apex_file,
+                                 const std::string& device_name,
+                                 bool reuse_device) {
+  ATRACE_NAME("ActivatePackageImpl");
+  auto prepared = PrepareActivation(apex_file, device_name, reuse_device);
+  if (!prepared.ok()) {
+    return prepared.error();
+  }
+  return FinishActivation(std::move(*prepared));
+}
+
 // Wrapper around ActivatePackageImpl.
 // Do not use, this wrapper is going away.
 Result<void> ActivatePackage(const std::string& full_path) {
@@ -1554,20 +1809,23 @@ Result<ClassPath> MountAndDeriveClassPath(
 }
 
 std::vector<ApexFile> GetActivePackages() {
-  std::vector<ApexFile> ret;
+  std::vector<MountedApexData> active;
   gMountedApexes.ForallMountedApexes(
       [&](const std::string&, const MountedApexData& data, bool latest) {
-        if (!latest) {
-          return;
-        }
-
-        Result<ApexFile> apex_file = ApexFile::Open(data.full_path);
-        if (!apex_file.ok()) {
-          return;
+        if (latest) {
+          active.emplace_back(data);
         }
-        ret.emplace_back(std::move(*apex_file));
       });
 
+  std::vector<ApexFile> ret;
+  ret.reserve(active.size());
+  for (const auto& data : active) {
+    auto apex_file = GetMountedApexFile(data);
+    if (!apex_file.ok()) {
+      continue;
+    }
+    ret.emplace_back(**apex_file);
+  }
   return ret;
 }
 
@@ -1741,91 +1999,369 @@ namespace {
 
 enum ActivationMode { kBootstrapMode = 0, kBootMode, kOtaChrootMode, kVmMode };
 
-std::vector<Result<const ApexFile*>> ActivateApexWorker(
-    ActivationMode mode, std::queue<const ApexFile*>& apex_queue,
-    std::mutex& mutex) {
-  ATRACE_NAME("ActivateApexWorker");
-  std::vector<Result<const ApexFile*>> ret;
+std::string GetActivationDeviceName(ActivationMode mode,
+                                    const ApexManifest& manifest) {
+  std::string device_name;
+  if (mode == ActivationMode::kBootMode) {
+    device_name = manifest.name();
+  } else {
+    device_name = GetPackageId(manifest);
+  }
+  if (mode == ActivationMode::kOtaChrootMode) {
+    device_name += ".chroot";
+  }
+  return device_name;
+}
 
-  while (true) {
-    const ApexFile* apex;
+// Returns whether |apex| is the active version of its package.
+bool IsActiveApex(const ApexFile& apex) {
+  bool active = false;
+  gMountedApexes.ForallMountedApexes(
+      apex.GetManifest().name(),
+      [&](const MountedApexData& data, bool latest) {
+        if (latest && data.full_path == apex.GetPath()) {
+          active = true;
+        }
+      });
+  return active;
+}
+
+// Lets early services that only need a single APEX start as soon as
+// /apex/<name> is mounted, by waiting for /apex/.mounted/<name> instead of
+// apexd.status.
+void PublishApexMounted(const ApexManifest& manifest) {
+  const std::string dir = StringPrintf("%s/%s", kApexRoot, kApexMountedSubDir);
+  if (auto st = CreateDirIfNeeded(dir, 0755); !st.ok()) {
+    LOG(WARNING) << st.error();
+    return;
+  }
+  const std::string marker = GetMountedMarkerPath(manifest);
+  unique_fd fd(TEMP_FAILURE_RETRY(
+      open(marker.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644)));
+  if (fd.get() == -1) {
+    PLOG(WARNING) << "Failed to create " << marker;
+  }
+}
+
+// Activates a set of APEXes in two pipelined stages on the executor:
+//   1. Creating loop and dm-verity devices (PrepareActivation), which is
+//      mostly waiting for ueventd.
+//   2. Mounting the devices and bind mounting them (FinishActivation).
+// Each stage has its own concurrency limit, so that mounting APEXes doesn't
+// have to wait until all devices are created, and vice versa. The number of
+// APEXes that have devices but are not mounted yet is bounded as well.
+//
+// Within each stage APEXes are picked by activation priority (see
+// GetActivationPriority), ties are broken by the order they were passed in.
+//
+// Tasks never block on each other: every finished stage schedules whatever
+// became runnable. A scheduled task only picks the APEX it works on once it
+// starts running, so that the order in which the executor runs tasks doesn't
+// matter.
+class ActivationPipeline final
+    : public std::enable_shared_from_this<ActivationPipeline> {
+ public:
+  struct Limits {
+    size_t device_threads;
+    size_t mount_threads;
+    size_t max_in_flight;
+  };
+
+  ActivationPipeline(ActivationMode mode, ApexdExecutor::Priority priority,
+                     const Limits& limits,
+                     std::unordered_map<std::string, int32_t> overrides)
+      : mode_(mode),
+        priority_(priority),
+        limits_(limits),
+        overrides_(std::move(overrides)) {}
+
+  // Queues |apex| for activation. It must outlive this pipeline.
+  void Add(const ApexFile& apex) REQUIRES(!mutex_) {
     {
-      std::lock_guard lock(mutex);
-      if (apex_queue.empty()) break;
-      apex = apex_queue.front();
-      apex_queue.pop();
+      std::lock_guard lock(mutex_);
+      CHECK(!closed_);
+      device_queue_.push_back(entries_.size());
+      entries_.push_back(Entry{
+          .apex = &apex,
+          .priority = GetActivationPriority(apex.GetManifest(), overrides_),
+      });
+      ++remaining_;
     }
+    Schedule();
+  }
 
-    std::string device_name;
-    if (mode == ActivationMode::kBootMode) {
-      device_name = apex->GetManifest().name();
-    } else {
-      device_name = GetPackageId(apex->GetManifest());
+  // Waits until all the APEXes added so far are processed, and returns the
+  // result of activating each of them, in no particular order. No APEXes can
+  // be added afterwards.
+  std::vector<Result<const ApexFile*>> Finish() REQUIRES(!mutex_) {
+    ATRACE_NAME("ActivationPipeline::Finish");
+    bool finished;
+    {
+      std::lock_guard lock(mutex_);
+      closed_ = true;
+      finished = IsDoneLocked();
     }
-    if (mode == ActivationMode::kOtaChrootMode) {
-      device_name += ".chroot";
+    if (finished) {
+      all_done_.set_value();
     }
-    bool reuse_device = mode == ActivationMode::kBootMode;
-    auto res = ActivatePackageImpl(*apex, device_name, reuse_device);
-    if (!res.ok()) {
-      ret.push_back(Error() << "Failed to activate " << apex->GetPath() << "("
-                            << device_name << "): " << res.error());
-    } else {
-      ret.push_back({apex});
+    ApexdExecutor::GetInstance().Wait(all_done_.get_future(), priority_);
+    std::lock_guard lock(mutex_);
+    return std::move(results_);
+  }
+
+ private:
+  void Schedule() REQUIRES(!mutex_) {
+    size_t num_create = 0;
+    size_t num_mount = 0;
+    {
+      std::lock_guard lock(mutex_);
+      // Mounting first, it frees up room for creating more devices.
+      while (mount_queue_.size() > mount_claims_ &&
+             mount_running_ < limits_.mount_threads) {
+        ++mount_claims_;
+        ++mount_running_;
+        ++num_mount;
+      }
+      while (device_queue_.size() > device_claims_ &&
+             device_running_ < limits_.device_threads &&
+             in_flight_ < limits_.max_in_flight) {
+        ++device_claims_;
+        ++device_running_;
+        ++in_flight_;
+        ++num_create;
+      }
+    }
+    ApexdExecutor& executor = ApexdExecutor::GetInstance();
+    for (size_t i = 0; i < num_mount; i++) {
+      executor.Submit(
+          "ActivationPipeline::Mount",
+          [self = shared_from_this()]() { self->MountStage(); }, priority_);
+    }
+    for (size_t i = 0; i < num_create; i++) {
+      executor.Submit(
+          "ActivationPipeline::CreateDevices",
+          [self = shared_from_this()]() { self->CreateDevicesStage(); },
+          priority_);
+    }
+  }
+
+  // Removes the APEX with the highest priority from |queue|.
+  size_t PopNextLocked(std::vector<size_t>& queue) REQUIRES(mutex_) {
+    auto best = queue.begin();
+    for (auto it = queue.begin(); it != queue.end(); ++it) {
+      const int32_t priority = entries_[*it].priority;
+      const int32_t best_priority = entries_[*best].priority;
+      if (priority > best_priority ||
+          (priority == best_priority && *it < *best)) {
+        best = it;
+      }
     }
+    size_t index = *best;
+    queue.erase(best);
+    return index;
   }
 
-  return ret;
-}
+  // Whether all the APEXes are processed and no more are coming. Only returns
+  // true once, so that |all_done_| is set exactly once.
+  bool IsDoneLocked() REQUIRES(mutex_) {
+    if (!closed_ || remaining_ > 0 || done_) {
+      return false;
+    }
+    done_ = true;
+    return true;
+  }
 
-Result<void> ActivateApexPackages(const std::vector<ApexFileRef>& apexes,
-                                  ActivationMode mode) {
-  ATRACE_NAME("ActivateApexPackages");
-  std::queue<const ApexFile*> apex_queue;
-  std::mutex apex_queue_mutex;
+  void CreateDevicesStage() REQUIRES(!mutex_) {
+    size_t index;
+    const ApexFile* apex_ptr;
+    {
+      std::lock_guard lock(mutex_);
+      --device_claims_;
+      index = PopNextLocked(device_queue_);
+      apex_ptr = entries_[index].apex;
+    }
+    const ApexFile& apex = *apex_ptr;
+    const std::string device_name =
+        GetActivationDeviceName(mode_, apex.GetManifest());
+    bool reuse_device = mode_ == ActivationMode::kBootMode;
+    auto prepared = PrepareActivation(apex, device_name, reuse_device);
+    bool finished = false;
+    {
+      std::lock_guard lock(mutex_);
+      --device_running_;
+      if (prepared.ok()) {
+        entries_[index].prepared = std::move(*prepared);
+        mount_queue_.push_back(index);
+      } else {
+        results_.push_back(Error() << "Failed to activate " << apex.GetPath()
+                                   << "(" << device_name
+                                   << "): " << prepared.error());
+        --in_flight_;
+        --remaining_;
+        finished = IsDoneLocked();
+      }
+    }
+    Advance(finished);
+  }
 
-  for (const ApexFile& apex : apexes) {
-    apex_queue.emplace(&apex);
+  void MountStage() REQUIRES(!mutex_) {
+    const ApexFile* apex_ptr;
+    PreparedActivation prepared;
+    {
+      std::lock_guard lock(mutex_);
+      --mount_claims_;
+      Entry& entry = entries_[PopNextLocked(mount_queue_)];
+      apex_ptr = entry.apex;
+      prepared = std::move(*entry.prepared);
+      entry.prepared.reset();
+    }
+    const ApexFile& apex = *apex_ptr;
+    auto res = FinishActivation(std::move(prepared));
+    if (res.ok() && ShouldPublishMounted() &&
+        !apex.GetManifest().providesharedapexlibs() && IsActiveApex(apex)) {
+      PublishApexMounted(apex.GetManifest());
+    }
+    bool finished = false;
+    {
+      std::lock_guard lock(mutex_);
+      --mount_running_;
+      --in_flight_;
+      if (res.ok()) {
+        results_.push_back({&apex});
+      } else {
+        results_.push_back(
+            Error() << "Failed to activate " << apex.GetPath() << "("
+                    << GetActivationDeviceName(mode_, apex.GetManifest())
+                    << "): " << res.error());
+      }
+      --remaining_;
+      finished = IsDoneLocked();
+    }
+    Advance(finished);
   }
 
-  // Creates threads as many as half number of cores for the performance.
-  size_t worker_num = std::max(get_nprocs_conf() >> 1, 1);
-  worker_num = std::min(apex_queue.size(), worker_num);
+  void Advance(bool finished) REQUIRES(!mutex_) {
+    if (finished) {
+      all_done_.set_value();
+      return;
+    }
+    Schedule();
+  }
 
+  // Markers are only meaningful for the APEXes mounted for this boot.
+  bool ShouldPublishMounted() const {
+    return mode_ == ActivationMode::kBootstrapMode ||
+           mode_ == ActivationMode::kBootMode;
+  }
+
+  struct Entry {
+    const ApexFile* apex;
+    int32_t priority;
+    // Set between the two stages.
+    std::optional<PreparedActivation> prepared;
+  };
+
+  const ActivationMode mode_;
+  const ApexdExecutor::Priority priority_;
+  const Limits limits_;
+  const std::unordered_map<std::string, int32_t> overrides_;
+  std::promise<void> all_done_;
+
+  std::mutex mutex_;
+  // Never shrinks, indices into it are used to refer to APEXes.
+  std::deque<Entry> entries_ GUARDED_BY(mutex_);
+  std::vector<size_t> device_queue_ GUARDED_BY(mutex_);
+  std::vector<size_t> mount_queue_ GUARDED_BY(mutex_);
+  // Tasks that were scheduled for a stage but haven't picked an APEX yet.
+  size_t device_claims_ GUARDED_BY(mutex_) = 0;
+  size_t mount_claims_ GUARDED_BY(mutex_) = 0;
+  std::vector<Result<const ApexFile*>> results_ GUARDED_BY(mutex_);
+  size_t device_running_ GUARDED_BY(mutex_) = 0;
+  size_t mount_running_ GUARDED_BY(mutex_) = 0;
+  // APEXes whose devices are being created or are waiting to be mounted.
+  size_t in_flight_ GUARDED_BY(mutex_) = 0;
+  size_t remaining_ GUARDED_BY(mutex_) = 0;
+  bool closed_ GUARDED_BY(mutex_) = false;
+  bool done_ GUARDED_BY(mutex_) = false;
+};
+
+std::unordered_map<std::string, int32_t> GetActivationPriorityOverrides() {
+  auto prop =
+      android::sysprop::ApexProperties::activation_priority_overrides();
+  if (!prop.has_value() || prop->empty()) {
+    return {};
+  }
+  auto overrides = ParseActivationPriorityOverrides(*prop);
+  if (!overrides.ok()) {
+    LOG(ERROR) << "Ignoring activation priority overrides: "
+               << overrides.error();
+    return {};
+  }
+  return std::move(*overrides);
+}
+
+ActivationPipeline::Limits GetActivationLimits() {
   // On -eng builds there might be two different pre-installed art apexes.
   // Attempting to activate them in parallel will result in UB (e.g.
   // apexd-bootstrap might crash). In order to avoid this, for the time being on
   // -eng builds activate apexes sequentially.
   // TODO(b/176497601): remove this.
   if (GetProperty("ro.build.type", "") == "eng") {
-    worker_num = 1;
+    return {.device_threads = 1, .mount_threads = 1, .max_in_flight = 1};
   }
+  using android::sysprop::ApexProperties;
+  const size_t threads = ApexdExecutor::GetInstance().GetNumThreads();
+  auto get = [](std::optional<uint32_t> value, size_t default_value) {
+    return value.has_value() && *value > 0 ? static_cast<size_t>(*value)
+                                           : default_value;
+  };
+  return {
+      .device_threads =
+          get(ApexProperties::activation_device_threads(), threads),
+      .mount_threads = get(ApexProperties::activation_mount_threads(), threads),
+      .max_in_flight =
+          get(ApexProperties::activation_max_in_flight(), threads * 2),
+  };
+}
+
+// Produces APEXes that become available while ActivateApexPackages is already
+// running, e.g. the ones that have to be decompressed first. Must pass each of
+// them to |add| and only return once there are no more.
+using LateApexesFn =
+    std::function<void(const std::function<void(const ApexFile&)>& add)>;
 
-  std::vector<std::future<std::vector<Result<const ApexFile*>>>> futures;
-  futures.reserve(worker_num);
-  for (size_t i = 0; i < worker_num; i++) {
-    futures.push_back(std::async(std::launch::async, ActivateApexWorker,
-                                 std::ref(mode), std::ref(apex_queue),
-                                 std::ref(apex_queue_mutex)));
+Result<void> ActivateApexPackages(const std::vector<ApexFileRef>& apexes,
+                                  ActivationMode mode,
+                                  const LateApexesFn& late_apexes = nullptr) {
+  ATRACE_NAME("ActivateApexPackages");
+  // Bootstrap APEXes block the rest of early boot, so they go first.
+  const auto priority = mode == ActivationMode::kBootstrapMode
+                            ? ApexdExecutor::Priority::kHigh
+                            : ApexdExecutor::Priority::kNormal;
+  auto pipeline = std::make_shared<ActivationPipeline>(
+      mode, priority, GetActivationLimits(), GetActivationPriorityOverrides());
+  for (const ApexFile& apex : apexes) {
+    pipeline->Add(apex);
+  }
+  if (late_apexes) {
+    late_apexes([&pipeline](const ApexFile& apex) { pipeline->Add(apex); });
   }
 
   size_t activated_cnt = 0;
   size_t failed_cnt = 0;
   std::string error_message;
   std::vector<const ApexFile*> activated_sharedlibs_apexes;
-  for (size_t i = 0; i < futures.size(); i++) {
-    for (const auto& res : futures[i].get()) {
-      if (res.ok()) {
-        ++activated_cnt;
-        if (res.value()->GetManifest().providesharedapexlibs()) {
-          activated_sharedlibs_apexes.push_back(res.value());
-        }
-      } else {
-        ++failed_cnt;
-        LOG(ERROR) << res.error();
-        if (failed_cnt == 1) {
-          error_message = res.error().message();
-        }
+  for (const auto& res : pipeline->Finish()) {
+    if (res.ok()) {
+      ++activated_cnt;
+      if (res.value()->GetManifest().providesharedapexlibs()) {
+        activated_sharedlibs_apexes.push_back(res.value());
+      }
+    } else {
+      ++failed_cnt;
+      LOG(ERROR) << res.error();
+      if (failed_cnt == 1) {
+        error_message = res.error().message();
       }
     }
   }
@@ -2359,38 +2895,19 @@ Result<void> StagePackages(const std::vector<std::string>& tmp_paths) {
 
   // Ensure the APEX gets removed on failure.
   std::unordered_set<std::string> staged_files;
-  std::vector<std::string> changed_hashtree_files;
-  auto deleter = [&staged_files, &changed_hashtree_files]() {
+  auto deleter = [&staged_files]() {
     for (const std::string& staged_path : staged_files) {
       if (TEMP_FAILURE_RETRY(unlink(staged_path.c_str())) != 0) {
         PLOG(ERROR) << "Unable to unlink " << staged_path;
       }
     }
-    for (const std::string& hashtree_file : changed_hashtree_files) {
-      if (TEMP_FAILURE_RETRY(unlink(hashtree_file.c_str())) != 0) {
-        PLOG(ERROR) << "Unable to unlink " << hashtree_file;
-      }
-    }
   };
   auto scope_guard = android::base::make_scope_guard(deleter);
 
   std::unordered_set<std::string> staged_packages;
   for (const ApexFile& apex_file : *apex_files) {
-    // First promote new hashtree file to the one that will be used when
-    // mounting apex.
-    std::string new_hashtree_file = GetHashTreeFileName(apex_file,
-                                                        /* is_new = */ true);
-    std::string old_hashtree_file = GetHashTreeFileName(apex_file,
-                                                        /* is_new = */ false);
-    if (access(new_hashtree_file.c_str(), F_OK) == 0) {
-      if (TEMP_FAILURE_RETRY(rename(new_hashtree_file.c_str(),
-                                    old_hashtree_file.c_str())) != 0) {
-        return ErrnoError() << "Failed to move " << new_hashtree_file << " to "
-                            << old_hashtree_file;
-      }
-      changed_hashtree_files.emplace_back(std::move(old_hashtree_file));
-    }
-    // And only then move apex to /data/apex/active.
+    // The hashtree generated when verifying the session is already where the
+    // next boot looks for it.
     std::string dest_path = StageDestPath(apex_file);
     if (access(dest_path.c_str(), F_OK) == 0) {
       LOG(DEBUG) << dest_path << " already exists. Deleting";
@@ -2557,9 +3074,23 @@ Result<void> CreateSharedLibsApexDir() {
   return {};
 }
 
+namespace {
+
+// Applies the apexd.config.executor.threads override, if any. Has to run
+// before anything is submitted to the executor.
+void ConfigureExecutor() {
+  auto threads = android::sysprop::ApexProperties::executor_threads();
+  if (threads.has_value() && *threads > 0) {
+    ApexdExecutor::GetInstance().Configure(*threads);
+  }
+}
+
+}  // namespace
+
 int OnBootstrap() {
   ATRACE_NAME("OnBootstrap");
   auto time_started = boot_clock::now();
+  ConfigureExecutor();
 
   ApexFileRepository& instance = ApexFileRepository::GetInstance();
   Result<void> status =
@@ -2570,14 +3101,22 @@ int OnBootstrap() {
   }
 
   const auto& pre_installed_apexes = instance.GetPreInstalledApexFiles();
-  int loop_device_cnt = pre_installed_apexes.size();
+  int loop_device_cnt = 0;
   // Find all bootstrap apexes
   std::vector<ApexFileRef> bootstrap_apexes;
   for (const auto& apex : pre_installed_apexes) {
+    // Pre-installed erofs APEXes are mounted from their file. If one of them
+    // is updated, the loop device for the update is allocated on demand.
+    const bool needs_loop_device = !CanMountFromFile(apex.get());
+    if (needs_loop_device) {
+      loop_device_cnt++;
+    }
     if (IsBootstrapApex(apex.get())) {
       LOG(INFO) << "Found bootstrap APEX " << apex.get().GetPath();
       bootstrap_apexes.push_back(apex);
-      loop_device_cnt++;
+      if (needs_loop_device) {
+        loop_device_cnt++;
+      }
     }
     if (apex.get().GetManifest().providesharedapexlibs()) {
       LOG(INFO) << "Found sharedlibs APEX " << apex.get().GetPath();
@@ -2678,6 +3217,7 @@ void InitializeVold(CheckpointInterface* checkpoint_service) {
 
 void Initialize(CheckpointInterface* checkpoint_service) {
   InitializeVold(checkpoint_service);
+  ConfigureExecutor();
   ApexFileRepository& instance = ApexFileRepository::GetInstance();
   Result<void> status = instance.AddPreInstalledApex(kApexPackageBuiltinDirs);
   if (!status.ok()) {
@@ -2837,11 +3377,69 @@ Result<ApexFile> OpenAndValidateDecompressedApex(const ApexFile& capex,
   return std::move(*apex);
 }
 
+// Builds the hashtree of a freshly decompressed |apex|, if it doesn't embed
+// one. Its content is still in the page cache at this point, which saves
+// reading it back from disk on the first mount, where PrepareHashTree() then
+// finds the hashtree up to date. With apexd.config.hashtree.sidecar, the
+// hashtree goes into the APEX file itself, see StoreSidecarHashTree().
+Result<void> PrepareDecompressedApexHashTree(const ApexFile& apex) {
+  auto tag = "PrepareDecompressedApexHashTree: " + apex.GetManifest().name();
+  ATRACE_NAME(tag.c_str());
+  auto verity_data = apex.VerifyApexVerity(apex.GetBundledPublicKey());
+  if (!verity_data.ok()) {
+    return verity_data.error();
+  }
+  if (verity_data->desc->tree_size != 0) {
+    return {};
+  }
+  // Saves the second loop device for a separate hashtree file. A decompressed
+  // APEX that can't be opened afterwards is simply decompressed again.
+  if (android::sysprop::ApexProperties::hashtree_sidecar().value_or(false)) {
+    auto st = StoreSidecarHashTree(apex, *verity_data);
+    if (st.ok()) {
+      return {};
+    }
+    LOG(WARNING) << "Using a separate hashtree for " << apex.GetPath() << ": "
+                 << st.error();
+  }
+  auto st =
+      PrepareHashTree(apex, *verity_data, GetHashTreeFileName(*verity_data));
+  if (!st.ok()) {
+    return st.error();
+  }
+  return {};
+}
+
+// Opens the original APEX stored uncompressed in |capex|, and validates it
+// just like a decompressed one. It can be mounted straight from |capex|, which
+// lives on a read-only partition, so there is no SELinux context to check.
+Result<ApexFile> OpenAndValidateStoredOriginalApex(const ApexFile& capex) {
+  auto apex = capex.OpenStoredOriginalApex();
+  if (!apex.ok()) {
+    return apex.error();
+  }
+  if (auto result = ValidateDecompressedApex(capex, *apex); !result.ok()) {
+    return result.error();
+  }
+  return std::move(*apex);
+}
+
 // Process a single compressed APEX. Returns the decompressed APEX if
 // successful.
 Result<ApexFile> ProcessCompressedApex(const ApexFile& capex,
                                        bool is_ota_chroot) {
   LOG(INFO) << "Processing compressed APEX " << capex.GetPath();
+  if (capex.HasStoredOriginalApex()) {
+    // Nothing to decompress. A decompressed APEX left behind by a previous
+    // boot is cleaned up by RemoveInactiveDataApex().
+    auto result = OpenAndValidateStoredOriginalApex(capex);
+    if (result.ok()) {
+      LOG(INFO) << "Mounting " << capex.GetPath() << " in place";
+      return result;
+    }
+    LOG(WARNING) << "Can't mount " << capex.GetPath()
+                 << " in place, decompressing it instead: " << result.error();
+  }
   const auto decompressed_apex_path =
       StringPrintf("%s/%s%s", gConfig->decompression_dir,
                    GetPackageId(capex.GetManifest()).c_str(),
@@ -2917,8 +3515,13 @@ Result<ApexFile> ProcessCompressedApex(const ApexFile& capex,
   // There was no way to avoid decompression
 
   // Clean up reserved space before decompressing capex
-  if (auto ret = DeleteDirContent(gConfig->ota_reserved_dir); !ret.ok()) {
-    LOG(ERROR) << "Failed to clean up reserved space: " << ret.error();
+  {
+    // Other CAPEXes might be doing the same in parallel.
+    static std::mutex reserved_dir_mutex;
+    std::lock_guard lock(reserved_dir_mutex);
+    if (auto ret = DeleteDirContent(gConfig->ota_reserved_dir); !ret.ok()) {
+      LOG(ERROR) << "Failed to clean up reserved space: " << ret.error();
+    }
   }
 
   auto decompression_dest =
@@ -2943,8 +3546,16 @@ Result<ApexFile> ProcessCompressedApex(const ApexFile& capex,
   if (!return_apex.ok()) {
     return Error() << "Failed to decompress CAPEX: " << return_apex.error();
   }
+  // Only an optimization: without it, the hashtree is built on activation.
+  if (auto st = PrepareDecompressedApexHashTree(*return_apex); !st.ok()) {
+    LOG(WARNING) << "Failed to prepare hashtree of " << decompression_dest
+                 << ": " << st.error();
+  }
 
-  gChangedActiveApexes.insert(return_apex->GetManifest().name());
+  {
+    std::lock_guard lock(gChangedActiveApexesMutex);
+    gChangedActiveApexes.insert(return_apex->GetManifest().name());
+  }
   /// Release compressed blocks in case decompression_dest is on f2fs-compressed
   // filesystem.
   ReleaseF2fsCompressedBlocks(decompression_dest);
@@ -2952,6 +3563,155 @@ Result<ApexFile> ProcessCompressedApex(const ApexFile& capex,
   scope_guard.Disable();
   return return_apex;
 }
+
+// Free space needed to process |capex|, assuming that an existing decompressed
+// or OTA APEX can be reused.
+uint64_t GetSpaceNeededForDecompression(const ApexFile& capex) {
+  if (capex.HasStoredOriginalApex()) {
+    return 0;
+  }
+  const std::string package_id = GetPackageId(capex.GetManifest());
+  for (const char* suffix :
+       {kDecompressedApexPackageSuffix, kOtaApexPackageSuffix}) {
+    auto path = StringPrintf("%s/%s%s", gConfig->decompression_dir,
+                             package_id.c_str(), suffix);
+    if (access(path.c_str(), F_OK) == 0) {
+      return 0;
+    }
+  }
+  return capex.GetDecompressedSize().value_or(0);
+}
+
+// Decompresses a set of CAPEXes in parallel on the executor.
+//
+// At most as many CAPEXes as the executor has threads are processed at the
+// same time, and only as many as fit in the free space of the decompression
+// directory. A CAPEX that doesn't fit still gets its turn once nothing else is
+// running, and fails just like it would have when decompressing sequentially.
+class DecompressionPipeline final
+    : public std::enable_shared_from_this<DecompressionPipeline> {
+ public:
+  using ReadyFn = std::function<void(ApexFile)>;
+
+  DecompressionPipeline(const std::vector<ApexFileRef>& compressed_apex,
+                        bool is_ota_chroot, ReadyFn on_ready)
+      : is_ota_chroot_(is_ota_chroot),
+        on_ready_(std::move(on_ready)),
+        max_running_(ApexdExecutor::GetInstance().GetNumThreads()) {
+    for (const ApexFile& capex : compressed_apex) {
+      if (capex.IsCompressed()) {
+        pending_.push_back(&capex);
+      }
+    }
+    remaining_ = pending_.size();
+    struct statvfs buf;
+    if (statvfs(gConfig->decompression_dir, &buf) == 0) {
+      available_ = static_cast<uint64_t>(buf.f_bavail) * buf.f_frsize;
+    } else {
+      PLOG(WARNING) << "Failed to statvfs " << gConfig->decompression_dir;
+      available_ = 0;
+    }
+  }
+
+  // Returns once all the CAPEXes are processed.
+  void Run() REQUIRES(!mutex_) {
+    ATRACE_NAME("DecompressionPipeline::Run");
+    {
+      std::lock_guard lock(mutex_);
+      if (pending_.empty()) {
+        return;
+      }
+    }
+    std::future<void> done = all_done_.get_future();
+    Schedule();
+    ApexdExecutor::GetInstance().Wait(std::move(done));
+  }
+
+ private:
+  struct Job {
+    const ApexFile* capex;
+    uint64_t reserved;
+  };
+
+  void Schedule() REQUIRES(!mutex_) {
+    std::vector<Job> jobs;
+    {
+      std::lock_guard lock(mutex_);
+      while (!pending_.empty() && running_ < max_running_) {
+        const ApexFile* capex = pending_.front();
+        uint64_t needed = GetSpaceNeededForDecompression(*capex);
+        if (needed > available_ && running_ > 0) {
+          // Wait until the running ones are done.
+          break;
+        }
+        pending_.pop_front();
+        available_ -= std::min(needed, available_);
+        running_++;
+        jobs.push_back({.capex = capex, .reserved = needed});
+      }
+    }
+    for (const Job& job : jobs) {
+      ApexdExecutor::GetInstance().Submit(
+          "ProcessCompressedApex",
+          [self = shared_from_this(), job]() { self->Process(job); });
+    }
+  }
+
+  void Process(const Job& job) REQUIRES(!mutex_) {
+    auto decompressed = ProcessCompressedApex(*job.capex, is_ota_chroot_);
+    if (decompressed.ok()) {
+      // Handed over right away, e.g. so that it can be activated while the
+      // others are still being decompressed.
+      std::lock_guard lock(ready_mutex_);
+      on_ready_(std::move(*decompressed));
+    } else {
+      LOG(ERROR) << "Failed to process compressed APEX: "
+                 << decompressed.error();
+    }
+    bool finished;
+    {
+      std::lock_guard lock(mutex_);
+      running_--;
+      if (!decompressed.ok()) {
+        // The partial output was deleted.
+        available_ += job.reserved;
+      }
+      finished = --remaining_ == 0;
+    }
+    if (finished) {
+      all_done_.set_value();
+      return;
+    }
+    Schedule();
+  }
+
+  const bool is_ota_chroot_;
+  const ReadyFn on_ready_;
+  const size_t max_running_;
+  std::promise<void> all_done_;
+  // Serializes calls to |on_ready_|.
+  std::mutex ready_mutex_;
+
+  std::mutex mutex_;
+  std::deque<const ApexFile*> pending_ GUARDED_BY(mutex_);
+  size_t running_ GUARDED_BY(mutex_) = 0;
+  size_t remaining_ GUARDED_BY(mutex_) = 0;
+  // Free space in the decompression directory not claimed by any job yet.
+  uint64_t available_ GUARDED_BY(mutex_) = 0;
+};
+
+// Decompresses |compressed_apex| in parallel and calls |on_ready| with each
+// decompressed APEX as soon as it is ready. |on_ready| is called from the
+// executor's threads, but never concurrently.
+void ProcessCompressedApex(const std::vector<ApexFileRef>& compressed_apex,
+                           bool is_ota_chroot,
+                           DecompressionPipeline::ReadyFn on_ready) {
+  LOG(INFO) << "Processing compressed APEX";
+  std::make_shared<DecompressionPipeline>(compressed_apex, is_ota_chroot,
+                                          std::move(on_ready))
+      ->Run();
+}
+
 }  // namespace
 
 /**
@@ -2962,23 +3722,22 @@ Result<ApexFile> ProcessCompressedApex(const ApexFile& capex,
  */
 std::vector<ApexFile> ProcessCompressedApex(
     const std::vector<ApexFileRef>& compressed_apex, bool is_ota_chroot) {
-  LOG(INFO) << "Processing compressed APEX";
-
   std::vector<ApexFile> decompressed_apex_list;
+  ProcessCompressedApex(compressed_apex, is_ota_chroot, [&](ApexFile apex) {
+    decompressed_apex_list.emplace_back(std::move(apex));
+  });
+  // Keep the order of |compressed_apex|, regardless of which one finished
+  // first.
+  std::unordered_map<std::string, size_t> order;
   for (const ApexFile& capex : compressed_apex) {
-    if (!capex.IsCompressed()) {
-      continue;
-    }
-
-    auto decompressed_apex = ProcessCompressedApex(capex, is_ota_chroot);
-    if (decompressed_apex.ok()) {
-      decompressed_apex_list.emplace_back(std::move(*decompressed_apex));
-      continue;
-    }
-    LOG(ERROR) << "Failed to process compressed APEX: "
-               << decompressed_apex.error();
-  }
-  return std::move(decompressed_apex_list);
+    order.emplace(capex.GetManifest().name(), order.size());
+  }
+  std::sort(decompressed_apex_list.begin(), decompressed_apex_list.end(),
+            [&order](const ApexFile& a, const ApexFile& b) {
+              return order[a.GetManifest().name()] <
+                     order[b.GetManifest().name()];
+            });
+  return decompressed_apex_list;
 }
 
 Result<void> ValidateDecompressedApex(const ApexFile& capex,
@@ -3070,18 +3829,26 @@ void OnStart() {
       it++;
     }
   }
-  std::vector<ApexFile> decompressed_apex;
-  if (!compressed_apex.empty()) {
-    decompressed_apex =
-        ProcessCompressedApex(compressed_apex, /* is_ota_chroot= */ false);
-    for (const ApexFile& apex_file : decompressed_apex) {
-      activation_list.emplace_back(std::cref(apex_file));
+  // Decompressed APEXes are activated as soon as each of them is ready, while
+  // the others are still being decompressed. std::deque keeps references to
+  // them valid.
+  std::deque<ApexFile> decompressed_apex;
+  auto decompress = [&](const auto& add) {
+    if (compressed_apex.empty()) {
+      return;
     }
-  }
+    ProcessCompressedApex(compressed_apex, /* is_ota_chroot= */ false,
+                          [&](ApexFile apex) {
+                            add(decompressed_apex.emplace_back(
+                                std::move(apex)));
+                          });
+  };
 
-  // TODO(b/179248390): activate parallelly if possible
-  auto activate_status =
-      ActivateApexPackages(activation_list, ActivationMode::kBootMode);
+  auto activate_status = ActivateApexPackages(
+      activation_list, ActivationMode::kBootMode, decompress);
+  for (const ApexFile& apex_file : decompressed_apex) {
+    activation_list.emplace_back(std::cref(apex_file));
+  }
   if (!activate_status.ok()) {
     std::string error_message =
         StringPrintf("Failed to activate packages: %s",
@@ -3102,6 +3869,10 @@ void OnStart() {
   // Now that APEXes are mounted, snapshot or restore DE_sys data.
   SnapshotOrRestoreDeSysData();
 
+  // Mounted APEXes hold their own references to the files, so the ones kept
+  // by the repository are no longer needed.
+  ApexFileRepository::GetInstance().ReleaseFds();
+
   auto time_elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
     boot_clock::now() - time_started).count();
   LOG(INFO) << "OnStart done, duration=" << time_elapsed;
@@ -3141,22 +3912,26 @@ std::future<void> FinishLoopConfiguration() {
   LOG(INFO) << "Finalizing configuration of " << mounted_apexes.size()
             << " loop devices";
   // A very basic version of the async IO. We should use the io_uring on
-  // devices that support it.
-  return std::async(
-      std::launch::async,
-      [](std::vector<MountedApexData>&& mounted_apexes) {
+  // devices that support it. This isn't on the critical path of boot anymore,
+  // hence the low priority.
+  return ApexdExecutor::GetInstance().Submit(
+      "FinishLoopConfiguration",
+      [apexes = std::move(mounted_apexes)]() {
         auto time_started = boot_clock::now();
-        for (const auto& apex : mounted_apexes) {
-          loop::FinishConfiguring(apex.loop_name, apex.full_path);
+        for (const auto& apex : apexes) {
+          // Payloads mounted straight from their file have no loop device.
+          if (!apex.loop_name.empty()) {
+            loop::FinishConfiguring(apex.loop_name, apex.full_path);
+          }
         }
         auto time_elapsed =
             std::chrono::duration_cast<std::chrono::milliseconds>(
                 boot_clock::now() - time_started)
                 .count();
-        LOG(INFO) << "Finished confuring " << mounted_apexes.size()
+        LOG(INFO) << "Finished confuring " << apexes.size()
                   << " loop devices duration=" << time_elapsed;
       },
-      std::move(mounted_apexes));
+      ApexdExecutor::Priority::kLow);
 }
 
 void OnAllPackagesReady() {
@@ -3363,10 +4138,91 @@ void DeleteUnusedVerityDevices() {
   }
 }
 
+namespace {
+
+// Returns the root digests of the APEXes whose hashtree must be kept: the
+// mounted ones, the ones backed up to be restored on rollback, and the ones of
+// sessions that get activated on the next boot. Fails if the root digest of a
+// mounted APEX can't be determined, since its hashtree might be in use.
+Result<std::unordered_set<std::string>> GetRootDigestsInUse() {
+  std::unordered_set<std::string> root_digests;
+  std::vector<MountedApexData> mounted;
+  gMountedApexes.ForallMountedApexes([&](const std::string&,
+                                         const MountedApexData& data,
+                                         [[maybe_unused]] bool latest) {
+    mounted.push_back(data);
+  });
+  // The snapshot of the mounted file, rather than whatever is at its path now.
+  for (const MountedApexData& data : mounted) {
+    auto apex = GetMountedApexFile(data);
+    if (!apex.ok()) {
+      return Error() << "Failed to open " << data.full_path << ": "
+                     << apex.error();
+    }
+    auto verity_data =
+        (*apex)->VerifyApexVerity((*apex)->GetBundledPublicKey());
+    if (!verity_data.ok()) {
+      return Error() << "Failed to get root digest of " << data.full_path
+                     << ": " << verity_data.error();
+    }
+    root_digests.insert(verity_data->root_digest);
+  }
+
+  std::vector<ApexFile> apexes;
+  std::vector<std::string> paths;
+  if (auto exists = PathExists(kApexBackupDir); exists.ok() && *exists) {
+    auto backup = FindFilesBySuffix(kApexBackupDir, {kApexPackageSuffix});
+    if (backup.ok()) {
+      paths.insert(paths.end(), backup->begin(), backup->end());
+    } else {
+      LOG(ERROR) << "Failed to scan " << kApexBackupDir << ": "
+                 << backup.error();
+    }
+  }
+  for (const std::string& path : paths) {
+    if (auto apex = ApexFile::Open(path); apex.ok()) {
+      apexes.push_back(std::move(*apex));
+    }
+  }
+  for (const auto& session :
+       ApexSession::GetSessionsInState(SessionState::STAGED)) {
+    const auto& child_session_ids = session.GetChildSessionIds();
+    auto staged = GetStagedApexFiles(
+        session.GetId(),
+        std::vector<int>(child_session_ids.begin(), child_session_ids.end()));
+    if (staged.ok()) {
+      std::move(staged->begin(), staged->end(), std::back_inserter(apexes));
+    }
+  }
+
+  for (const ApexFile& apex : apexes) {
+    if (apex.IsCompressed()) {
+      continue;
+    }
+    auto verity_data = apex.VerifyApexVerity(apex.GetBundledPublicKey());
+    if (verity_data.ok()) {
+      root_digests.insert(verity_data->root_digest);
+    }
+  }
+  return root_digests;
+}
+
+}  // namespace
+
 void BootCompletedCleanup() {
   RemoveInactiveDataApex();
   ApexSession::DeleteFinalizedSessions();
   DeleteUnusedVerityDevices();
+  loop::ReleasePooledLoopDevices();
+  const uint64_t quota_mb =
+      android::sysprop::ApexProperties::hashtree_cache_quota_mb().value_or(
+          kDefaultHashTreeCacheQuotaMb);
+  if (auto in_use = GetRootDigestsInUse(); in_use.ok()) {
+    RemoveObsoleteHashTrees(gConfig->apex_hash_tree_dir, *in_use,
+                            quota_mb * 1024 * 1024);
+  } else {
+    LOG(ERROR) << "Keeping all hashtrees: " << in_use.error();
+  }
 }
 
 int UnmountAll() {
@@ -3379,7 +4235,7 @@ int UnmountAll() {
                                          bool latest) {
     LOG(INFO) << "Unmounting " << data.full_path << " mounted on "
               << data.mount_point;
-    auto apex = ApexFile::Open(data.full_path);
+    auto apex = OpenMountedApex(data.full_path);
     if (!apex.ok()) {
       LOG(ERROR) << "Failed to open " << data.full_path << " : "
                  << apex.error();
@@ -3390,6 +4246,10 @@ int UnmountAll() {
       auto pos = data.mount_point.find('@');
       CHECK(pos != std::string::npos);
       std::string bind_mount = data.mount_point.substr(0, pos);
+      std::string marker = GetMountedMarkerPath(apex->GetManifest());
+      if (unlink(marker.c_str()) != 0 && errno != ENOENT) {
+        PLOG(ERROR) << "Failed to remove " << marker;
+      }
       if (umount2(bind_mount.c_str(), UMOUNT_NOFOLLOW) != 0) {
         PLOG(ERROR) << "Failed to unmount bind-mount " << bind_mount;
         ret = 1;
@@ -3610,6 +4470,7 @@ Result<int> AddBlockApex(ApexFileRepository& instance) {
 // - ActivateApexPackages
 // - setprop apexd.status: activated/ready
 int OnStartInVmMode() {
+  ConfigureExecutor();
   Result<void> loop_ready = WaitForFile("/dev/loop-control", 20s);
   if (!loop_ready.ok()) {
     LOG(ERROR) << loop_ready.error();
@@ -3656,6 +4517,7 @@ int OnStartInVmMode() {
 }
 
 int OnOtaChrootBootstrap() {
+  ConfigureExecutor();
   auto& instance = ApexFileRepository::GetInstance();
   if (auto status = instance.AddPreInstalledApex(gConfig->apex_built_in_dirs);
       !status.ok()) {
@@ -3696,18 +4558,23 @@ int OnOtaChrootBootstrap() {
       it++;
     }
   }
-  std::vector<ApexFile> decompressed_apex;
-  if (!compressed_apex.empty()) {
-    decompressed_apex =
-        ProcessCompressedApex(compressed_apex, /* is_ota_chroot= */ true);
-
-    for (const ApexFile& apex_file : decompressed_apex) {
-      activation_list.emplace_back(std::cref(apex_file));
+  std::deque<ApexFile> decompressed_apex;
+  auto decompress = [&](const auto& add) {
+    if (compressed_apex.empty()) {
+      return;
     }
-  }
+    ProcessCompressedApex(compressed_apex, /* is_ota_chroot= */ true,
+                          [&](ApexFile apex) {
+                            add(decompressed_apex.emplace_back(
+                                std::move(apex)));
+                          });
+  };
 
-  auto activate_status =
-      ActivateApexPackages(activation_list, ActivationMode::kOtaChrootMode);
+  auto activate_status = ActivateApexPackages(
+      activation_list, ActivationMode::kOtaChrootMode, decompress);
+  for (const ApexFile& apex_file : decompressed_apex) {
+    activation_list.emplace_back(std::cref(apex_file));
+  }
   if (!activate_status.ok()) {
     LOG(ERROR) << "Failed to activate apex packages : "
                << activate_status.error();
@@ -4066,7 +4933,7 @@ Result<ApexFile> InstallPackage(const std::string& package_path) {
     return Error() << "No active version found for package " << module_name;
   }
 
-  auto cur_apex = ApexFile::Open(cur_mounted_data->full_path);
+  auto cur_apex = GetMountedApexFile(*cur_mounted_data);
   if (!cur_apex.ok()) {
     return cur_apex.error();
   }
@@ -4108,7 +4975,7 @@ Result<ApexFile> InstallPackage(const std::string& package_path) {
   });
 
   // 2. Unmount currently active APEX.
-  if (auto res = UnmountPackage(*cur_apex, /* allow_latest= */ true,
+  if (auto res = UnmountPackage(**cur_apex, /* allow_latest= */ true,
                                 /* deferred= */ true);
       !res.ok()) {
     return res.error();
@@ -4126,7 +4993,7 @@ Result<ApexFile> InstallPackage(const std::string& package_path) {
     // previously active APEX is still around. We need to create a new one.
     std::string old_new_id = GetPackageId(temp_apex->GetManifest()) + "_" +
                              std::to_string(*new_id_minor + 1);
-    auto res = ActivatePackageImpl(*cur_apex, old_new_id,
+    auto res = ActivatePackageImpl(**cur_apex, old_new_id,
                                    /* reuse_device= */ false);
     if (!res.ok()) {
       // At this point not much we can do... :(
@@ -4158,7 +5025,7 @@ Result<ApexFile> InstallPackage(const std::string& package_path) {
   guard.Disable();
 
   // 4. Now we can unlink old APEX if it's not pre-installed.
-  if (!ApexFileRepository::GetInstance().IsPreInstalledApex(*cur_apex)) {
+  if (!ApexFileRepository::GetInstance().IsPreInstalledApex(**cur_apex)) {
     if (unlink(cur_mounted_data->full_path.c_str()) != 0) {
       PLOG(ERROR) << "Failed to unlink " << cur_mounted_data->full_path;
     }
@@ -0,0 +1,243 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define ATRACE_TAG ATRACE_TAG_PACKAGE_MANAGER
+
+#include "apexd_executor.h"
+
+#include <android-base/logging.h>
+#include <sys/sysinfo.h>
+#include <utils/Trace.h>
+
+#include <algorithm>
+
+using android::base::ScopedLockAssertion;
+
+namespace android {
+namespace apex {
+
+namespace {
+
+// Executor the current thread is a worker of, if any, and its index.
+thread_local const ApexdExecutor* tls_executor = nullptr;
+thread_local size_t tls_worker_index = 0;
+// Priority of the task running on the current thread, if any.
+thread_local std::optional<ApexdExecutor::Priority> tls_task_priority;
+
+}  // namespace
+
+ApexdExecutor& ApexdExecutor::GetInstance() {
+  // Intentionally leaked, so that workers never outlive the executor during
+  // process exit.
+  static ApexdExecutor* instance =
+      new ApexdExecutor(std::max(get_nprocs_conf() >> 1, 1));
+  return *instance;
+}
+
+ApexdExecutor::ApexdExecutor(size_t num_threads)
+    : num_threads_(std::max(num_threads, static_cast<size_t>(1))) {}
+
+ApexdExecutor::~ApexdExecutor() {
+  std::vector<std::thread> threads;
+  {
+    std::lock_guard lock(mutex_);
+    stopping_ = true;
+    threads = std::move(threads_);
+  }
+  cv_.notify_all();
+  // Workers only exit once all pending tasks are done.
+  for (auto& thread : threads) {
+    thread.join();
+  }
+}
+
+void ApexdExecutor::Configure(size_t num_threads) {
+  num_threads = std::max(num_threads, static_cast<size_t>(1));
+  std::lock_guard lock(mutex_);
+  if (num_threads == num_threads_) {
+    return;
+  }
+  if (started_) {
+    LOG(WARNING) << "Ignoring request to resize executor to " << num_threads
+                 << " threads: already running with " << num_threads_;
+    return;
+  }
+  num_threads_ = num_threads;
+}
+
+size_t ApexdExecutor::GetNumThreads() {
+  std::lock_guard lock(mutex_);
+  return num_threads_;
+}
+
+ApexdExecutor::Priority ApexdExecutor::GetCurrentPriority() {
+  return tls_task_priority.value_or(Priority::kNormal);
+}
+
+void ApexdExecutor::StartLocked() {
+  LOG(INFO) << "Starting executor with " << num_threads_ << " threads";
+  queues_.reserve(num_threads_ + 1);
+  for (size_t i = 0; i < num_threads_ + 1; i++) {
+    queues_.emplace_back(std::make_unique<Queue>());
+  }
+  started_ = true;
+  threads_.reserve(num_threads_);
+  for (size_t i = 0; i < num_threads_; i++) {
+    threads_.emplace_back([this, i]() { WorkerLoop(i); });
+  }
+}
+
+void ApexdExecutor::Enqueue(Task task, Priority priority) {
+  // The parent task may wait for this one, and only helps with tasks that are
+  // at least as urgent as itself.
+  if (tls_task_priority.has_value()) {
+    priority = std::min(priority, *tls_task_priority);
+  }
+  task.priority = priority;
+  {
+    std::lock_guard lock(mutex_);
+    if (!started_) {
+      StartLocked();
+    }
+    // Accounted before the task becomes visible, so that whoever picks it up
+    // never sees |pending_| drop below zero.
+    ++pending_[static_cast<size_t>(priority)];
+  }
+  size_t queue_index = tls_executor == this ? tls_worker_index + 1 : 0;
+  Queue& queue = *queues_[queue_index];
+  {
+    std::lock_guard lock(queue.mutex);
+    queue.tasks[static_cast<size_t>(priority)].push_back(std::move(task));
+  }
+  cv_.notify_all();
+}
+
+std::optional<ApexdExecutor::Task> ApexdExecutor::TryPop(Priority lowest) {
+  if (!started_) {
+    return std::nullopt;
+  }
+  // 0 if the current thread is not a worker of this executor.
+  const size_t self = tls_executor == this ? tls_worker_index + 1 : 0;
+  auto pop = [](Queue& queue, size_t priority,
+                bool lifo) -> std::optional<Task> {
+    std::lock_guard lock(queue.mutex);
+    auto& tasks = queue.tasks[priority];
+    if (tasks.empty()) {
+      return std::nullopt;
+    }
+    Task popped;
+    if (lifo) {
+      popped = std::move(tasks.back());
+      tasks.pop_back();
+    } else {
+      popped = std::move(tasks.front());
+      tasks.pop_front();
+    }
+    return popped;
+  };
+
+  std::optional<Task> task;
+  for (size_t priority = 0;
+       priority <= static_cast<size_t>(lowest) && !task; priority++) {
+    // First own tasks, then the shared ones, then steal from other workers.
+    if (self != 0) {
+      task = pop(*queues_[self], priority, /* lifo= */ true);
+    }
+    for (size_t i = 0; i < queues_.size() && !task; i++) {
+      if (self == 0 || i != self) {
+        task = pop(*queues_[i], priority, /* lifo= */ false);
+      }
+    }
+  }
+  if (task) {
+    std::lock_guard lock(mutex_);
+    --pending_[static_cast<size_t>(task->priority)];
+  }
+  return task;
+}
+
+void ApexdExecutor::Run(Task& task) {
+  {
+    ATRACE_NAME(task.name.c_str());
+    // Restored afterwards, as waiters run tasks from within their own task.
+    const auto outer_priority = tls_task_priority;
+    tls_task_priority = task.priority;
+    task.fn();
+    tls_task_priority = outer_priority;
+  }
+  {
+    std::lock_guard lock(mutex_);
+    ++completed_;
+  }
+  cv_.notify_all();
+}
+
+void ApexdExecutor::WorkerLoop(size_t index) {
+  tls_executor = this;
+  tls_worker_index = index;
+  while (true) {
+    if (auto task = TryPop(Priority::kLow); task) {
+      Run(*task);
+      continue;
+    }
+    std::unique_lock lock(mutex_);
+    ScopedLockAssertion assume_locked(mutex_);
+    cv_.wait(lock, [this]() {
+      ScopedLockAssertion lock_assertion(mutex_);
+      return stopping_ || HasPendingLocked(Priority::kLow);
+    });
+    if (stopping_ && !HasPendingLocked(Priority::kLow)) {
+      return;
+    }
+  }
+}
+
+bool ApexdExecutor::HasPendingLocked(Priority lowest) {
+  for (size_t priority = 0; priority <= static_cast<size_t>(lowest);
+       priority++) {
+    if (pending_[priority] > 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void ApexdExecutor::WaitUntilReady(const std::function<bool()>& is_ready,
+                                   Priority lowest) {
+  while (!is_ready()) {
+    // Less urgent tasks are left to the workers: the waiter might be on the
+    // critical path of boot, or a binder thread.
+    if (auto task = TryPop(lowest); task) {
+      Run(*task);
+      continue;
+    }
+    std::unique_lock lock(mutex_);
+    ScopedLockAssertion assume_locked(mutex_);
+    // Tasks are accounted as completed under |mutex_| after they finish, so
+    // checking again here guarantees that the wakeup can't be missed.
+    if (is_ready()) {
+      break;
+    }
+    const uint64_t completed = completed_;
+    cv_.wait(lock, [this, completed, lowest]() {
+      ScopedLockAssertion lock_assertion(mutex_);
+      return HasPendingLocked(lowest) || completed_ != completed;
+    });
+  }
+}
+
+}  // namespace apex
+}  // namespace android
@@ -0,0 +1,173 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <android-base/thread_annotations.h>
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace android {
+namespace apex {
+
+// Pool of worker threads shared by all the boot phases of apexd (scanning of
+// APEX files, activation, configuration of loop devices, ...).
+//
+// Every worker owns a queue. Tasks submitted from a worker are pushed to its
+// own queue and picked up by that worker in LIFO order, while tasks submitted
+// from any other thread are pushed to a shared queue. Idle workers steal tasks
+// from the other queues in FIFO order. Tasks with a higher priority are always
+// picked up first, no matter which queue they are in.
+//
+// Threads waiting for a task of this executor should use Wait(), which runs
+// other pending tasks in the meantime, as long as they are at least as urgent
+// as the waiter. Tasks submitted from within a task are at least as urgent as
+// their parent, so that waiting for them from within that task is safe.
+//
+// Worker threads are started on the first Submit().
+class ApexdExecutor final {
+ public:
+  enum class Priority { kHigh = 0, kNormal, kLow };
+
+  // Returns the executor shared by the whole process. By default it has half as
+  // many threads as there are CPUs, see Configure().
+  static ApexdExecutor& GetInstance();
+
+  explicit ApexdExecutor(size_t num_threads);
+  ~ApexdExecutor() REQUIRES(!mutex_);
+
+  ApexdExecutor(const ApexdExecutor&) = delete;
+  ApexdExecutor& operator=(const ApexdExecutor&) = delete;
+
+  // Sets the number of worker threads. Has no effect once the workers are
+  // started.
+  void Configure(size_t num_threads) REQUIRES(!mutex_);
+
+  size_t GetNumThreads() REQUIRES(!mutex_);
+
+  // Schedules |fn| to run on one of the workers. |name| is used to trace the
+  // execution of the task. When called from within a task, |priority| is
+  // raised to the priority of that task.
+  template <typename F>
+  std::future<std::invoke_result_t<F>> Submit(
+      std::string name, F&& fn, Priority priority = Priority::kNormal)
+      REQUIRES(!mutex_) {
+    using R = std::invoke_result_t<F>;
+    auto task = std::make_shared<std::packaged_task<R()>>(std::forward<F>(fn));
+    std::future<R> future = task->get_future();
+    Enqueue(Task{.name = std::move(name), .fn = [task]() { (*task)(); }},
+            priority);
+    return future;
+  }
+
+  // Waits for |future|, which must come from a task of this executor, and
+  // returns its result. Meanwhile, runs pending tasks of priority |priority|
+  // or higher. Within a task, |priority| defaults to the priority of that task,
+  // and to kNormal otherwise.
+  template <typename T>
+  T Wait(std::future<T> future,
+         std::optional<Priority> priority = std::nullopt) REQUIRES(!mutex_) {
+    WaitUntilReady(
+        [&future]() {
+          return future.wait_for(std::chrono::seconds(0)) ==
+                 std::future_status::ready;
+        },
+        priority.value_or(GetCurrentPriority()));
+    return future.get();
+  }
+
+  // Schedules |fn| to run with the result of |future| once it is available.
+  // |future| may come from a task of any priority, so the continuation helps
+  // with tasks of any priority while waiting for it.
+  template <typename T, typename F>
+  auto Then(std::future<T> future, std::string name, F&& fn,
+            Priority priority = Priority::kNormal) REQUIRES(!mutex_) {
+    return Submit(
+        std::move(name),
+        [this, input = std::move(future),
+         continuation = std::forward<F>(fn)]() mutable {
+          if constexpr (std::is_void_v<T>) {
+            Wait(std::move(input), Priority::kLow);
+            return continuation();
+          } else {
+            return continuation(Wait(std::move(input), Priority::kLow));
+          }
+        },
+        priority);
+  }
+
+ private:
+  static constexpr size_t kNumPriorities = 3;
+
+  struct Task {
+    std::string name;
+    std::function<void()> fn;
+    Priority priority = Priority::kNormal;
+  };
+
+  struct Queue {
+    std::mutex mutex;
+    std::array<std::deque<Task>, kNumPriorities> tasks GUARDED_BY(mutex);
+  };
+
+  // Priority of the task running on the current thread, or kNormal.
+  static Priority GetCurrentPriority();
+
+  void Enqueue(Task task, Priority priority) REQUIRES(!mutex_);
+  // Pops the next task of priority |lowest| or higher, if any.
+  std::optional<Task> TryPop(Priority lowest) REQUIRES(!mutex_);
+  void Run(Task& task) REQUIRES(!mutex_);
+  void WorkerLoop(size_t index) REQUIRES(!mutex_);
+  void WaitUntilReady(const std::function<bool()>& is_ready, Priority lowest)
+      REQUIRES(!mutex_);
+  bool HasPendingLocked(Priority lowest) REQUIRES(mutex_);
+  void StartLocked() REQUIRES(mutex_);
+
+  std::mutex mutex_;
+  // Notified every time a task is enqueued or finished.
+  std::condition_variable cv_;
+  size_t num_threads_ GUARDED_BY(mutex_);
+  bool stopping_ GUARDED_BY(mutex_) = false;
+  // Number of tasks of each priority that were enqueued but not picked up yet.
+  std::array<size_t, kNumPriorities> pending_ GUARDED_BY(mutex_) = {};
+  // Number of tasks that have finished so far.
+  uint64_t completed_ GUARDED_BY(mutex_) = 0;
+  std::vector<std::thread> threads_ GUARDED_BY(mutex_);
+
+  // queues_[0] is the shared queue and queues_[i + 1] belongs to the i-th
+  // worker. It is populated before |started_| is set and never modified
+  // afterwards, so it can be read without holding |mutex_| once |started_| is
+  // true.
+  std::vector<std::unique_ptr<Queue>> queues_;
+  std::atomic<bool> started_ = false;
+};
+
+}  // namespace apex
+}  // namespace android
@@ -0,0 +1,159 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "apexd_executor.h"
+
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <future>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace android {
+namespace apex {
+
+using Priority = ApexdExecutor::Priority;
+using ::testing::ElementsAre;
+
+TEST(ApexdExecutorTest, RunsAllTasks) {
+  ApexdExecutor executor(4);
+  std::atomic<int> sum = 0;
+  std::vector<std::future<int>> futures;
+  for (int i = 1; i <= 100; i++) {
+    futures.push_back(executor.Submit("task", [i, &sum]() {
+      sum += i;
+      return i * 2;
+    }));
+  }
+  int doubled = 0;
+  for (auto& future : futures) {
+    doubled += executor.Wait(std::move(future));
+  }
+  ASSERT_EQ(5050, sum);
+  ASSERT_EQ(10100, doubled);
+}
+
+TEST(ApexdExecutorTest, HigherPriorityTasksRunFirst) {
+  ApexdExecutor executor(1);
+  std::promise<void> unblock;
+  std::shared_future<void> unblocked = unblock.get_future().share();
+  // Occupy the only worker, so that the following tasks get queued.
+  auto blocker =
+      executor.Submit("blocker", [unblocked]() { unblocked.wait(); });
+
+  std::mutex mutex;
+  std::vector<std::string> order;
+  auto record = [&](const std::string& name) {
+    return [&, name]() {
+      std::lock_guard lock(mutex);
+      order.push_back(name);
+    };
+  };
+  auto low = executor.Submit("low", record("low"), Priority::kLow);
+  auto normal = executor.Submit("normal", record("normal"));
+  auto high = executor.Submit("high", record("high"), Priority::kHigh);
+  unblock.set_value();
+
+  // Don't use Wait(), which would run the tasks on this thread.
+  blocker.wait();
+  low.wait();
+  normal.wait();
+  high.wait();
+  ASSERT_THAT(order, ElementsAre("high", "normal", "low"));
+}
+
+TEST(ApexdExecutorTest, WaitingFromTaskDoesNotDeadlock) {
+  ApexdExecutor executor(1);
+  auto outer = executor.Submit("outer", [&executor]() {
+    std::vector<std::future<int>> inner;
+    for (int i = 0; i < 10; i++) {
+      inner.push_back(executor.Submit("inner", [i]() { return i; }));
+    }
+    int sum = 0;
+    for (auto& future : inner) {
+      sum += executor.Wait(std::move(future));
+    }
+    return sum;
+  });
+  ASSERT_EQ(45, executor.Wait(std::move(outer)));
+}
+
+TEST(ApexdExecutorTest, WaiterOnlyRunsTasksAtLeastAsUrgent) {
+  ApexdExecutor executor(1);
+  std::promise<void> started;
+  std::promise<void> unblock;
+  std::shared_future<void> unblocked = unblock.get_future().share();
+  // Occupy the only worker, so that the following tasks get queued.
+  auto blocker = executor.Submit("blocker", [&started, unblocked]() {
+    started.set_value();
+    unblocked.wait();
+  });
+  started.get_future().wait();
+
+  std::atomic<bool> low_ran = false;
+  auto low = executor.Submit(
+      "low", [&low_ran]() { low_ran = true; }, Priority::kLow);
+  auto normal = executor.Submit("normal", []() { return 42; });
+  ASSERT_EQ(42, executor.Wait(std::move(normal)));
+  ASSERT_FALSE(low_ran);
+
+  unblock.set_value();
+  executor.Wait(std::move(blocker));
+  executor.Wait(std::move(low), Priority::kLow);
+  ASSERT_TRUE(low_ran);
+}
+
+TEST(ApexdExecutorTest, SubtasksInheritPriority) {
+  ApexdExecutor executor(1);
+  auto outer = executor.Submit(
+      "outer",
+      [&executor]() {
+        // Would never run if it stayed less urgent than its parent, which
+        // occupies the only worker.
+        auto inner = executor.Submit(
+            "inner", []() { return 42; }, Priority::kLow);
+        return executor.Wait(std::move(inner));
+      },
+      Priority::kHigh);
+  ASSERT_EQ(42, executor.Wait(std::move(outer)));
+}
+
+TEST(ApexdExecutorTest, ThenReceivesResult) {
+  ApexdExecutor executor(2);
+  auto first = executor.Submit("first", []() { return 20; });
+  auto second = executor.Then(std::move(first), "second",
+                              [](int value) { return value + 22; });
+  std::atomic<bool> done = false;
+  auto third = executor.Then(std::move(second), "third",
+                             [&done](int value) { done = value == 42; });
+  executor.Wait(std::move(third));
+  ASSERT_TRUE(done);
+}
+
+TEST(ApexdExecutorTest, ConfigureOnlyBeforeStart) {
+  ApexdExecutor executor(1);
+  executor.Configure(3);
+  ASSERT_EQ(3u, executor.GetNumThreads());
+  executor.Wait(executor.Submit("task", []() {}));
+  executor.Configure(5);
+  ASSERT_EQ(3u, executor.GetNumThreads());
+}
+
+}  // namespace apex
+}  // namespace android
@@ -25,6 +25,7 @@
 #include <android-base/properties.h>
 #include <android-base/stringprintf.h>
 #include <android-base/strings.h>
+#include <android-base/thread_annotations.h>
 #include <dirent.h>
 #include <fcntl.h>
 #include <libdm/dm.h>
@@ -38,23 +39,34 @@
 #include <unistd.h>
 #include <utils/Trace.h>
 
+#include <algorithm>
 #include <array>
 #include <filesystem>
 #include <mutex>
+#include <optional>
 #include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
+#include "apexd_path_waiter.h"
 #include "apexd_utils.h"
 
 using android::base::Basename;
+using android::base::borrowed_fd;
 using android::base::ErrnoError;
 using android::base::Error;
 using android::base::GetBoolProperty;
+using android::base::Join;
+using android::base::ParseInt;
 using android::base::ParseUint;
 using android::base::ReadFileToString;
 using android::base::Result;
+using android::base::Split;
 using android::base::StartsWith;
 using android::base::StringPrintf;
 using android::base::unique_fd;
+using android::base::WriteStringToFile;
 using android::dm::DeviceMapper;
 
 namespace android {
@@ -63,6 +75,12 @@ namespace loop {
 
 static constexpr const char* kApexLoopIdPrefix = "apex:";
 
+// Ids of the loop devices added by PreAllocateLoopDevices. apexd-bootstrap
+// adds them, but they are claimed and released by the apexd process that
+// runs afterwards, which has to know they aren't the kernel's.
+static constexpr const char* kPreAllocatedLoopDevicesFile =
+    "/metadata/apex/loop_devices";
+
 // 128 kB read-ahead, which we currently use for /system as well
 static constexpr const char* kReadAheadKb = "128";
 
@@ -119,87 +137,166 @@ Result<void> ConfigureScheduler(const std::string& device_path) {
   return {};
 }
 
-// Return the parent device of a partition. Converts e.g. "sda26" into "sda".
-static Result<std::string> PartitionParent(const std::string& blockdev) {
-  if (blockdev.find('/') != std::string::npos) {
-    return Error() << "Invalid argument " << blockdev;
-  }
-  std::error_code ec;
-  for (const auto& entry :
-       std::filesystem::directory_iterator("/sys/class/block", ec)) {
-    const std::string path = entry.path().string();
-    if (std::filesystem::exists(
-            StringPrintf("%s/%s", path.c_str(), blockdev.c_str()))) {
-      return Basename(path);
+namespace {
+
+// Index of the block devices of the system, built once per process, mapping the
+// device of a file to the queue depth of the disk underneath. Almost every APEX
+// resolves to the same one or two disks, so this saves scanning /dev/block and
+// /sys/class/block for each loop device. Looking up a device that appeared
+// since the index was built (i.e. after a uevent) rebuilds it. Device numbers
+// are reused once a loop or dm device is removed, so entries are also keyed
+// by the inode of the device's sysfs directory, which is not.
+class BlockDeviceTopology {
+ public:
+  static BlockDeviceTopology& GetInstance() {
+    static BlockDeviceTopology instance;
+    return instance;
+  }
+
+  // For the filesystem on |dev|, returns the queue depth of the block device
+  // backing it. This may e.g. traverse the following hierarchy:
+  // /dev/block/dm-9 (system-verity; dm-verity)
+  // -> /dev/block/dm-1 (system_b; dm-linear)
+  // -> /dev/sda26
+  Result<uint32_t> QueueDepth(dev_t dev) REQUIRES(!mutex_) {
+    auto sysfs_ino = SysfsInode(
+        StringPrintf("/sys/dev/block/%u:%u", major(dev), minor(dev)));
+    if (!sysfs_ino.ok()) {
+      return sysfs_ino.error();
+    }
+    std::lock_guard lock(mutex_);
+    if (auto it = queue_depths_.find(dev); it != queue_depths_.end()) {
+      if (it->second.sysfs_ino == *sysfs_ino) {
+        return it->second.queue_depth;
+      }
+      queue_depths_.erase(it);
+    }
+    auto name = names_.find(dev);
+    if (name == names_.end() ||
+        SysfsInode("/sys/class/block/" + name->second).value_or(0) !=
+            *sysfs_ino) {
+      RebuildLocked();
+      name = names_.find(dev);
     }
+    if (name == names_.end()) {
+      return Errorf("Failed to convert {}:{}", major(dev), minor(dev));
+    }
+    auto queue_depth = ResolveQueueDepthLocked("/dev/block/" + name->second);
+    if (!queue_depth.ok()) {
+      return queue_depth.error();
+    }
+    queue_depths_.insert_or_assign(
+        dev, CachedQueueDepth{*sysfs_ino, *queue_depth});
+    return *queue_depth;
   }
-  return blockdev;
-}
 
-// Convert a major:minor pair into a block device name.
-static std::string BlockdevName(dev_t dev) {
-  std::error_code ec;
-  for (const auto& entry :
-       std::filesystem::directory_iterator("/dev/block", ec)) {
+ private:
+  struct CachedQueueDepth {
+    ino_t sysfs_ino;
+    uint32_t queue_depth;
+  };
+
+  static Result<ino_t> SysfsInode(const std::string& path) {
     struct stat statbuf;
-    if (stat(entry.path().string().c_str(), &statbuf) < 0) {
-      continue;
+    if (stat(path.c_str(), &statbuf) < 0) {
+      return ErrnoError() << "Failed to stat " << path;
+    }
+    return statbuf.st_ino;
+  }
+
+  void RebuildLocked() REQUIRES(mutex_) {
+    ATRACE_NAME("BlockDeviceTopology::Rebuild");
+    names_.clear();
+    parents_.clear();
+    queue_depths_.clear();
+    std::error_code ec;
+    for (const auto& entry :
+         std::filesystem::directory_iterator("/dev/block", ec)) {
+      struct stat statbuf;
+      if (stat(entry.path().c_str(), &statbuf) < 0 ||
+          !S_ISBLK(statbuf.st_mode)) {
+        continue;
+      }
+      names_.emplace(statbuf.st_rdev, entry.path().filename().string());
+    }
+    // Partitions show up as subdirectories of their disk, e.g. sda/sda26.
+    for (const auto& disk :
+         std::filesystem::directory_iterator("/sys/class/block", ec)) {
+      std::error_code disk_ec;
+      for (const auto& entry :
+           std::filesystem::directory_iterator(disk.path(), disk_ec)) {
+        if (std::filesystem::exists(entry.path() / "partition", disk_ec)) {
+          parents_.emplace(entry.path().filename().string(),
+                           disk.path().filename().string());
+        }
+      }
+    }
+    LOG(VERBOSE) << "Indexed " << names_.size() << " block devices and "
+                 << parents_.size() << " partitions";
+  }
+
+  Result<uint32_t> ResolveQueueDepthLocked(std::string blockdev)
+      REQUIRES(mutex_) {
+    auto& dm = DeviceMapper::Instance();
+    for (;;) {
+      std::optional<std::string> child =
+          dm.GetParentBlockDeviceByPath(blockdev);
+      if (!child) {
+        break;
+      }
+      LOG(VERBOSE) << blockdev << " -> " << *child;
+      blockdev = *child;
+    }
+    std::optional<std::string> maybe_blockdev =
+        android::dm::ExtractBlockDeviceName(blockdev);
+    if (!maybe_blockdev) {
+      return Error() << "Failed to remove /dev/block/ prefix from " << blockdev;
+    }
+    // Converts e.g. "sda26" into "sda". Disks have no parent.
+    auto parent = parents_.find(*maybe_blockdev);
+    blockdev = parent != parents_.end() ? parent->second : *maybe_blockdev;
+    LOG(VERBOSE) << "Partition parent: " << blockdev;
+    const std::string nr_tags_path =
+        StringPrintf("/sys/class/block/%s/mq/0/nr_tags", blockdev.c_str());
+    std::string nr_tags;
+    if (!ReadFileToString(nr_tags_path, &nr_tags)) {
+      return ErrnoError() << "Failed to read " << nr_tags_path;
     }
-    if (dev == statbuf.st_rdev) {
-      return Basename(entry.path().string());
+    nr_tags = android::base::Trim(nr_tags);
+    uint32_t queue_depth = 0;
+    if (!ParseUint(nr_tags, &queue_depth)) {
+      return Error() << "Failed to parse " << nr_tags_path << ": " << nr_tags;
     }
+    LOG(VERBOSE) << "/dev/" << blockdev << " supports queue depth "
+                 << queue_depth;
+    return queue_depth;
   }
-  return {};
-}
+
+  std::mutex mutex_;
+  // Device numbers of the nodes in /dev/block -> their names.
+  std::unordered_map<dev_t, std::string> names_ GUARDED_BY(mutex_);
+  // Partition -> disk it belongs to.
+  std::unordered_map<std::string, std::string> parents_ GUARDED_BY(mutex_);
+  std::unordered_map<dev_t, CachedQueueDepth> queue_depths_
+      GUARDED_BY(mutex_);
+};
+
+}  // namespace
 
 // For file `file_path`, retrieve the block device backing the filesystem on
-// which the file exists and return the queue depth of the block device. The
-// loop in this function may e.g. traverse the following hierarchy:
-// /dev/block/dm-9 (system-verity; dm-verity)
-// -> /dev/block/dm-1 (system_b; dm-linear)
-// -> /dev/sda26
+// which the file exists and return the queue depth of the block device.
 static Result<uint32_t> BlockDeviceQueueDepth(const std::string& file_path) {
   struct stat statbuf;
   int res = stat(file_path.c_str(), &statbuf);
   if (res < 0) {
     return ErrnoErrorf("stat({})", file_path.c_str());
   }
-  std::string blockdev = "/dev/block/" + BlockdevName(statbuf.st_dev);
-  LOG(VERBOSE) << file_path << " -> " << blockdev;
-  if (blockdev.empty()) {
-    return Errorf("Failed to convert {}:{} (path {})", major(statbuf.st_dev),
-                  minor(statbuf.st_dev), file_path.c_str());
+  auto queue_depth =
+      BlockDeviceTopology::GetInstance().QueueDepth(statbuf.st_dev);
+  if (!queue_depth.ok()) {
+    return Error() << queue_depth.error() << " (path " << file_path << ")";
   }
-  auto& dm = DeviceMapper::Instance();
-  for (;;) {
-    std::optional<std::string> child = dm.GetParentBlockDeviceByPath(blockdev);
-    if (!child) {
-      break;
-    }
-    LOG(VERBOSE) << blockdev << " -> " << *child;
-    blockdev = *child;
-  }
-  std::optional<std::string> maybe_blockdev =
-      android::dm::ExtractBlockDeviceName(blockdev);
-  if (!maybe_blockdev) {
-    return Error() << "Failed to remove /dev/block/ prefix from " << blockdev;
-  }
-  Result<std::string> maybe_parent = PartitionParent(*maybe_blockdev);
-  if (!maybe_parent.ok()) {
-    return Error() << "Failed to determine parent of " << *maybe_blockdev;
-  }
-  blockdev = *maybe_parent;
-  LOG(VERBOSE) << "Partition parent: " << blockdev;
-  const std::string nr_tags_path =
-      StringPrintf("/sys/class/block/%s/mq/0/nr_tags", blockdev.c_str());
-  std::string nr_tags;
-  if (!ReadFileToString(nr_tags_path, &nr_tags)) {
-    return ErrnoError() << "Failed to read " << nr_tags_path;
-  }
-  nr_tags = android::base::Trim(nr_tags);
-  LOG(VERBOSE) << file_path << " is backed by /dev/" << blockdev
-               << " and that block device supports queue depth " << nr_tags;
-  return strtol(nr_tags.c_str(), NULL, 0);
+  return queue_depth;
 }
 
 // Set 'nr_requests' of `loop_device_path` equal to the queue depth of
@@ -268,6 +365,196 @@ Result<void> ConfigureReadAhead(const std::string& device_path) {
   return {};
 }
 
+namespace {
+
+constexpr const char* kLoopPrefix = "loop";
+
+// Loop device that is set aside for this process but not in use yet.
+struct PooledLoopDevice {
+  int num;
+  // Opened device node, or -1 if ueventd hadn't created it yet.
+  unique_fd device_fd;
+  std::string name;
+  // Whether apexd created the device, as opposed to adopting one that
+  // already existed. Only those are removed again by ReleasePooledLoopDevices.
+  bool created = false;
+};
+
+// Tries to open the device node of loop device |num| without waiting for it.
+PooledLoopDevice OpenPooledLoopDevice(int num, bool created) {
+  PooledLoopDevice device{.num = num, .created = created};
+  for (const auto& path : {StringPrintf("/dev/block/loop%d", num),
+                           StringPrintf("/dev/loop%d", num)}) {
+    unique_fd fd(open(path.c_str(), O_RDWR | O_CLOEXEC));
+    if (fd.get() != -1) {
+      device.device_fd = std::move(fd);
+      device.name = path;
+      break;
+    }
+  }
+  return device;
+}
+
+// Loop devices set aside by PreAllocateLoopDevices, or found unused when the
+// pool ran dry. Claiming one only takes the lock for popping it from the list;
+// opening the device node, which might require waiting for ueventd, and
+// configuring it happen without holding any lock.
+class LoopDevicePool {
+ public:
+  static LoopDevicePool& GetInstance() {
+    static LoopDevicePool instance;
+    return instance;
+  }
+
+  void Add(PooledLoopDevice device) REQUIRES(!mutex_) {
+    std::lock_guard lock(mutex_);
+    devices_.push_back(std::move(device));
+  }
+
+  std::optional<PooledLoopDevice> Claim() REQUIRES(!mutex_) {
+    std::lock_guard lock(mutex_);
+    if (devices_.empty()) {
+      return std::nullopt;
+    }
+    PooledLoopDevice device = std::move(devices_.back());
+    devices_.pop_back();
+    return device;
+  }
+
+  std::vector<PooledLoopDevice> TakeAll() REQUIRES(!mutex_) {
+    std::lock_guard lock(mutex_);
+    return std::move(devices_);
+  }
+
+ private:
+  std::mutex mutex_;
+  std::vector<PooledLoopDevice> devices_ GUARDED_BY(mutex_);
+};
+
+struct LoopDeviceScan {
+  // Highest id of all the loop devices, if any.
+  std::optional<size_t> max_id;
+  // All the loop devices.
+  std::vector<int> ids;
+  // Loop devices that are not bound to any file.
+  std::vector<int> unbound;
+};
+
+// Returns the loop devices that PreAllocateLoopDevices added during this boot,
+// possibly in another process.
+const std::vector<int>& GetPreAllocatedLoopDevices() {
+  static const std::vector<int> ids = [] {
+    std::vector<int> ids;
+    std::string content;
+    if (!ReadFileToString(kPreAllocatedLoopDevicesFile, &content)) {
+      if (errno != ENOENT) {
+        PLOG(WARNING) << "Failed to read " << kPreAllocatedLoopDevicesFile;
+      }
+      return ids;
+    }
+    for (const auto& line : Split(content, "\n")) {
+      int id;
+      if (ParseInt(line, &id, 0)) {
+        ids.push_back(id);
+      }
+    }
+    return ids;
+  }();
+  return ids;
+}
+
+bool IsPreAllocatedLoopDevice(int num) {
+  const std::vector<int>& ids = GetPreAllocatedLoopDevices();
+  return std::find(ids.begin(), ids.end(), num) != ids.end();
+}
+
+Result<LoopDeviceScan> ScanLoopDevices() {
+  LoopDeviceScan scan;
+  auto walk_res =
+      WalkDir("/sys/block", [&](const std::filesystem::directory_entry& entry) {
+        std::string devname = entry.path().filename().string();
+        if (!StartsWith(devname, kLoopPrefix)) {
+          return;
+        }
+        size_t id;
+        if (!ParseUint(
+                devname.substr(std::char_traits<char>::length(kLoopPrefix)),
+                &id)) {
+          return;
+        }
+        if (!scan.max_id.has_value() || id > *scan.max_id) {
+          scan.max_id = id;
+        }
+        scan.ids.push_back(static_cast<int>(id));
+        // The loop/ subdirectory only exists while a file is bound.
+        if (access((entry.path() / "loop").c_str(), F_OK) != 0) {
+          scan.unbound.push_back(static_cast<int>(id));
+        }
+      });
+  if (!walk_res.ok()) {
+    return walk_res.error();
+  }
+  return scan;
+}
+
+// Called when the pool is empty. Adopts the loop devices nobody is using, or
+// adds a new one if there are none.
+Result<void> RefillLoopDevicePool() {
+  ATRACE_NAME("RefillLoopDevicePool");
+  // Only one thread at a time needs to scan, the others find the pool
+  // refilled once they get the lock.
+  static std::mutex refill_mutex;
+  std::lock_guard lock(refill_mutex);
+  auto& pool = LoopDevicePool::GetInstance();
+  if (auto device = pool.Claim(); device.has_value()) {
+    pool.Add(std::move(*device));
+    return {};
+  }
+  auto scan = ScanLoopDevices();
+  if (!scan.ok()) {
+    return scan.error();
+  }
+  for (int id : scan->unbound) {
+    pool.Add(OpenPooledLoopDevice(id, IsPreAllocatedLoopDevice(id)));
+  }
+  if (!scan->unbound.empty()) {
+    return {};
+  }
+  unique_fd ctl_fd(open("/dev/loop-control", O_RDWR | O_CLOEXEC));
+  if (ctl_fd.get() == -1) {
+    return ErrnoError() << "Failed to open loop-control";
+  }
+  int num = ioctl(ctl_fd.get(), LOOP_CTL_GET_FREE);
+  if (num == -1) {
+    return ErrnoError() << "Failed LOOP_CTL_GET_FREE";
+  }
+  // LOOP_CTL_GET_FREE hands out an existing device if one got unbound since
+  // the scan; only a device that wasn't there before is ours.
+  bool created = std::find(scan->ids.begin(), scan->ids.end(), num) ==
+                 scan->ids.end();
+  pool.Add(OpenPooledLoopDevice(num, created));
+  return {};
+}
+
+// Takes a loop device out of the pool, refilling it if needed, and opens it.
+Result<LoopbackDeviceUniqueFd> ClaimLoopDevice() {
+  auto& pool = LoopDevicePool::GetInstance();
+  std::optional<PooledLoopDevice> device = pool.Claim();
+  while (!device.has_value()) {
+    if (auto status = RefillLoopDevicePool(); !status.ok()) {
+      return status.error();
+    }
+    device = pool.Claim();
+  }
+  if (device->device_fd.get() != -1) {
+    return LoopbackDeviceUniqueFd(std::move(device->device_fd),
+                                  device->name);
+  }
+  return WaitForDevice(device->num);
+}
+
+}  // namespace
+
 Result<void> PreAllocateLoopDevices(size_t num) {
   Result<void> loop_ready = WaitForFile("/dev/loop-control", 20s);
   if (!loop_ready.ok()) {
@@ -279,26 +566,11 @@ Result<void> PreAllocateLoopDevices(size_t num) {
     return ErrnoError() << "Failed to open loop-control";
   }
 
-  bool found = false;
-  size_t start_id = 0;
-  constexpr const char* kLoopPrefix = "loop";
-  auto walk_res =
-      WalkDir("/sys/block", [&](const std::filesystem::directory_entry& entry) {
-        std::string devname = entry.path().filename().string();
-        if (StartsWith(devname, kLoopPrefix)) {
-          size_t id;
-          auto parse_ok = ParseUint(
-              devname.substr(std::char_traits<char>::length(kLoopPrefix)), &id);
-          if (parse_ok && id > start_id) {
-            start_id = id;
-            found = true;
-          }
-        }
-      });
-  if (!walk_res.ok()) {
-    return walk_res.error();
+  auto scan = ScanLoopDevices();
+  if (!scan.ok()) {
+    return scan.error();
   }
-  if (found) ++start_id;
+  size_t start_id = scan->max_id.has_value() ? *scan->max_id + 1 : 0;
 
   // Assumption: loop device ID [0..num) is valid.
   // This is because pre-allocation happens during bootstrap.
@@ -306,10 +578,12 @@ Result<void> PreAllocateLoopDevices(size_t num) {
   // as many as CONFIG_BLK_DEV_LOOP_MIN_COUNT,
   // Within the amount of kernel-pre-allocation,
   // LOOP_CTL_ADD will fail with EEXIST
+  std::vector<int> added;
   for (size_t id = start_id, cnt = 0; cnt < num; ++id) {
     int ret = ioctl(ctl_fd.get(), LOOP_CTL_ADD, id);
     if (ret > 0) {
       LOG(INFO) << "Pre-allocated loop device " << id;
+      added.push_back(ret);
       cnt++;
     } else if (errno == EEXIST) {
       LOG(WARNING) << "Loop device " << id << " already exists";
@@ -318,18 +592,89 @@ Result<void> PreAllocateLoopDevices(size_t num) {
     }
   }
 
+  // Always rewrite the list, so that one left from a previous boot doesn't
+  // hand over devices that apexd didn't add.
+  std::vector<std::string> lines;
+  for (int id : added) {
+    lines.push_back(std::to_string(id));
+  }
+  if (!WriteStringToFile(Join(lines, '\n'), kPreAllocatedLoopDevicesFile)) {
+    PLOG(WARNING) << "Failed to write " << kPreAllocatedLoopDevicesFile
+                  << ", pre-allocated loop devices won't be released";
+  }
+
+  // Keep the new devices for this process, so that activating APEXes in
+  // parallel doesn't need to coordinate on LOOP_CTL_GET_FREE.
+  //
   // Don't wait until the dev nodes are actually created, which
   // will delay the boot. By simply returing here, the creation of the dev
   // nodes will be done in parallel with other boot processes, and we
   // just optimistally hope that they are all created when we actually
   // access them for activating APEXes. If the dev nodes are not ready
-  // even then, we wait 50ms and warning message will be printed (see below
-  // CreateLoopDevice()).
+  // even then, we wait 50ms and warning message will be printed (see
+  // WaitForDevice()).
+  auto& pool = LoopDevicePool::GetInstance();
+  // Claimed from the back, so add in reverse to hand out lower ids first.
+  for (auto it = added.rbegin(); it != added.rend(); ++it) {
+    pool.Add(OpenPooledLoopDevice(*it, /*created=*/true));
+  }
   LOG(INFO) << "Pre-allocated " << num << " loopback devices";
   return {};
 }
 
-Result<void> ConfigureLoopDevice(const int device_fd, const std::string& target,
+void ReleasePooledLoopDevices() {
+  std::vector<PooledLoopDevice> devices =
+      LoopDevicePool::GetInstance().TakeAll();
+  // Pre-allocated devices that never made it into this process's pool, e.g.
+  // because apexd-bootstrap added more than it used.
+  if (auto scan = ScanLoopDevices(); scan.ok()) {
+    for (int id : scan->unbound) {
+      bool pooled = std::any_of(
+          devices.begin(), devices.end(),
+          [&](const PooledLoopDevice& device) { return device.num == id; });
+      if (!pooled && IsPreAllocatedLoopDevice(id)) {
+        devices.push_back(PooledLoopDevice{.num = id, .created = true});
+      }
+    }
+  } else {
+    LOG(WARNING) << scan.error();
+  }
+  // The pre-allocated devices are released at most once. A restarted apexd
+  // can't tell whether ids reused since then are still apexd's.
+  if (unlink(kPreAllocatedLoopDevicesFile) != 0 && errno != ENOENT) {
+    PLOG(WARNING) << "Failed to remove " << kPreAllocatedLoopDevicesFile;
+  }
+  if (devices.empty()) {
+    return;
+  }
+  unique_fd ctl_fd(open("/dev/loop-control", O_RDWR | O_CLOEXEC));
+  if (ctl_fd.get() == -1) {
+    PLOG(WARNING) << "Failed to open loop-control";
+    return;
+  }
+  size_t removed = 0;
+  for (auto& device : devices) {
+    // The kernel refuses to remove devices that are still open.
+    device.device_fd.reset();
+    // Devices adopted from the kernel's pre-allocated set, or from other
+    // users, are left for them.
+    if (!device.created) {
+      continue;
+    }
+    if (ioctl(ctl_fd.get(), LOOP_CTL_REMOVE, device.num) == -1) {
+      // EBUSY: somebody else started using it in the meantime.
+      if (errno != EBUSY) {
+        PLOG(WARNING) << "Failed to remove loop device " << device.num;
+      }
+      continue;
+    }
+    removed++;
+  }
+  LOG(INFO) << "Released " << removed << " unused loop devices";
+}
+
+Result<void> ConfigureLoopDevice(const int device_fd, borrowed_fd target_fd,
+                                 const std::string& target,
                                  const uint32_t image_offset,
                                  const size_t image_size) {
   static bool use_loop_configure;
@@ -358,13 +703,22 @@ Result<void> ConfigureLoopDevice(const int device_fd, const std::string& target,
    * kernel driver will automatically enable Direct I/O when it sees that
    * condition is now met.
    */
+  //
+  // If the caller already has the target open, it is re-opened through
+  // /proc/self/fd. This guarantees that the loop device is backed by exactly
+  // the file the caller has verified, while still getting a separate open file
+  // description for O_DIRECT.
+  const std::string open_path =
+      target_fd.get() != -1 ? StringPrintf("/proc/self/fd/%d", target_fd.get())
+                            : target;
   bool use_buffered_io = false;
-  unique_fd target_fd(open(target.c_str(), O_RDONLY | O_CLOEXEC | O_DIRECT));
-  if (target_fd.get() == -1) {
+  unique_fd backing_fd(
+      open(open_path.c_str(), O_RDONLY | O_CLOEXEC | O_DIRECT));
+  if (backing_fd.get() == -1) {
     struct statfs stbuf;
     int saved_errno = errno;
     // let's give another try with buffered I/O for EROFS and squashfs
-    if (statfs(target.c_str(), &stbuf) != 0 ||
+    if (statfs(open_path.c_str(), &stbuf) != 0 ||
         (stbuf.f_type != EROFS_SUPER_MAGIC_V1 &&
          stbuf.f_type != SQUASHFS_MAGIC &&
          stbuf.f_type != OVERLAYFS_SUPER_MAGIC)) {
@@ -372,8 +726,8 @@ Result<void> ConfigureLoopDevice(const int device_fd, const std::string& target,
     }
     LOG(WARNING) << "Fallback to buffered I/O for " << target;
     use_buffered_io = true;
-    target_fd.reset(open(target.c_str(), O_RDONLY | O_CLOEXEC));
-    if (target_fd.get() == -1) {
+    backing_fd.reset(open(open_path.c_str(), O_RDONLY | O_CLOEXEC));
+    if (backing_fd.get() == -1) {
       return ErrnoError() << "Failed to open " << target;
     }
   }
@@ -389,7 +743,7 @@ Result<void> ConfigureLoopDevice(const int device_fd, const std::string& target,
   if (use_loop_configure) {
     struct loop_config config;
     memset(&config, 0, sizeof(config));
-    config.fd = target_fd.get();
+    config.fd = backing_fd.get();
     config.info = li;
     config.block_size = 4096;
     if (!use_buffered_io) {
@@ -402,7 +756,7 @@ Result<void> ConfigureLoopDevice(const int device_fd, const std::string& target,
 
     return {};
   } else {
-    if (ioctl(device_fd, LOOP_SET_FD, target_fd.get()) == -1) {
+    if (ioctl(device_fd, LOOP_SET_FD, backing_fd.get()) == -1) {
       return ErrnoError() << "Failed to LOOP_SET_FD";
     }
 
@@ -455,23 +809,38 @@ Result<LoopbackDeviceUniqueFd> WaitForDevice(int num) {
   bool cold_boot_done = GetBoolProperty("ro.cold_boot_done", false);
 
   // Even though the kernel has created the loop device, we still depend on
-  // ueventd to run to actually create the device node in userspace. To solve
-  // this properly we should listen on the netlink socket for uevents, or use
-  // inotify. For now, this will have to do.
+  // ueventd to run to actually create the device node in userspace. Wait for
+  // it to show up with inotify, giving up after the same number of 50ms
+  // periods as when polling.
+  constexpr auto kWaitPeriod = 50ms;
   size_t attempts =
       android::sysprop::ApexProperties::loop_wait_attempts().value_or(3u);
   for (size_t i = 0; i != attempts; ++i) {
     if (!cold_boot_done) {
       cold_boot_done = GetBoolProperty("ro.cold_boot_done", false);
     }
+    bool exists = false;
     for (const auto& device : candidate_devices) {
       unique_fd sysfs_fd(open(device.c_str(), O_RDWR | O_CLOEXEC));
       if (sysfs_fd.get() != -1) {
         return LoopbackDeviceUniqueFd(std::move(sysfs_fd), device);
       }
+      exists |= errno != ENOENT;
+    }
+    if (exists) {
+      // The node is there, but not usable yet, e.g. ueventd didn't set its
+      // permissions. There is no point in waiting for it to be created.
+      PLOG(WARNING) << "Loopback device " << num
+                    << " not ready. Waiting 50ms...";
+      std::this_thread::sleep_for(kWaitPeriod);
+    } else {
+      // Returns as soon as one of the nodes is created.
+      auto created =
+          PathWaiter::GetInstance().WaitForAny(candidate_devices, kWaitPeriod);
+      if (!created.ok()) {
+        LOG(WARNING) << "Loopback device " << num << " not ready after 50ms";
+      }
     }
-    PLOG(WARNING) << "Loopback device " << num << " not ready. Waiting 50ms...";
-    usleep(50000);
     if (!cold_boot_done) {
       // ueventd hasn't finished cold boot yet, keep trying.
       i = 0;
@@ -481,49 +850,51 @@ Result<LoopbackDeviceUniqueFd> WaitForDevice(int num) {
   return Error() << "Failed to open loopback device " << num;
 }
 
-Result<LoopbackDeviceUniqueFd> CreateLoopDevice(const std::string& target,
+Result<LoopbackDeviceUniqueFd> CreateLoopDevice(borrowed_fd target_fd,
+                                                const std::string& target,
                                                 uint32_t image_offset,
                                                 size_t image_size) {
   ATRACE_NAME("CreateLoopDevice");
 
-  unique_fd ctl_fd(open("/dev/loop-control", O_RDWR | O_CLOEXEC));
-  if (ctl_fd.get() == -1) {
-    return ErrnoError() << "Failed to open loop-control";
-  }
-
-  static std::mutex mtx;
-  std::lock_guard lock(mtx);
-  int num = ioctl(ctl_fd.get(), LOOP_CTL_GET_FREE);
-  if (num == -1) {
-    return ErrnoError() << "Failed LOOP_CTL_GET_FREE";
-  }
-
-  Result<LoopbackDeviceUniqueFd> loop_device = WaitForDevice(num);
-  if (!loop_device.ok()) {
-    return loop_device.error();
-  }
-  CHECK_NE(loop_device->device_fd.get(), -1);
+  // Devices in the pool might still be taken by somebody else, e.g. through
+  // LOOP_CTL_GET_FREE. The kernel only lets one of us bind a file to it, the
+  // others get EBUSY and move on to another device.
+  static constexpr size_t kMaxBusyAttempts = 8;
+  for (size_t attempts = 1;; ++attempts) {
+    Result<LoopbackDeviceUniqueFd> loop_device = ClaimLoopDevice();
+    if (!loop_device.ok()) {
+      return loop_device.error();
+    }
+    CHECK_NE(loop_device->device_fd.get(), -1);
 
-  Result<void> configure_status = ConfigureLoopDevice(
-      loop_device->device_fd.get(), target, image_offset, image_size);
-  if (!configure_status.ok()) {
-    return configure_status.error();
+    Result<void> configure_status =
+        ConfigureLoopDevice(loop_device->device_fd.get(), target_fd, target,
+                            image_offset, image_size);
+    if (configure_status.ok()) {
+      return loop_device;
+    }
+    if (configure_status.error().code() != EBUSY ||
+        attempts >= kMaxBusyAttempts) {
+      return configure_status.error();
+    }
+    LOG(WARNING) << loop_device->name << " is busy, trying another one";
+    // Not ours, so don't let MaybeCloseBad() unbind it.
+    loop_device->CloseGood();
   }
-
-  return loop_device;
 }
 
 Result<LoopbackDeviceUniqueFd> CreateAndConfigureLoopDevice(
     const std::string& target, uint32_t image_offset, size_t image_size) {
+  return CreateAndConfigureLoopDevice(/* target_fd= */ -1, target, image_offset,
+                                      image_size);
+}
+
+Result<LoopbackDeviceUniqueFd> CreateAndConfigureLoopDevice(
+    borrowed_fd target_fd, const std::string& target, uint32_t image_offset,
+    size_t image_size) {
   ATRACE_NAME("CreateAndConfigureLoopDevice");
-  // Do minimal amount of work while holding a mutex. We need it because
-  // acquiring + configuring a loop device is not atomic. Ideally we should
-  // pre-acquire all the loop devices in advance, so that when we run APEX
-  // activation in-parallel, we can do it without holding any lock.
-  // Unfortunately, this will require some refactoring of how we manage loop
-  // devices, and probably some new loop-control ioctls, so for the time being
-  // we just limit the scope that requires locking.
-  auto loop_device = CreateLoopDevice(target, image_offset, image_size);
+  auto loop_device =
+      CreateLoopDevice(target_fd, target, image_offset, image_size);
   if (!loop_device.ok()) {
     return loop_device.error();
   }
@@ -59,11 +59,25 @@ android::base::Result<LoopbackDeviceUniqueFd> WaitForDevice(int num);
 
 android::base::Result<void> ConfigureReadAhead(const std::string& device_path);
 
+// Adds |num| loop devices and sets them aside for this process, so that they
+// can be claimed without coordinating with other activations. Their ids are
+// recorded, so that later apexd processes can release them.
 android::base::Result<void> PreAllocateLoopDevices(size_t num);
 
+// Removes the loop devices apexd created and didn't use, including the ones
+// pre-allocated by apexd-bootstrap. Unused devices that already existed are
+// only closed.
+void ReleasePooledLoopDevices();
+
 android::base::Result<LoopbackDeviceUniqueFd> CreateAndConfigureLoopDevice(
     const std::string& target, uint32_t image_offset, size_t image_size);
 
+// Same as above, but backs the loop device by |target_fd|, an already opened
+// descriptor of |target|, instead of resolving |target| again.
+android::base::Result<LoopbackDeviceUniqueFd> CreateAndConfigureLoopDevice(
+    android::base::borrowed_fd target_fd, const std::string& target,
+    uint32_t image_offset, size_t image_size);
+
 void FinishConfiguring(const std::string& loop_device,
                        const std::string& backing_file);
 
@@ -0,0 +1,203 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "apexd_path_waiter.h"
+
+#include <android-base/logging.h>
+#include <android-base/strings.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <filesystem>
+#include <optional>
+#include <thread>
+
+using android::base::ErrnoError;
+using android::base::Join;
+using android::base::Result;
+using android::base::ScopedLockAssertion;
+
+namespace android {
+namespace apex {
+
+namespace {
+
+using namespace std::chrono_literals;
+
+// Used when inotify is not available.
+constexpr auto kPollInterval = 5ms;
+
+std::optional<std::string> FindExisting(const std::vector<std::string>& paths) {
+  for (const auto& path : paths) {
+    struct stat sb;
+    if (stat(path.c_str(), &sb) == 0) {
+      return path;
+    }
+  }
+  return std::nullopt;
+}
+
+// Returns the closest ancestor of |path| that exists, which is the directory
+// an entry on the way to |path| is going to be created in.
+std::string NearestExistingParent(const std::string& path) {
+  std::filesystem::path dir = std::filesystem::path(path).parent_path();
+  while (!dir.empty() && dir != dir.root_path()) {
+    struct stat sb;
+    if (stat(dir.c_str(), &sb) == 0) {
+      break;
+    }
+    dir = dir.parent_path();
+  }
+  return dir.empty() ? "." : dir.string();
+}
+
+}  // namespace
+
+PathWaiter& PathWaiter::GetInstance() {
+  // Intentionally leaked, the reader thread runs until the process exits.
+  static PathWaiter* instance = new PathWaiter();
+  return *instance;
+}
+
+PathWaiter::PathWaiter()
+    : inotify_fd_(inotify_init1(IN_CLOEXEC | IN_NONBLOCK)) {
+  if (inotify_fd_.get() == -1) {
+    PLOG(WARNING) << "Failed to initialize inotify, falling back to polling";
+    return;
+  }
+  std::thread([this]() { ReadEvents(); }).detach();
+}
+
+bool PathWaiter::AddWatch(const std::string& dir) {
+  if (inotify_fd_.get() == -1) {
+    return false;
+  }
+  std::lock_guard lock(mutex_);
+  auto it = watches_.find(dir);
+  if (it != watches_.end()) {
+    it->second.waiters++;
+    return true;
+  }
+  int wd = inotify_add_watch(inotify_fd_.get(), dir.c_str(),
+                             IN_CREATE | IN_MOVED_TO | IN_ATTRIB |
+                                 IN_DELETE_SELF | IN_MOVE_SELF);
+  if (wd == -1) {
+    PLOG(WARNING) << "Failed to watch " << dir;
+    return false;
+  }
+  watches_.emplace(dir, Watch{.wd = wd, .waiters = 1});
+  return true;
+}
+
+void PathWaiter::RemoveWatch(const std::string& dir) {
+  std::lock_guard lock(mutex_);
+  auto it = watches_.find(dir);
+  if (it == watches_.end() || --it->second.waiters > 0) {
+    return;
+  }
+  // Fails if the directory is gone already, which is fine.
+  inotify_rm_watch(inotify_fd_.get(), it->second.wd);
+  watches_.erase(it);
+}
+
+void PathWaiter::ReadEvents() {
+  alignas(struct inotify_event) char buf[4096];
+  while (true) {
+    struct pollfd pfd = {.fd = inotify_fd_.get(), .events = POLLIN};
+    if (TEMP_FAILURE_RETRY(poll(&pfd, 1, -1)) == -1) {
+      PLOG(ERROR) << "Failed to poll inotify";
+      return;
+    }
+    // Drain everything, the contents of the events don't matter: waiters
+    // check their paths again anyway.
+    while (read(inotify_fd_.get(), buf, sizeof(buf)) > 0) {
+    }
+    {
+      std::lock_guard lock(mutex_);
+      generation_++;
+    }
+    cv_.notify_all();
+  }
+}
+
+std::optional<std::string> PathWaiter::WaitForChange(
+    const std::vector<std::string>& paths,
+    const std::vector<std::string>& dirs,
+    std::chrono::steady_clock::time_point deadline, bool watching) {
+  std::unique_lock lock(mutex_);
+  ScopedLockAssertion assume_locked(mutex_);
+  const uint64_t generation = generation_;
+  // The path might have been created before the watches were in place.
+  if (auto found = FindExisting(paths); found.has_value()) {
+    return found;
+  }
+  // So might a directory on the way to it, and no event is coming for that
+  // one. Let the caller watch the new directory instead.
+  for (size_t i = 0; i < dirs.size(); i++) {
+    if (NearestExistingParent(paths[i]) != dirs[i]) {
+      return std::nullopt;
+    }
+  }
+  if (watching) {
+    cv_.wait_until(lock, deadline, [this, generation]() {
+      ScopedLockAssertion lock_assertion(mutex_);
+      return generation_ != generation;
+    });
+  } else {
+    cv_.wait_until(lock,
+                   std::min(deadline, std::chrono::steady_clock::now() +
+                                          kPollInterval));
+  }
+  return std::nullopt;
+}
+
+Result<std::string> PathWaiter::WaitForAny(
+    const std::vector<std::string>& paths, std::chrono::nanoseconds timeout) {
+  const auto deadline = std::chrono::steady_clock::now() + timeout;
+  while (true) {
+    if (auto found = FindExisting(paths); found.has_value()) {
+      return *found;
+    }
+    if (std::chrono::steady_clock::now() >= deadline) {
+      errno = ETIMEDOUT;
+      return ErrnoError() << "Timed out waiting for " << Join(paths, " or ");
+    }
+
+    std::vector<std::string> dirs;
+    for (const auto& path : paths) {
+      std::string dir = NearestExistingParent(path);
+      if (!AddWatch(dir)) {
+        break;
+      }
+      dirs.push_back(std::move(dir));
+    }
+    auto found =
+        WaitForChange(paths, dirs, deadline, dirs.size() == paths.size());
+    for (const auto& dir : dirs) {
+      RemoveWatch(dir);
+    }
+    if (found.has_value()) {
+      return *found;
+    }
+  }
+}
+
+}  // namespace apex
+}  // namespace android
@@ -0,0 +1,87 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <android-base/result.h>
+#include <android-base/thread_annotations.h>
+#include <android-base/unique_fd.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace android {
+namespace apex {
+
+// Waits for paths to appear, e.g. device nodes created by ueventd.
+//
+// All waiters share a single inotify instance, whose events are read by a
+// background thread. Every event wakes up all waiters, which then check their
+// paths again, so a path is noticed as soon as it is created instead of on the
+// next polling interval. If inotify isn't available, waiters fall back to
+// polling.
+class PathWaiter final {
+ public:
+  static PathWaiter& GetInstance();
+
+  PathWaiter(const PathWaiter&) = delete;
+  PathWaiter& operator=(const PathWaiter&) = delete;
+
+  // Waits until any of |paths| exists, and returns the first one that does.
+  // Fails with ETIMEDOUT if none of them appears within |timeout|.
+  android::base::Result<std::string> WaitForAny(
+      const std::vector<std::string>& paths, std::chrono::nanoseconds timeout)
+      REQUIRES(!mutex_);
+
+ private:
+  PathWaiter();
+
+  // Watches |dir| for new entries. Returns false if it couldn't be watched.
+  bool AddWatch(const std::string& dir) REQUIRES(!mutex_);
+  void RemoveWatch(const std::string& dir) REQUIRES(!mutex_);
+  void ReadEvents() REQUIRES(!mutex_);
+  // Waits until the watched directories change or |deadline| passes, or for a
+  // polling interval if not |watching|. |dirs| are the watched directories
+  // for |paths|, in the same order. Returns the path in |paths| that exists,
+  // if any.
+  std::optional<std::string> WaitForChange(
+      const std::vector<std::string>& paths,
+      const std::vector<std::string>& dirs,
+      std::chrono::steady_clock::time_point deadline, bool watching)
+      REQUIRES(!mutex_);
+
+  android::base::unique_fd inotify_fd_;
+
+  std::mutex mutex_;
+  // Notified whenever something changed in one of the watched directories.
+  std::condition_variable cv_;
+  // Incremented on every batch of inotify events.
+  uint64_t generation_ GUARDED_BY(mutex_) = 0;
+  struct Watch {
+    int wd;
+    size_t waiters;
+  };
+  std::map<std::string, Watch> watches_ GUARDED_BY(mutex_);
+};
+
+}  // namespace apex
+}  // namespace android
@@ -0,0 +1,93 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "apexd_path_waiter.h"
+
+#include <android-base/file.h>
+#include <android-base/result-gmock.h>
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+#include <sys/stat.h>
+
+#include <chrono>
+#include <string>
+#include <thread>
+
+namespace android {
+namespace apex {
+
+using android::base::WriteStringToFile;
+using android::base::testing::HasError;
+using android::base::testing::HasValue;
+using android::base::testing::WithCode;
+using namespace std::chrono_literals;
+
+TEST(PathWaiterTest, ReturnsExistingPath) {
+  TemporaryDir td;
+  std::string path = std::string(td.path) + "/file";
+  ASSERT_TRUE(WriteStringToFile("", path));
+  ASSERT_THAT(PathWaiter::GetInstance().WaitForAny(
+                  {std::string(td.path) + "/missing", path}, 0s),
+              HasValue(path));
+}
+
+TEST(PathWaiterTest, WakesUpWhenPathIsCreated) {
+  TemporaryDir td;
+  std::string dir = std::string(td.path) + "/dir";
+  std::string path = dir + "/file";
+  std::thread creator([&]() {
+    std::this_thread::sleep_for(100ms);
+    mkdir(dir.c_str(), 0755);
+    WriteStringToFile("", path);
+  });
+  auto start = std::chrono::steady_clock::now();
+  auto found = PathWaiter::GetInstance().WaitForAny({path}, 10s);
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  creator.join();
+  ASSERT_THAT(found, HasValue(path));
+  ASSERT_LT(elapsed, 5s);
+}
+
+TEST(PathWaiterTest, WakesUpWhenParentIsCreatedWhileStartingToWait) {
+  // Races the creation of the parent directory with the waiter picking the
+  // directory to watch.
+  for (int i = 0; i < 50; i++) {
+    TemporaryDir td;
+    std::string dir = std::string(td.path) + "/dir";
+    std::string path = dir + "/file";
+    std::thread creator([&]() {
+      mkdir(dir.c_str(), 0755);
+      std::this_thread::sleep_for(10ms);
+      WriteStringToFile("", path);
+    });
+    auto start = std::chrono::steady_clock::now();
+    auto found = PathWaiter::GetInstance().WaitForAny({path}, 10s);
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    creator.join();
+    ASSERT_THAT(found, HasValue(path));
+    ASSERT_LT(elapsed, 5s);
+  }
+}
+
+TEST(PathWaiterTest, TimesOut) {
+  TemporaryDir td;
+  std::string path = std::string(td.path) + "/missing";
+  ASSERT_THAT(PathWaiter::GetInstance().WaitForAny({path}, 50ms),
+              HasError(WithCode(ETIMEDOUT)));
+}
+
+}  // namespace apex
+}  // namespace android
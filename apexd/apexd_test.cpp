@@ -28,6 +28,7 @@
 #include <selinux/selinux.h>
 #include <sys/stat.h>
 
+#include <algorithm>
 #include <functional>
 #include <optional>
 #include <string>
@@ -186,6 +187,15 @@ class ApexdUnitTest : public ::testing::Test {
     return digest->root_digest;
   }
 
+  // Hashtrees are named after the root digest of their APEX.
+  std::string GetHashTreeFile(const std::string& apex_path) {
+    auto apex = ApexFile::Open(apex_path);
+    if (!apex.ok()) {
+      return "";
+    }
+    return hash_tree_dir_ + "/" + GetRootDigest(*apex);
+  }
+
   std::string AddPreInstalledApex(const std::string& apex_name) {
     fs::copy(GetTestFile(apex_name), built_in_dir_);
     return StringPrintf("%s/%s", built_in_dir_.c_str(), apex_name.c_str());
@@ -455,6 +465,47 @@ TEST_F(ApexdUnitTest, ProcessCompressedApex) {
               UnorderedElementsAre(ApexFileEq(ByRef(*decompressed_apex))));
 }
 
+TEST_F(ApexdUnitTest, ProcessCompressedApexPreparesHashTree) {
+  auto compressed_apex = ApexFile::Open(
+      AddPreInstalledApex("com.android.apex.compressed.v1.capex"));
+
+  std::vector<ApexFileRef> compressed_apex_list;
+  compressed_apex_list.emplace_back(std::cref(*compressed_apex));
+  auto return_value =
+      ProcessCompressedApex(compressed_apex_list, /* is_ota_chroot= */ false);
+  ASSERT_EQ(return_value.size(), 1u);
+
+  auto verity_data =
+      return_value[0].VerifyApexVerity(return_value[0].GetBundledPublicKey());
+  ASSERT_THAT(verity_data, Ok());
+  // Only APEXes without an embedded hashtree need one on /data.
+  std::string hashtree_path =
+      GetHashTreeDir() + "/" + verity_data->root_digest;
+  ASSERT_THAT(PathExists(hashtree_path),
+              HasValue(verity_data->desc->tree_size == 0));
+}
+
+TEST_F(ApexdUnitTest, ProcessCompressedApexMountsStoredApexInPlace) {
+  const std::string capex_path =
+      AddPreInstalledApex("com.android.apex.compressed.v1_stored.capex");
+  auto compressed_apex = ApexFile::Open(capex_path);
+  ASSERT_THAT(compressed_apex, Ok());
+
+  std::vector<ApexFileRef> compressed_apex_list;
+  compressed_apex_list.emplace_back(std::cref(*compressed_apex));
+  auto return_value =
+      ProcessCompressedApex(compressed_apex_list, /* is_ota_chroot= */ false);
+  ASSERT_EQ(return_value.size(), 1u);
+  ASSERT_EQ(return_value[0].GetPath(), compressed_apex->GetPath());
+  ASSERT_FALSE(return_value[0].IsCompressed());
+
+  // Nothing was written to /data.
+  std::string decompressed_file_path = StringPrintf(
+      "%s/com.android.apex.compressed@1%s", GetDecompressionDir().c_str(),
+      kDecompressedApexPackageSuffix);
+  ASSERT_THAT(PathExists(decompressed_file_path), HasValue(false));
+}
+
 TEST_F(ApexdUnitTest, ProcessCompressedApexRunsVerification) {
   auto compressed_apex_mismatch_key = ApexFile::Open(AddPreInstalledApex(
       "com.android.apex.compressed_key_mismatch_with_original.capex"));
@@ -996,8 +1047,8 @@ TEST_F(ApexdMountTest, InstallPackageRejectsCorrupted) {
   UnmountOnTearDown(file_path);
 
   auto ret = InstallPackage(GetTestFile("test.rebootless_apex_corrupted.apex"));
-  ASSERT_THAT(ret,
-              HasError(WithMessage(HasSubstr("Can't verify /dev/block/dm-"))));
+  ASSERT_THAT(ret, HasError(WithMessage(
+                       HasSubstr("Failed to verify payload of"))));
 }
 
 TEST_F(ApexdMountTest, InstallPackageRejectsProvidesSharedLibs) {
@@ -1610,6 +1661,69 @@ TEST_F(ApexdMountTest, ActivatePackageShowsUpInMountedApexDatabase) {
       << "mounted apexes";
 }
 
+TEST_F(ApexdMountTest, ActivatePreInstalledErofsPackage) {
+  std::string file_path = AddPreInstalledApex("apex.apexd_test_erofs.apex");
+  ApexFileRepository::GetInstance().AddPreInstalledApex({GetBuiltInDir()});
+
+  ASSERT_THAT(ActivatePackage(file_path), Ok());
+  UnmountOnTearDown(file_path);
+
+  auto& db = GetApexDatabaseForTesting();
+  std::optional<MountedApexData> mounted_apex;
+  db.ForallMountedApexes("com.android.apex.test_package",
+                         [&](const MountedApexData& d, bool active) {
+                           if (active) {
+                             mounted_apex.emplace(d);
+                           }
+                         });
+  ASSERT_TRUE(mounted_apex);
+  ASSERT_THAT(mounted_apex->device_name, IsEmpty());
+  // Depending on the kernel, the payload is mounted either from the APEX file
+  // or from a loop device. Both must survive repopulating the database.
+  if (!mounted_apex->loop_name.empty()) {
+    ASSERT_THAT(mounted_apex->loop_name, StartsWith("/dev"));
+  }
+
+  db.Reset();
+  db.PopulateFromMounts(GetDataDir(), GetDecompressionDir(), GetHashTreeDir());
+
+  std::optional<MountedApexData> populated_apex;
+  db.ForallMountedApexes("com.android.apex.test_package",
+                         [&](const MountedApexData& d, bool active) {
+                           if (active) {
+                             populated_apex.emplace(d);
+                           }
+                         });
+  ASSERT_TRUE(populated_apex);
+  ASSERT_EQ(populated_apex->full_path, file_path);
+  ASSERT_EQ(populated_apex->loop_name, mounted_apex->loop_name);
+}
+
+TEST_F(ApexdMountTest, MountedApexDatabaseKeepsApexFileSnapshot) {
+  std::string file_path = AddPreInstalledApex("apex.apexd_test.apex");
+  ApexFileRepository::GetInstance().AddPreInstalledApex({GetBuiltInDir()});
+
+  ASSERT_THAT(ActivatePackage(file_path), Ok());
+  UnmountOnTearDown(file_path);
+
+  auto& db = GetApexDatabaseForTesting();
+  std::optional<MountedApexData> mounted_apex;
+  db.ForallMountedApexes("com.android.apex.test_package",
+                         [&](const MountedApexData& d, bool active) {
+                           if (active) {
+                             mounted_apex.emplace(d);
+                           }
+                         });
+  ASSERT_TRUE(mounted_apex);
+  ASSERT_NE(nullptr, mounted_apex->apex_file);
+  ASSERT_EQ(file_path, mounted_apex->apex_file->GetPath());
+
+  // Active packages are served from the snapshot.
+  auto active_apexes = GetActivePackages();
+  ASSERT_EQ(1u, active_apexes.size());
+  ASSERT_THAT(active_apexes[0], ApexFileEq(ByRef(*mounted_apex->apex_file)));
+}
+
 TEST_F(ApexdMountTest, ActivatePackageNoHashtree) {
   AddPreInstalledApex("apex.apexd_test.apex");
   ApexFileRepository::GetInstance().AddPreInstalledApex({GetBuiltInDir()});
@@ -1619,8 +1733,7 @@ TEST_F(ApexdMountTest, ActivatePackageNoHashtree) {
   UnmountOnTearDown(file_path);
 
   // Check that hashtree was generated
-  std::string hashtree_path =
-      GetHashTreeDir() + "/com.android.apex.test_package@1";
+  std::string hashtree_path = GetHashTreeFile(file_path);
   ASSERT_EQ(0, access(hashtree_path.c_str(), F_OK));
 
   // Check that block device can be read.
@@ -1713,14 +1826,13 @@ TEST_F(ApexdMountTest, NoHashtreeApexNewSessionDoesNotImpactActivePackage) {
   // Check that new hashtree file was created.
   {
     std::string hashtree_path =
-        GetHashTreeDir() + "/com.android.apex.test_package@1.new";
+        GetHashTreeFile(GetTestFile("apex.apexd_test_no_hashtree_2.apex"));
     ASSERT_THAT(PathExists(hashtree_path), HasValue(true))
         << hashtree_path << " does not exist";
   }
   // Check that active hashtree is still there.
   {
-    std::string hashtree_path =
-        GetHashTreeDir() + "/com.android.apex.test_package@1";
+    std::string hashtree_path = GetHashTreeFile(file_path);
     ASSERT_THAT(PathExists(hashtree_path), HasValue(true))
         << hashtree_path << " does not exist";
   }
@@ -1731,7 +1843,7 @@ TEST_F(ApexdMountTest, NoHashtreeApexNewSessionDoesNotImpactActivePackage) {
   ASSERT_THAT(ReadDevice(*block_device), Ok());
 }
 
-TEST_F(ApexdMountTest, NoHashtreeApexStagePackagesMovesHashtree) {
+TEST_F(ApexdMountTest, NoHashtreeApexStagePackagesKeepsHashtree) {
   MockCheckpointInterface checkpoint_interface;
   checkpoint_interface.SetSupportsCheckpoint(true);
   InitializeVold(&checkpoint_interface);
@@ -1764,28 +1876,15 @@ TEST_F(ApexdMountTest, NoHashtreeApexStagePackagesMovesHashtree) {
   auto staged_apex = std::move((*status)[0]);
 
   // Check that new hashtree file was created.
-  std::vector<uint8_t> original_hashtree_data;
-  {
-    std::string hashtree_path =
-        GetHashTreeDir() + "/com.android.apex.test_package@1.new";
-    ASSERT_THAT(PathExists(hashtree_path), HasValue(true));
-    original_hashtree_data = read_fn(hashtree_path);
-  }
+  std::string hashtree_path = GetHashTreeFile(staged_apex.GetPath());
+  ASSERT_THAT(PathExists(hashtree_path), HasValue(true));
+  std::vector<uint8_t> original_hashtree_data = read_fn(hashtree_path);
 
+  // Check that the hashtree is left where the next boot looks for it.
   ASSERT_THAT(StagePackages({staged_apex.GetPath()}), Ok());
-  // Check that hashtree file was moved.
-  {
-    std::string hashtree_path =
-        GetHashTreeDir() + "/com.android.apex.test_package@1.new";
-    ASSERT_THAT(PathExists(hashtree_path), HasValue(false));
-  }
-  {
-    std::string hashtree_path =
-        GetHashTreeDir() + "/com.android.apex.test_package@1";
-    ASSERT_THAT(PathExists(hashtree_path), HasValue(true));
-    std::vector<uint8_t> moved_hashtree_data = read_fn(hashtree_path);
-    ASSERT_EQ(moved_hashtree_data, original_hashtree_data);
-  }
+  ASSERT_THAT(PathExists(hashtree_path), HasValue(true));
+  std::vector<uint8_t> staged_hashtree_data = read_fn(hashtree_path);
+  ASSERT_EQ(staged_hashtree_data, original_hashtree_data);
 }
 
 TEST_F(ApexdMountTest, DeactivePackageTearsDownVerityDevice) {
@@ -3222,6 +3321,36 @@ TEST_F(ApexdMountTest, OnStartOnlyPreInstalledApexes) {
                                    "/apex/com.android.apex.test_package_2@1"));
 }
 
+TEST_F(ApexdMountTest, OnStartPublishesMountedMarkers) {
+  MockCheckpointInterface checkpoint_interface;
+  // Need to call InitializeVold before calling OnStart
+  InitializeVold(&checkpoint_interface);
+
+  std::string apex_path_1 = AddPreInstalledApex("apex.apexd_test.apex");
+  std::string apex_path_2 =
+      AddPreInstalledApex("apex.apexd_test_different_app.apex");
+
+  ASSERT_THAT(
+      ApexFileRepository::GetInstance().AddPreInstalledApex({GetBuiltInDir()}),
+      Ok());
+
+  OnStart();
+
+  UnmountOnTearDown(apex_path_1);
+  UnmountOnTearDown(apex_path_2);
+
+  ASSERT_THAT(PathExists("/apex/.mounted/com.android.apex.test_package"),
+              HasValue(true));
+  ASSERT_THAT(PathExists("/apex/.mounted/com.android.apex.test_package_2"),
+              HasValue(true));
+
+  ASSERT_THAT(DeactivatePackage(apex_path_1), Ok());
+  ASSERT_THAT(PathExists("/apex/.mounted/com.android.apex.test_package"),
+              HasValue(false));
+  ASSERT_THAT(PathExists("/apex/.mounted/com.android.apex.test_package_2"),
+              HasValue(true));
+}
+
 TEST_F(ApexdMountTest, OnStartDataHasHigherVersion) {
   MockCheckpointInterface checkpoint_interface;
   // Need to call InitializeVold before calling OnStart
@@ -3459,6 +3588,47 @@ TEST_F(ApexdMountTest, OnStartOnlyPreInstalledCapexes) {
                          });
 }
 
+TEST_F(ApexdMountTest, StoredCapexMountedInPlaceSurvivesRestart) {
+  MockCheckpointInterface checkpoint_interface;
+  // Need to call InitializeVold before calling OnStart
+  InitializeVold(&checkpoint_interface);
+
+  std::string capex_path =
+      AddPreInstalledApex("com.android.apex.compressed.v1_stored.capex");
+
+  ASSERT_THAT(
+      ApexFileRepository::GetInstance().AddPreInstalledApex({GetBuiltInDir()}),
+      Ok());
+
+  OnStart();
+  UnmountOnTearDown(capex_path);
+
+  auto find_active = [](const std::vector<ApexFile>& apexes) {
+    return std::find_if(apexes.begin(), apexes.end(), [](const ApexFile& a) {
+      return a.GetManifest().name() == "com.android.apex.compressed";
+    });
+  };
+  auto active = GetActivePackages();
+  auto mounted = find_active(active);
+  ASSERT_NE(mounted, active.end());
+  ASSERT_EQ(mounted->GetPath(), capex_path);
+  ASSERT_FALSE(mounted->IsCompressed());
+
+  // After a restart, the mount is recognized as the original APEX stored in
+  // the CAPEX, not as the CAPEX itself.
+  auto& db = GetApexDatabaseForTesting();
+  db.Reset();
+  db.PopulateFromMounts(GetDataDir(), GetDecompressionDir(), GetHashTreeDir());
+
+  auto repopulated = GetActivePackages();
+  auto populated = find_active(repopulated);
+  ASSERT_NE(populated, repopulated.end());
+  ASSERT_EQ(populated->GetPath(), capex_path);
+  ASSERT_FALSE(populated->IsCompressed());
+  ASSERT_EQ(populated->GetImageOffset(), mounted->GetImageOffset());
+  ASSERT_EQ(populated->GetImageSize(), mounted->GetImageSize());
+}
+
 TEST_F(ApexdMountTest, OnStartDataHasHigherVersionThanCapex) {
   MockCheckpointInterface checkpoint_interface;
   // Need to call InitializeVold before calling OnStart
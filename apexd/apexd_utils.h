@@ -29,6 +29,7 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <unistd.h>
 
 #include <android-base/chrono_utils.h>
 #include <android-base/logging.h>
@@ -40,6 +41,7 @@
 #include <selinux/android.h>
 
 #include "apex_constants.h"
+#include "apexd_path_waiter.h"
 
 namespace android {
 namespace apex {
@@ -168,21 +170,19 @@ inline void Reboot() {
 
 inline android::base::Result<void> WaitForFile(
     const std::string& path, std::chrono::nanoseconds timeout) {
+  // Most of the time the file is there already, which isn't worth logging.
+  if (access(path.c_str(), F_OK) == 0) {
+    return {};
+  }
   android::base::Timer t;
-  bool has_slept = false;
-  while (t.duration() < timeout) {
-    struct stat sb;
-    if (stat(path.c_str(), &sb) != -1) {
-      if (has_slept) {
-        LOG(INFO) << "wait for '" << path << "' took " << t;
-      }
-      return {};
-    }
-    std::this_thread::sleep_for(5ms);
-    has_slept = true;
+  auto found = PathWaiter::GetInstance().WaitForAny({path}, timeout);
+  if (!found.ok()) {
+    errno = found.error().code();
+    return android::base::ErrnoError()
+           << "wait for '" << path << "' timed out and took " << t;
   }
-  return android::base::ErrnoError()
-         << "wait for '" << path << "' timed out and took " << t;
+  LOG(INFO) << "wait for '" << path << "' took " << t;
+  return {};
 }
 
 inline android::base::Result<std::vector<std::string>> GetSubdirs(
@@ -19,24 +19,48 @@
 #include <android-base/file.h>
 #include <android-base/result.h>
 #include <android-base/unique_fd.h>
+#include <fcntl.h>
+#include <google/protobuf/util/message_differencer.h>
+#include <openssl/evp.h>
+#include <openssl/sha.h>
+#include <sys/stat.h>
+#include <time.h>
 #include <verity/hash_tree_builder.h>
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
 #include <filesystem>
+#include <future>
 #include <iomanip>
+#include <memory>
+#include <optional>
 #include <sstream>
 #include <string>
+#include <string_view>
+#include <unordered_set>
 #include <vector>
 
 #include "apex_constants.h"
 #include "apex_file.h"
+#include "apexd_executor.h"
 #include "apexd_utils.h"
+#include "hashtree_stamp.pb.h"
 
+using android::base::borrowed_fd;
 using android::base::Dirname;
 using android::base::ErrnoError;
 using android::base::Error;
+using android::base::ReadFileToString;
 using android::base::ReadFully;
+using android::base::ReadFullyAtOffset;
 using android::base::Result;
 using android::base::unique_fd;
+using android::base::WriteFully;
+using android::base::WriteStringToFd;
+using google::protobuf::util::MessageDifferencer;
 
 namespace android {
 namespace apex {
@@ -59,64 +83,91 @@ std::vector<uint8_t> HexToBin(const std::string& hex) {
   return bin;
 }
 
-Result<void> GenerateHashTree(const ApexFile& apex,
-                              const ApexVerityData& verity_data,
-                              const std::string& hashtree_file) {
-  unique_fd fd(
-      TEMP_FAILURE_RETRY(open(apex.GetPath().c_str(), O_RDONLY | O_CLOEXEC)));
-  if (fd.get() == -1) {
-    return ErrnoError() << "Failed to open " << apex.GetPath();
-  }
+// Number of data blocks read by each pread() when building a hashtree.
+constexpr uint64_t kBlocksPerRead = 256;
 
-  auto block_size = verity_data.desc->hash_block_size;
-  auto image_size = verity_data.desc->image_size;
+// Alignment of read buffers, enough for O_DIRECT.
+constexpr size_t kReadAlignment = 4096;
 
-  auto hash_fn = HashTreeBuilder::HashFunction(verity_data.hash_algorithm);
-  if (hash_fn == nullptr) {
-    return Error() << "Unsupported hash algorithm "
-                   << verity_data.hash_algorithm;
-  }
+// Same as HashTreeBuilder::HashBlock(): the salt is prepended to the block.
+bool HashBlock(EVP_MD_CTX* ctx, const EVP_MD* md,
+               const std::vector<uint8_t>& salt, const uint8_t* block,
+               size_t block_size, uint8_t* out) {
+  return EVP_DigestInit_ex(ctx, md, nullptr) == 1 &&
+         EVP_DigestUpdate(ctx, salt.data(), salt.size()) == 1 &&
+         EVP_DigestUpdate(ctx, block, block_size) == 1 &&
+         EVP_DigestFinal_ex(ctx, out, nullptr) == 1;
+}
 
-  auto builder = std::make_unique<HashTreeBuilder>(block_size, hash_fn);
-  if (!builder->Initialize(image_size, HexToBin(verity_data.salt))) {
-    return Error() << "Invalid image size " << image_size;
+// Hashes data blocks [first_block, first_block + block_count) of the image
+// into |out|, one digest after the other. The blocks are read into |buf| with
+// a single read.
+Result<void> HashDataBlocks(borrowed_fd fd, off_t offset, uint32_t block_size,
+                            const EVP_MD* md, const std::vector<uint8_t>& salt,
+                            uint64_t first_block, uint64_t block_count,
+                            uint8_t* buf, uint8_t* out) {
+  bssl::ScopedEVP_MD_CTX ctx;
+  const size_t hash_size = EVP_MD_size(md);
+  offset += first_block * block_size;
+  const size_t len = block_count * block_size;
+  if (!ReadFullyAtOffset(fd, buf, len, offset)) {
+    return ErrnoError() << "Failed to read " << len << " bytes at " << offset;
+  }
+  for (uint64_t i = 0; i < block_count; i++) {
+    if (!HashBlock(ctx.get(), md, salt, buf + i * block_size, block_size,
+                   out + i * hash_size)) {
+      return Error() << "Failed to hash block at " << offset + i * block_size;
+    }
   }
+  return {};
+}
 
-  if (!apex.GetImageOffset()) {
-    return Error() << "Cannot generate HashTree without image offset";
+Result<void> WriteHashTree(const std::vector<uint8_t>& tree,
+                           const std::string& hashtree_file) {
+  unique_fd out_fd(TEMP_FAILURE_RETRY(open(
+      hashtree_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)));
+  if (out_fd.get() == -1) {
+    return ErrnoError() << "Failed to open " << hashtree_file;
   }
-  if (lseek(fd, apex.GetImageOffset().value(), SEEK_SET) == -1) {
-    return ErrnoError() << "Failed to seek";
+  // Synced, so that the stamp written afterwards never vouches for a hashtree
+  // that didn't make it to disk.
+  if (!WriteFully(out_fd, tree.data(), tree.size()) ||
+      fsync(out_fd.get()) != 0) {
+    return ErrnoError() << "Failed to write hashtree to " << hashtree_file;
   }
+  return {};
+}
 
-  auto block_count = image_size / block_size;
-  auto buf = std::vector<uint8_t>(block_size);
-  while (block_count-- > 0) {
-    if (!ReadFully(fd, buf.data(), block_size)) {
-      return Error() << "Failed to read";
-    }
-    if (!builder->Update(buf.data(), block_size)) {
-      return Error() << "Failed to build hashtree: Update";
-    }
+Result<void> GenerateHashTree(const ApexFile& apex,
+                              const ApexVerityData& verity_data,
+                              const std::string& hashtree_file) {
+  if (!apex.GetImageOffset()) {
+    return Error() << "Cannot generate HashTree without image offset";
   }
-  if (!builder->BuildHashTree()) {
-    return Error() << "Failed to build hashtree: incomplete data";
+  const auto time_started = std::chrono::steady_clock::now();
+  const uint64_t image_size = verity_data.desc->image_size;
+  auto hashtree = BuildHashTree(
+      apex.GetFd(), apex.GetImageOffset().value(), image_size,
+      verity_data.desc->hash_block_size, verity_data.hash_algorithm,
+      HexToBin(verity_data.salt));
+  if (!hashtree.ok()) {
+    return hashtree.error();
   }
 
-  auto golden_digest = HexToBin(verity_data.root_digest);
-  auto digest = builder->root_hash();
-  // This returns zero-padded digest.
-  // resize() it to compare with golden digest,
-  digest.resize(golden_digest.size());
-  if (digest != golden_digest) {
+  if (hashtree->root_digest != HexToBin(verity_data.root_digest)) {
     return Error() << "Failed to build hashtree: root digest mismatch";
   }
 
-  unique_fd out_fd(TEMP_FAILURE_RETRY(open(
-      hashtree_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)));
-  if (!builder->WriteHashTreeToFd(out_fd, 0)) {
-    return Error() << "Failed to write hashtree to " << hashtree_file;
+  if (auto st = WriteHashTree(hashtree->tree, hashtree_file); !st.ok()) {
+    return st.error();
   }
+  const auto elapsed_us =
+      std::chrono::duration_cast<std::chrono::microseconds>(
+          std::chrono::steady_clock::now() - time_started)
+          .count();
+  LOG(INFO) << "Generated hashtree of " << apex.GetPath() << " in "
+            << elapsed_us / 1000 << "ms ("
+            << (elapsed_us > 0 ? image_size / elapsed_us : 0) << " MB/s)";
   return {};
 }
 
@@ -152,8 +203,367 @@ Result<std::string> CalculateRootDigest(const std::string& hashtree_file,
   return result;
 }
 
+// Hashtrees are named after the root digest of their APEX, see
+// GetHashTreeFileName() in apexd.cpp.
+bool IsHashTreeName(const std::string& name) {
+  return !name.empty() && std::all_of(name.begin(), name.end(), [](char c) {
+    return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f');
+  });
+}
+
+// Bump this every time the meaning of ::apex::proto::HashTreeStamp changes.
+constexpr uint32_t kHashTreeStampVersion = 1;
+
+int64_t ToNanos(const struct timespec& ts) {
+  return static_cast<int64_t>(ts.tv_sec) * 1'000'000'000 + ts.tv_nsec;
+}
+
+std::string Checksum(const std::string& data) {
+  std::string digest(SHA256_DIGEST_LENGTH, '\0');
+  SHA256(reinterpret_cast<const uint8_t*>(data.data()), data.size(),
+         reinterpret_cast<uint8_t*>(digest.data()));
+  return digest;
+}
+
+::apex::proto::HashTreeStamp MakeHashTreeStamp(
+    const ApexVerityData& verity_data, const struct stat& st) {
+  ::apex::proto::HashTreeStamp stamp;
+  stamp.set_dev(st.st_dev);
+  stamp.set_inode(st.st_ino);
+  stamp.set_size(st.st_size);
+  stamp.set_mtime_ns(ToNanos(st.st_mtim));
+  stamp.set_root_digest(verity_data.root_digest);
+  stamp.set_salt(verity_data.salt);
+  stamp.set_hash_algorithm(verity_data.hash_algorithm);
+  stamp.set_image_size(verity_data.desc->image_size);
+  stamp.set_block_size(verity_data.desc->hash_block_size);
+  return stamp;
+}
+
+// Returns whether the stamp of |hashtree_file| says that it was generated for
+// |verity_data| and that it hasn't been modified since. Any error just means
+// that the stamp can't be trusted.
+bool MatchesHashTreeStamp(const std::string& hashtree_file,
+                          const ApexVerityData& verity_data) {
+  struct stat st;
+  if (stat(hashtree_file.c_str(), &st) != 0) {
+    return false;
+  }
+  const std::string stamp_path = GetHashTreeStampPath(hashtree_file);
+  std::string content;
+  if (!ReadFileToString(stamp_path, &content)) {
+    return false;
+  }
+  ::apex::proto::HashTreeStampFile file;
+  ::apex::proto::HashTreeStamp stamp;
+  if (!file.ParseFromString(content) ||
+      file.version() != kHashTreeStampVersion ||
+      file.checksum() != Checksum(file.stamp()) ||
+      !stamp.ParseFromString(file.stamp())) {
+    LOG(WARNING) << "Ignoring invalid " << stamp_path;
+    return false;
+  }
+  return MessageDifferencer::Equals(stamp,
+                                    MakeHashTreeStamp(verity_data, st));
+}
+
+// Records that |hashtree_file|, in its current state, matches |verity_data|.
+Result<void> WriteHashTreeStamp(const std::string& hashtree_file,
+                                const ApexVerityData& verity_data) {
+  struct stat st;
+  if (stat(hashtree_file.c_str(), &st) != 0) {
+    return ErrnoError() << "Failed to stat " << hashtree_file;
+  }
+  ::apex::proto::HashTreeStampFile file;
+  file.set_version(kHashTreeStampVersion);
+  if (!MakeHashTreeStamp(verity_data, st)
+           .SerializeToString(file.mutable_stamp())) {
+    return Error() << "Failed to serialize stamp of " << hashtree_file;
+  }
+  file.set_checksum(Checksum(file.stamp()));
+  std::string content;
+  if (!file.SerializeToString(&content)) {
+    return Error() << "Failed to serialize stamp of " << hashtree_file;
+  }
+
+  const std::string stamp_path = GetHashTreeStampPath(hashtree_file);
+  const std::string temp_path = stamp_path + ".tmp";
+  unique_fd fd(TEMP_FAILURE_RETRY(
+      open(temp_path.c_str(),
+           O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | O_NOFOLLOW, 0600)));
+  if (fd.get() == -1) {
+    return ErrnoError() << "Failed to open " << temp_path;
+  }
+  if (!WriteStringToFd(content, fd) || fsync(fd.get()) != 0) {
+    unlink(temp_path.c_str());
+    return ErrnoError() << "Failed to write " << temp_path;
+  }
+  if (rename(temp_path.c_str(), stamp_path.c_str()) != 0) {
+    unlink(temp_path.c_str());
+    return ErrnoError() << "Failed to rename " << temp_path << " to "
+                        << stamp_path;
+  }
+  return {};
+}
+
+
+// The APK Signing Block sits right before the central directory. It is a list
+// of id-value pairs, see
+// https://source.android.com/docs/security/features/apksigning/v2#apk-signing-block
+constexpr std::string_view kApkSigBlockMagic = "APK Sig Block 42";
+// Size of the block, repeated, followed by the magic.
+constexpr size_t kApkSigBlockFooterSize = 8 + kApkSigBlockMagic.size();
+// Id of the pair holding a sidecar hashtree. Verifiers ignore unknown ids, and
+// pairs are not covered by the v2/v3 signatures, which sign the block's offset
+// rather than its content.
+constexpr uint32_t kSidecarHashTreeId = 0x68547041;
+constexpr uint32_t kEocdMagic = 0x06054b50;
+constexpr size_t kEocdSize = 22;
+
+uint16_t GetLE16(const uint8_t* p) { return p[0] | (p[1] << 8); }
+
+uint32_t GetLE32(const uint8_t* p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) |
+         (static_cast<uint32_t>(p[3]) << 24);
+}
+
+uint64_t GetLE64(const uint8_t* p) {
+  return GetLE32(p) | (static_cast<uint64_t>(GetLE32(p + 4)) << 32);
+}
+
+void PutLE32(uint8_t* p, uint32_t v) {
+  for (int i = 0; i < 4; i++) {
+    p[i] = v >> (8 * i);
+  }
+}
+
+void AppendLE32(std::vector<uint8_t>& out, uint32_t v) {
+  out.resize(out.size() + 4);
+  PutLE32(out.data() + out.size() - 4, v);
+}
+
+void AppendLE64(std::vector<uint8_t>& out, uint64_t v) {
+  AppendLE32(out, v);
+  AppendLE32(out, v >> 32);
+}
+
+struct ApkSigningBlock {
+  // File offset of the block.
+  uint64_t offset;
+  // The pairs, without the size fields and the magic around them.
+  std::vector<uint8_t> pairs;
+  uint64_t cd_offset;
+  uint64_t cd_size;
+  // End of central directory record, with its comment. Ends the file.
+  std::vector<uint8_t> eocd;
+};
+
+Result<ApkSigningBlock> ReadApkSigningBlock(borrowed_fd fd) {
+  struct stat st;
+  if (fstat(fd.get(), &st) != 0) {
+    return ErrnoError() << "Failed to stat";
+  }
+  const uint64_t file_size = st.st_size;
+  if (file_size < kEocdSize) {
+    return Error() << "Not a zip file";
+  }
+  // The record is followed by a comment of up to 64 KiB.
+  const uint64_t tail_size =
+      std::min<uint64_t>(file_size, kEocdSize + UINT16_MAX);
+  std::vector<uint8_t> tail(tail_size);
+  if (!ReadFullyAtOffset(fd, tail.data(), tail.size(),
+                         file_size - tail_size)) {
+    return ErrnoError() << "Failed to read end of central directory";
+  }
+  std::optional<size_t> eocd_pos;
+  for (size_t pos = tail_size - kEocdSize + 1; pos-- > 0;) {
+    if (GetLE32(&tail[pos]) == kEocdMagic &&
+        pos + kEocdSize + GetLE16(&tail[pos + 20]) == tail_size) {
+      eocd_pos = pos;
+      break;
+    }
+  }
+  if (!eocd_pos.has_value()) {
+    return Error() << "No end of central directory";
+  }
+
+  ApkSigningBlock block;
+  block.cd_size = GetLE32(&tail[*eocd_pos + 12]);
+  block.cd_offset = GetLE32(&tail[*eocd_pos + 16]);
+  block.eocd.assign(tail.begin() + *eocd_pos, tail.end());
+  // Also rules out zip64, which uses 0xffffffff here.
+  if (block.cd_offset + block.cd_size != file_size - block.eocd.size()) {
+    return Error() << "Central directory isn't right before its end record";
+  }
+  if (block.cd_offset < kApkSigBlockFooterSize + 8) {
+    return Error() << "No APK Signing Block";
+  }
+  std::array<uint8_t, kApkSigBlockFooterSize> footer;
+  if (!ReadFullyAtOffset(fd, footer.data(), footer.size(),
+                         block.cd_offset - footer.size())) {
+    return ErrnoError() << "Failed to read APK Signing Block";
+  }
+  if (std::string_view(reinterpret_cast<const char*>(footer.data() + 8),
+                       kApkSigBlockMagic.size()) != kApkSigBlockMagic) {
+    return Error() << "No APK Signing Block";
+  }
+  const uint64_t size = GetLE64(footer.data());
+  if (size < kApkSigBlockFooterSize || size > block.cd_offset - 8) {
+    return Error() << "Invalid APK Signing Block size " << size;
+  }
+  block.offset = block.cd_offset - size - 8;
+  std::array<uint8_t, 8> header;
+  if (!ReadFullyAtOffset(fd, header.data(), header.size(), block.offset)) {
+    return ErrnoError() << "Failed to read APK Signing Block";
+  }
+  if (GetLE64(header.data()) != size) {
+    return Error() << "APK Signing Block sizes don't match";
+  }
+  block.pairs.resize(size - kApkSigBlockFooterSize);
+  if (!ReadFullyAtOffset(fd, block.pairs.data(), block.pairs.size(),
+                         block.offset + 8)) {
+    return ErrnoError() << "Failed to read APK Signing Block";
+  }
+  return block;
+}
+
+// Calls |fn| with the id, and the position and size within |pairs| of the
+// value, of each pair.
+template <typename Fn>
+Result<void> ForEachPair(const std::vector<uint8_t>& pairs, const Fn& fn) {
+  for (size_t pos = 0; pos < pairs.size();) {
+    if (pairs.size() - pos < 12) {
+      return Error() << "Truncated APK Signing Block pair";
+    }
+    const uint64_t len = GetLE64(&pairs[pos]);
+    if (len < 4 || len > pairs.size() - pos - 8) {
+      return Error() << "Invalid APK Signing Block pair size " << len;
+    }
+    fn(GetLE32(&pairs[pos + 8]), pos + 12, len - 4);
+    pos += 8 + len;
+  }
+  return {};
+}
+
 }  // namespace
 
+Result<HashTree> BuildHashTree(borrowed_fd fd, off_t offset,
+                               uint64_t image_size, uint32_t block_size,
+                               const std::string& hash_algorithm,
+                               const std::vector<uint8_t>& salt,
+                               bool drop_cache) {
+  const EVP_MD* md = HashTreeBuilder::HashFunction(hash_algorithm);
+  if (md == nullptr) {
+    return Error() << "Unsupported hash algorithm " << hash_algorithm;
+  }
+  const size_t hash_size = EVP_MD_size(md);
+  if (block_size == 0 || hash_size * 2 >= block_size) {
+    return Error() << "Invalid block size " << block_size;
+  }
+  if (image_size == 0 || image_size % block_size != 0) {
+    return Error() << "Invalid image size " << image_size;
+  }
+  auto padded = [block_size](uint64_t size) {
+    return (size + block_size - 1) / block_size * block_size;
+  };
+
+  // The bottom level covers the whole image and is where all the work is.
+  // Tasks take chunks of kBlocksPerRead blocks in turn and write their digests
+  // straight to their final position, until the first chunk that fails.
+  const uint64_t block_count = image_size / block_size;
+  std::vector<std::vector<uint8_t>> levels;
+  levels.emplace_back(padded(block_count * hash_size), 0);
+  uint8_t* bottom = levels.back().data();
+
+  const uint64_t num_chunks =
+      (block_count + kBlocksPerRead - 1) / kBlocksPerRead;
+  const size_t buf_size = (kBlocksPerRead * block_size + kReadAlignment - 1) /
+                          kReadAlignment * kReadAlignment;
+  std::atomic<uint64_t> next_chunk = 0;
+  std::atomic<uint64_t> blocks_done = 0;
+  std::atomic<bool> failed = false;
+  auto hash_chunks = [&]() -> Result<void> {
+    std::unique_ptr<uint8_t, decltype(&free)> buf(
+        static_cast<uint8_t*>(aligned_alloc(kReadAlignment, buf_size)), free);
+    if (buf == nullptr) {
+      failed = true;
+      return Error() << "Failed to allocate " << buf_size << " bytes";
+    }
+    for (uint64_t chunk = next_chunk++; chunk < num_chunks && !failed;
+         chunk = next_chunk++) {
+      const uint64_t first = chunk * kBlocksPerRead;
+      const uint64_t blocks = std::min(kBlocksPerRead, block_count - first);
+      auto st = HashDataBlocks(fd, offset, block_size, md, salt, first, blocks,
+                               buf.get(), bottom + first * hash_size);
+      if (!st.ok()) {
+        failed = true;
+        return st.error();
+      }
+      if (drop_cache) {
+        posix_fadvise(fd.get(), offset + first * block_size,
+                      blocks * block_size, POSIX_FADV_DONTNEED);
+      }
+      const uint64_t done = blocks_done += blocks;
+      if ((done - blocks) * 4 / block_count != done * 4 / block_count) {
+        LOG(DEBUG) << "Hashed " << done * 100 / block_count << "% of "
+                   << image_size << " bytes";
+      }
+    }
+    return {};
+  };
+
+  ApexdExecutor& executor = ApexdExecutor::GetInstance();
+  const uint64_t num_tasks =
+      std::min<uint64_t>(num_chunks, executor.GetNumThreads());
+  std::vector<std::future<Result<void>>> tasks;
+  tasks.reserve(num_tasks);
+  for (uint64_t i = 0; i < num_tasks; i++) {
+    tasks.push_back(executor.Submit("HashDataBlocks", hash_chunks));
+  }
+  Result<void> result;
+  for (auto& task : tasks) {
+    auto task_result = executor.Wait(std::move(task));
+    if (!task_result.ok() && result.ok()) {
+      result = std::move(task_result);
+    }
+  }
+  if (!result.ok()) {
+    return result.error();
+  }
+
+  // Upper levels are 1/128th the size of the level below with SHA-256 and 4K
+  // blocks, so they are hashed on this thread.
+  bssl::ScopedEVP_MD_CTX ctx;
+  while (levels.back().size() > block_size) {
+    const std::vector<uint8_t>& below = levels.back();
+    std::vector<uint8_t> level(padded(below.size() / block_size * hash_size),
+                               0);
+    for (size_t i = 0; i < below.size() / block_size; i++) {
+      if (!HashBlock(ctx.get(), md, salt, below.data() + i * block_size,
+                     block_size, level.data() + i * hash_size)) {
+        return Error() << "Failed to hash level " << levels.size();
+      }
+    }
+    levels.push_back(std::move(level));
+  }
+
+  HashTree hashtree;
+  hashtree.root_digest.resize(hash_size);
+  if (!HashBlock(ctx.get(), md, salt, levels.back().data(), block_size,
+                 hashtree.root_digest.data())) {
+    return Error() << "Failed to hash root block";
+  }
+  // Levels are laid out top-down, like HashTreeBuilder::WriteHashTreeToFd().
+  for (auto it = levels.rbegin(); it != levels.rend(); ++it) {
+    hashtree.tree.insert(hashtree.tree.end(), it->begin(), it->end());
+  }
+  return hashtree;
+}
+
+std::string GetHashTreeStampPath(const std::string& hashtree_file) {
+  return hashtree_file + ".stamp";
+}
+
 Result<PrepareHashTreeResult> PrepareHashTree(
     const ApexFile& apex, const ApexVerityData& verity_data,
     const std::string& hashtree_file) {
@@ -170,6 +580,12 @@ Result<PrepareHashTreeResult> PrepareHashTree(
     return exists.error();
   }
   if (*exists) {
+    // The stamp only saves reading the hashtree back: dm-verity still checks
+    // every block of it against the root digest when it's used.
+    if (MatchesHashTreeStamp(hashtree_file, verity_data)) {
+      LOG(INFO) << "hashtree: reuse " << hashtree_file << " (stamp matches)";
+      return kReuse;
+    }
     auto digest = CalculateRootDigest(hashtree_file, verity_data);
     if (!digest.ok()) {
       return digest.error();
@@ -186,19 +602,356 @@ Result<PrepareHashTreeResult> PrepareHashTree(
   }
 
   if (should_regenerate_hashtree) {
+    const std::string stamp_path = GetHashTreeStampPath(hashtree_file);
+    if (unlink(stamp_path.c_str()) != 0 && errno != ENOENT) {
+      return ErrnoError() << "Failed to unlink " << stamp_path;
+    }
     if (auto st = GenerateHashTree(apex, verity_data, hashtree_file);
         !st.ok()) {
       return st.error();
     }
     LOG(INFO) << "hashtree: generated to " << hashtree_file;
-    return KRegenerate;
+  } else {
+    LOG(INFO) << "hashtree: reuse " << hashtree_file;
   }
-  LOG(INFO) << "hashtree: reuse " << hashtree_file;
-  return kReuse;
+  // Not fatal, the hashtree just gets read back again on the next boot.
+  if (auto st = WriteHashTreeStamp(hashtree_file, verity_data); !st.ok()) {
+    LOG(WARNING) << st.error();
+  }
+  return should_regenerate_hashtree ? KRegenerate : kReuse;
 }
 
-void RemoveObsoleteHashTrees() {
-  // TODO(b/120058143): on boot complete, remove unused hashtree files
+Result<void> VerifyApexPayload(const ApexFile& apex,
+                               const ApexVerityData& verity_data,
+                               const std::string& hashtree_file) {
+  if (apex.IsCompressed()) {
+    return Error() << "Cannot verify payload of compressed APEX";
+  }
+  if (!apex.GetImageOffset()) {
+    return Error() << "Cannot verify payload without image offset";
+  }
+  const auto time_started = std::chrono::steady_clock::now();
+  const off_t image_offset = apex.GetImageOffset().value();
+  const uint64_t image_size = verity_data.desc->image_size;
+  const uint32_t hash_block_size = verity_data.desc->hash_block_size;
+
+  // Staged APEXes are read once and not mounted until the next boot, so keep
+  // them out of the page cache: read with O_DIRECT if the payload is aligned
+  // for it, or drop the pages after reading them otherwise.
+  const ApexFile::HeldFd apex_fd = apex.GetFd();
+  unique_fd direct_fd;
+  if (image_offset % kReadAlignment == 0 &&
+      hash_block_size % kReadAlignment == 0) {
+    direct_fd.reset(TEMP_FAILURE_RETRY(open(
+        apex.GetPath().c_str(), O_RDONLY | O_CLOEXEC | O_DIRECT | O_NOFOLLOW)));
+    struct stat st;
+    struct stat apex_st;
+    if (direct_fd.get() != -1 &&
+        (fstat(direct_fd.get(), &st) != 0 ||
+         fstat(apex_fd.get(), &apex_st) != 0 ||
+         st.st_dev != apex_st.st_dev || st.st_ino != apex_st.st_ino)) {
+      direct_fd.reset();
+    }
+  }
+  const bool direct = direct_fd.get() != -1;
+  auto hashtree = BuildHashTree(
+      direct ? borrowed_fd(direct_fd) : borrowed_fd(apex_fd), image_offset,
+      image_size, hash_block_size, verity_data.hash_algorithm,
+      HexToBin(verity_data.salt), /* drop_cache= */ !direct);
+  if (!hashtree.ok()) {
+    return Error() << "Failed to verify payload of " << apex.GetPath() << ": "
+                   << hashtree.error();
+  }
+  if (hashtree->root_digest != HexToBin(verity_data.root_digest)) {
+    return Error() << "Failed to verify payload of " << apex.GetPath()
+                   << ": root digest mismatch";
+  }
+
+  const uint64_t tree_size = verity_data.desc->tree_size;
+  if (tree_size != 0) {
+    // dm-verity reads the embedded hashtree as is, so it has to be checked as
+    // well. It is laid out exactly like the one that was just built.
+    if (tree_size != hashtree->tree.size()) {
+      return Error() << "Failed to verify payload of " << apex.GetPath()
+                     << ": embedded hashtree has " << tree_size
+                     << " bytes, expected " << hashtree->tree.size();
+    }
+    std::vector<uint8_t> embedded(tree_size);
+    const off_t tree_offset = image_offset + verity_data.desc->tree_offset;
+    if (!ReadFullyAtOffset(apex_fd, embedded.data(), tree_size,
+                           tree_offset)) {
+      return ErrnoError() << "Failed to read hashtree of " << apex.GetPath();
+    }
+    if (embedded != hashtree->tree) {
+      return Error() << "Failed to verify payload of " << apex.GetPath()
+                     << ": embedded hashtree mismatch";
+    }
+  } else {
+    if (auto st = CreateDirIfNeeded(Dirname(hashtree_file), 0700); !st.ok()) {
+      return st.error();
+    }
+    // An identical hashtree may already back a mounted APEX, leave it alone.
+    std::string existing;
+    const bool up_to_date =
+        ReadFileToString(hashtree_file, &existing) &&
+        std::equal(existing.begin(), existing.end(), hashtree->tree.begin(),
+                   hashtree->tree.end());
+    if (!up_to_date) {
+      const std::string stamp_path = GetHashTreeStampPath(hashtree_file);
+      if (unlink(stamp_path.c_str()) != 0 && errno != ENOENT) {
+        return ErrnoError() << "Failed to unlink " << stamp_path;
+      }
+      if (auto st = WriteHashTree(hashtree->tree, hashtree_file); !st.ok()) {
+        return st.error();
+      }
+    }
+    if (!up_to_date || !MatchesHashTreeStamp(hashtree_file, verity_data)) {
+      // Not fatal, PrepareHashTree() just reads the hashtree back.
+      if (auto st = WriteHashTreeStamp(hashtree_file, verity_data); !st.ok()) {
+        LOG(WARNING) << st.error();
+      }
+    }
+  }
+
+  const auto elapsed_us =
+      std::chrono::duration_cast<std::chrono::microseconds>(
+          std::chrono::steady_clock::now() - time_started)
+          .count();
+  LOG(INFO) << "Verified payload of " << apex.GetPath() << " in "
+            << elapsed_us / 1000 << "ms ("
+            << (elapsed_us > 0 ? image_size / elapsed_us : 0) << " MB/s"
+            << (direct ? ", O_DIRECT" : "") << ")";
+  return {};
+}
+
+Result<void> StoreSidecarHashTree(const ApexFile& apex,
+                                  const ApexVerityData& verity_data) {
+  if (verity_data.desc->tree_size != 0) {
+    return Error() << apex.GetPath() << " already embeds its hashtree";
+  }
+  if (!apex.GetImageOffset()) {
+    return Error() << "Cannot store hashtree without image offset";
+  }
+  const auto time_started = std::chrono::steady_clock::now();
+  unique_fd fd(TEMP_FAILURE_RETRY(
+      open(apex.GetPath().c_str(), O_RDWR | O_CLOEXEC | O_NOFOLLOW)));
+  if (fd.get() == -1) {
+    return ErrnoError() << "Failed to open " << apex.GetPath();
+  }
+  const ApexFile::HeldFd apex_fd = apex.GetFd();
+  struct stat st;
+  struct stat apex_st;
+  if (fstat(fd.get(), &st) != 0 || fstat(apex_fd.get(), &apex_st) != 0) {
+    return ErrnoError() << "Failed to stat " << apex.GetPath();
+  }
+  if (st.st_dev != apex_st.st_dev || st.st_ino != apex_st.st_ino) {
+    return Error() << apex.GetPath() << " was replaced";
+  }
+  auto block = ReadApkSigningBlock(fd);
+  if (!block.ok()) {
+    return Error() << "Can't store hashtree in " << apex.GetPath() << ": "
+                   << block.error();
+  }
+
+  const uint32_t hash_block_size = verity_data.desc->hash_block_size;
+  const uint64_t image_offset = apex.GetImageOffset().value();
+  auto hashtree = BuildHashTree(
+      apex_fd, image_offset, verity_data.desc->image_size,
+      hash_block_size, verity_data.hash_algorithm, HexToBin(verity_data.salt));
+  if (!hashtree.ok()) {
+    return hashtree.error();
+  }
+  if (hashtree->root_digest != HexToBin(verity_data.root_digest)) {
+    return Error() << "Failed to build hashtree: root digest mismatch";
+  }
+
+  // Keep the other pairs, dropping a sidecar hashtree stored earlier.
+  std::vector<uint8_t> pairs;
+  auto st_pairs = ForEachPair(
+      block->pairs, [&](uint32_t id, size_t value_pos, uint64_t value_size) {
+        if (id != kSidecarHashTreeId) {
+          pairs.insert(pairs.end(), block->pairs.begin() + value_pos - 12,
+                       block->pairs.begin() + value_pos + value_size);
+        }
+      });
+  if (!st_pairs.ok()) {
+    return st_pairs.error();
+  }
+
+  // The value is: header size, digest size, root digest, padding, hashtree.
+  // The padding puts the hashtree on a hash block boundary relative to the
+  // payload, so that dm-verity can find it through the payload's device.
+  const std::string& digest = verity_data.root_digest;
+  const uint64_t value_offset = block->offset + 8 + pairs.size() + 12;
+  const uint64_t digest_end = value_offset + 8 + digest.size();
+  const uint64_t tree_offset =
+      image_offset + (digest_end - image_offset + hash_block_size - 1) /
+                         hash_block_size * hash_block_size;
+  const uint64_t header_size = tree_offset - value_offset;
+  AppendLE64(pairs, 4 + header_size + hashtree->tree.size());
+  AppendLE32(pairs, kSidecarHashTreeId);
+  AppendLE32(pairs, header_size);
+  AppendLE32(pairs, digest.size());
+  pairs.insert(pairs.end(), digest.begin(), digest.end());
+  pairs.resize(pairs.size() + header_size - 8 - digest.size());
+  pairs.insert(pairs.end(), hashtree->tree.begin(), hashtree->tree.end());
+
+  std::vector<uint8_t> tail;
+  const uint64_t size = pairs.size() + kApkSigBlockFooterSize;
+  AppendLE64(tail, size);
+  tail.insert(tail.end(), pairs.begin(), pairs.end());
+  AppendLE64(tail, size);
+  tail.insert(tail.end(), kApkSigBlockMagic.begin(), kApkSigBlockMagic.end());
+  const uint64_t cd_offset = block->offset + tail.size();
+  if (cd_offset > UINT32_MAX) {
+    return Error() << "Storing the hashtree makes " << apex.GetPath()
+                   << " too large";
+  }
+  tail.resize(tail.size() + block->cd_size);
+  if (!ReadFullyAtOffset(fd, tail.data() + tail.size() - block->cd_size,
+                         block->cd_size, block->cd_offset)) {
+    return ErrnoError() << "Failed to read central directory of "
+                        << apex.GetPath();
+  }
+  PutLE32(block->eocd.data() + 16, cd_offset);
+  tail.insert(tail.end(), block->eocd.begin(), block->eocd.end());
+
+  // Past this point, an interruption leaves the file unreadable, so this is
+  // only for files that get recreated when they fail to open.
+  for (size_t written = 0; written < tail.size();) {
+    ssize_t n = TEMP_FAILURE_RETRY(pwrite(fd.get(), tail.data() + written,
+                                          tail.size() - written,
+                                          block->offset + written));
+    if (n <= 0) {
+      return ErrnoError() << "Failed to write " << apex.GetPath();
+    }
+    written += n;
+  }
+  if (ftruncate(fd.get(), block->offset + tail.size()) != 0 ||
+      fsync(fd.get()) != 0) {
+    return ErrnoError() << "Failed to write " << apex.GetPath();
+  }
+  const auto elapsed_us =
+      std::chrono::duration_cast<std::chrono::microseconds>(
+          std::chrono::steady_clock::now() - time_started)
+          .count();
+  LOG(INFO) << "Stored hashtree in " << apex.GetPath() << " in "
+            << elapsed_us / 1000 << "ms";
+  return {};
+}
+
+Result<std::optional<SidecarHashTree>> FindSidecarHashTree(
+    const ApexFile& apex, const ApexVerityData& verity_data) {
+  if (verity_data.desc->tree_size != 0 || !apex.GetImageOffset()) {
+    return std::nullopt;
+  }
+  auto block = ReadApkSigningBlock(apex.GetFd());
+  if (!block.ok()) {
+    // Most APEXes don't have a sidecar hashtree, and not all are signed with
+    // an APK Signing Block.
+    return std::nullopt;
+  }
+  const uint64_t image_offset = apex.GetImageOffset().value();
+  const uint32_t hash_block_size = verity_data.desc->hash_block_size;
+  std::optional<SidecarHashTree> found;
+  auto st = ForEachPair(
+      block->pairs, [&](uint32_t id, size_t value_pos, uint64_t value_size) {
+        if (id != kSidecarHashTreeId || value_size < 8) {
+          return;
+        }
+        const uint8_t* value = block->pairs.data() + value_pos;
+        const uint32_t header_size = GetLE32(value);
+        const uint32_t digest_size = GetLE32(value + 4);
+        if (header_size < 8 || header_size >= value_size ||
+            digest_size > header_size - 8) {
+          return;
+        }
+        // dm-verity checks the hashtree against the root digest anyway, this
+        // only tells a stale one apart.
+        if (std::string_view(reinterpret_cast<const char*>(value + 8),
+                             digest_size) != verity_data.root_digest) {
+          return;
+        }
+        const uint64_t offset = block->offset + 8 + value_pos + header_size;
+        if (offset < image_offset ||
+            (offset - image_offset) % hash_block_size != 0) {
+          return;
+        }
+        found = SidecarHashTree{.offset = offset,
+                                .size = value_size - header_size};
+      });
+  if (!st.ok()) {
+    return Error() << "Invalid APK Signing Block in " << apex.GetPath()
+                   << ": " << st.error();
+  }
+  return found;
+}
+
+void RemoveObsoleteHashTrees(
+    const std::string& hashtree_dir,
+    const std::unordered_set<std::string>& root_digests_to_keep,
+    uint64_t quota) {
+  namespace fs = std::filesystem;
+  constexpr std::string_view kStampSuffix = ".stamp";
+
+  struct timespec now, since_boot;
+  clock_gettime(CLOCK_REALTIME, &now);
+  clock_gettime(CLOCK_BOOTTIME, &since_boot);
+  // Anything written since then may belong to an APEX that is being mounted or
+  // staged right now.
+  const int64_t boot_time_ns = ToNanos(now) - ToNanos(since_boot);
+
+  struct CachedHashTree {
+    std::string path;
+    int64_t size;
+    int64_t mtime_ns;
+  };
+  std::vector<CachedHashTree> cached;
+  std::vector<std::string> obsolete;
+  auto status = WalkDir(hashtree_dir, [&](const fs::directory_entry& entry) {
+    const std::string path = entry.path();
+    struct stat st;
+    if (lstat(path.c_str(), &st) != 0 || ToNanos(st.st_mtim) >= boot_time_ns) {
+      return;
+    }
+    std::string name = entry.path().filename();
+    if (name.ends_with(kStampSuffix)) {
+      // Stamps are removed together with their hashtree, unless it is gone.
+      name.resize(name.size() - kStampSuffix.size());
+      if (!IsHashTreeName(name) ||
+          access((Dirname(path) + "/" + name).c_str(), F_OK) != 0) {
+        obsolete.push_back(path);
+      }
+    } else if (!IsHashTreeName(name) || !S_ISREG(st.st_mode)) {
+      // E.g. hashtrees named after the package id by older versions of apexd.
+      obsolete.push_back(path);
+    } else if (root_digests_to_keep.count(name) == 0) {
+      cached.push_back({path, st.st_size, ToNanos(st.st_mtim)});
+    }
+  });
+  if (!status.ok()) {
+    LOG(ERROR) << "Failed to scan " << hashtree_dir << ": " << status.error();
+    return;
+  }
+
+  std::sort(cached.begin(), cached.end(), [](const auto& a, const auto& b) {
+    return a.mtime_ns > b.mtime_ns;
+  });
+  uint64_t total_size = 0;
+  for (const CachedHashTree& hashtree : cached) {
+    total_size += hashtree.size;
+    if (total_size > quota) {
+      obsolete.push_back(hashtree.path);
+      obsolete.push_back(GetHashTreeStampPath(hashtree.path));
+    }
+  }
+
+  for (const std::string& path : obsolete) {
+    LOG(INFO) << "Removing obsolete hashtree file " << path;
+    if (unlink(path.c_str()) != 0 && errno != ENOENT) {
+      PLOG(ERROR) << "Failed to unlink " << path;
+    }
+  }
 }
 
 std::string BytesToHex(const uint8_t* bytes, size_t bytes_len) {
@@ -16,7 +16,14 @@
 
 #pragma once
 
+#include <android-base/result.h>
+#include <android-base/unique_fd.h>
+#include <sys/types.h>
+
+#include <optional>
 #include <string>
+#include <unordered_set>
+#include <vector>
 
 #include "apex_file.h"
 
@@ -33,11 +40,83 @@ enum PrepareHashTreeResult {
 // Generates a dm-verity hashtree of a given |apex| if |hashtree_file| doesn't
 // exist or it's root_digest doesn't match |verity_data.root_digest|. Otherwise
 // does nothing.
+//
+// A stamp recording |verity_data| and the identity of |hashtree_file| is kept
+// next to it, see GetHashTreeStampPath(). As long as both still match, the
+// hashtree is reused without being read.
 android::base::Result<PrepareHashTreeResult> PrepareHashTree(
     const ApexFile& apex, const ApexVerityData& verity_data,
     const std::string& hashtree_file);
 
-void RemoveObsoleteHashTrees();
+// Checks every block of the payload of |apex| against |verity_data| from
+// userspace, by rebuilding its hashtree with BuildHashTree(), without going
+// through the page cache. This is as thorough as reading the whole dm-verity
+// device, without needing one.
+//
+// An embedded hashtree has to be identical to the rebuilt one. Otherwise the
+// rebuilt hashtree is stored to |hashtree_file| together with its stamp, so
+// that PrepareHashTree() can reuse it.
+android::base::Result<void> VerifyApexPayload(
+    const ApexFile& apex, const ApexVerityData& verity_data,
+    const std::string& hashtree_file);
+
+// Stores the hashtree of |apex|, which must not embed one, in an extra pair of
+// the APK Signing Block of its file. The pair isn't covered by the v2/v3
+// signatures, so they stay valid. The hashtree starts on a hash block boundary
+// relative to the payload, so that dm-verity can read it from the same device
+// as the payload instead of from a separate hashtree file.
+//
+// The file is rewritten in place from its APK Signing Block onwards, and is
+// unreadable if this is interrupted. Only for files that get recreated when
+// they fail to open, such as decompressed APEXes.
+android::base::Result<void> StoreSidecarHashTree(
+    const ApexFile& apex, const ApexVerityData& verity_data);
+
+// Location of a hashtree stored by StoreSidecarHashTree().
+struct SidecarHashTree {
+  // Offset in the file of the APEX.
+  uint64_t offset;
+  uint64_t size;
+};
+
+// Returns the hashtree that StoreSidecarHashTree() stored in |apex| for
+// |verity_data|, if any.
+android::base::Result<std::optional<SidecarHashTree>> FindSidecarHashTree(
+    const ApexFile& apex, const ApexVerityData& verity_data);
+
+// Returns the path of the stamp of |hashtree_file|. The stamp has to be moved
+// or removed together with |hashtree_file|.
+std::string GetHashTreeStampPath(const std::string& hashtree_file);
+
+// Removes the hashtrees in |hashtree_dir| whose root digest is not in
+// |root_digests_to_keep|, together with their stamps, as well as files that are
+// not hashtrees or stamps. The most recently generated hashtrees are kept as
+// long as they take less than |quota| bytes in total, so that going back to a
+// previous version of an APEX doesn't require regenerating its hashtree.
+// Files written since boot are never removed.
+void RemoveObsoleteHashTrees(
+    const std::string& hashtree_dir,
+    const std::unordered_set<std::string>& root_digests_to_keep,
+    uint64_t quota);
+
+struct HashTree {
+  // Hash levels from the top down, each padded to a multiple of the block size.
+  std::vector<uint8_t> tree;
+  std::vector<uint8_t> root_digest;
+};
+
+// Builds the dm-verity hashtree of the |image_size| bytes of |fd| starting at
+// |offset|. Data blocks are read and hashed in chunks, concurrently on the
+// ApexdExecutor, and the first chunk that fails stops the others. The result
+// is byte-identical to the one of HashTreeBuilder.
+//
+// Read buffers are 4096 aligned, so |fd| may be opened with O_DIRECT if
+// |offset| and |block_size| are aligned too. Otherwise |drop_cache| drops the
+// pages that were read from the page cache.
+android::base::Result<HashTree> BuildHashTree(
+    android::base::borrowed_fd fd, off_t offset, uint64_t image_size,
+    uint32_t block_size, const std::string& hash_algorithm,
+    const std::vector<uint8_t>& salt, bool drop_cache = false);
 
 }  // namespace apex
 }  // namespace android
@@ -14,18 +14,27 @@
  * limitations under the License.
  */
 
+#include <algorithm>
+#include <filesystem>
 #include <string>
+#include <vector>
 
 #include <errno.h>
+#include <fcntl.h>
 #include <sys/stat.h>
+#include <unistd.h>
 
 #include <android-base/file.h>
 #include <android-base/logging.h>
 #include <android-base/stringprintf.h>
+#include <gmock/gmock.h>
 #include <gtest/gtest.h>
+#include <openssl/evp.h>
+#include <verity/hash_tree_builder.h>
 
 #include "apex_file.h"
 #include "apexd_test_utils.h"
+#include "apexd_utils.h"
 #include "apexd_verity.h"
 
 namespace android {
@@ -37,6 +46,8 @@ using android::apex::testing::IsOk;
 using android::base::GetExecutableDirectory;
 using android::base::ReadFileToString;
 using android::base::StringPrintf;
+using android::base::WriteFully;
+using android::base::WriteStringToFile;
 
 static std::string GetTestDataDir() { return GetExecutableDirectory(); }
 static std::string GetTestFile(const std::string& name) {
@@ -112,6 +123,96 @@ TEST(ApexdVerityTest, RegenerateHashree) {
   ASSERT_NE(first_hashtree, second_hashtree) << hashtree_file << " was reused";
 }
 
+// Overwrites the first byte of |path|, keeping its size and mtime.
+static void CorruptKeepingMtime(const std::string& path) {
+  struct stat st;
+  ASSERT_EQ(0, stat(path.c_str(), &st));
+  std::string content;
+  ASSERT_TRUE(ReadFileToString(path, &content));
+  content[0] ^= 0xff;
+  ASSERT_TRUE(WriteStringToFile(content, path));
+  struct timespec times[2] = {st.st_atim, st.st_mtim};
+  ASSERT_EQ(0, utimensat(AT_FDCWD, path.c_str(), times, 0));
+}
+
+TEST(ApexdVerityTest, ReusesHashtreeWithMatchingStamp) {
+  TemporaryDir td;
+
+  auto apex = ApexFile::Open(GetTestFile("apex.apexd_test_no_hashtree.apex"));
+  ASSERT_TRUE(IsOk(apex));
+  auto verity_data = apex->VerifyApexVerity(apex->GetBundledPublicKey());
+  ASSERT_TRUE(IsOk(verity_data));
+
+  auto hashtree_file = StringPrintf("%s/hashtree", td.path);
+  auto status = PrepareHashTree(*apex, *verity_data, hashtree_file);
+  ASSERT_TRUE(IsOk(status));
+  ASSERT_EQ(KRegenerate, *status);
+  ASSERT_EQ(0, access(GetHashTreeStampPath(hashtree_file).c_str(), F_OK));
+
+  // The stamp still matches, so the hashtree isn't read back. Otherwise the
+  // corrupted root block would cause a regeneration.
+  CorruptKeepingMtime(hashtree_file);
+  status = PrepareHashTree(*apex, *verity_data, hashtree_file);
+  ASSERT_TRUE(IsOk(status));
+  ASSERT_EQ(kReuse, *status);
+}
+
+TEST(ApexdVerityTest, IgnoresStampOfModifiedHashtree) {
+  TemporaryDir td;
+
+  auto apex = ApexFile::Open(GetTestFile("apex.apexd_test_no_hashtree.apex"));
+  ASSERT_TRUE(IsOk(apex));
+  auto verity_data = apex->VerifyApexVerity(apex->GetBundledPublicKey());
+  ASSERT_TRUE(IsOk(verity_data));
+
+  auto hashtree_file = StringPrintf("%s/hashtree", td.path);
+  auto status = PrepareHashTree(*apex, *verity_data, hashtree_file);
+  ASSERT_TRUE(IsOk(status));
+  ASSERT_EQ(KRegenerate, *status);
+  std::string expected_hashtree;
+  ASSERT_TRUE(ReadFileToString(hashtree_file, &expected_hashtree));
+
+  std::string content;
+  ASSERT_TRUE(ReadFileToString(hashtree_file, &content));
+  content[0] ^= 0xff;
+  ASSERT_TRUE(WriteStringToFile(content, hashtree_file));
+  // Don't depend on the granularity of timestamps of the filesystem.
+  struct timespec times[2] = {{.tv_sec = 1}, {.tv_sec = 1}};
+  ASSERT_EQ(0, utimensat(AT_FDCWD, hashtree_file.c_str(), times, 0));
+
+  status = PrepareHashTree(*apex, *verity_data, hashtree_file);
+  ASSERT_TRUE(IsOk(status));
+  ASSERT_EQ(KRegenerate, *status);
+  std::string hashtree;
+  ASSERT_TRUE(ReadFileToString(hashtree_file, &hashtree));
+  ASSERT_EQ(expected_hashtree, hashtree);
+}
+
+TEST(ApexdVerityTest, IgnoresCorruptedStamp) {
+  TemporaryDir td;
+
+  auto apex = ApexFile::Open(GetTestFile("apex.apexd_test_no_hashtree.apex"));
+  ASSERT_TRUE(IsOk(apex));
+  auto verity_data = apex->VerifyApexVerity(apex->GetBundledPublicKey());
+  ASSERT_TRUE(IsOk(verity_data));
+
+  auto hashtree_file = StringPrintf("%s/hashtree", td.path);
+  auto status = PrepareHashTree(*apex, *verity_data, hashtree_file);
+  ASSERT_TRUE(IsOk(status));
+  ASSERT_EQ(KRegenerate, *status);
+
+  std::string stamp;
+  ASSERT_TRUE(ReadFileToString(GetHashTreeStampPath(hashtree_file), &stamp));
+  stamp[stamp.size() / 2] ^= 0xff;
+  ASSERT_TRUE(WriteStringToFile(stamp, GetHashTreeStampPath(hashtree_file)));
+
+  // Without a valid stamp, the corrupted hashtree is detected.
+  CorruptKeepingMtime(hashtree_file);
+  status = PrepareHashTree(*apex, *verity_data, hashtree_file);
+  ASSERT_TRUE(IsOk(status));
+  ASSERT_EQ(KRegenerate, *status);
+}
+
 TEST(ApexdVerityTest, CannotPrepareHashTreeForCompressedApex) {
   TemporaryDir td;
 
@@ -127,5 +228,444 @@ TEST(ApexdVerityTest, CannotPrepareHashTreeForCompressedApex) {
       ::testing::HasSubstr("Cannot prepare HashTree of compressed APEX"));
 }
 
+TEST(ApexdVerityTest, BuildHashTreeMatchesHashTreeBuilder) {
+  constexpr uint32_t kBlockSize = 4096;
+  // Data is written after some garbage, to exercise |offset|.
+  constexpr off_t kOffset = 3 * kBlockSize;
+  const std::vector<uint8_t> salt = {0xde, 0xad, 0xbe, 0xef};
+
+  // Covers single-level trees, and the boundaries where a new level appears.
+  for (const std::string algorithm : {"sha256", "sha1"}) {
+    for (uint64_t block_count : {1, 2, 127, 128, 129, 1000, 128 * 128 + 1}) {
+      SCOPED_TRACE(algorithm + ", " + std::to_string(block_count) +
+                   " blocks");
+      std::vector<uint8_t> image(kOffset + block_count * kBlockSize);
+      for (size_t i = 0; i < image.size(); i++) {
+        image[i] = static_cast<uint8_t>(i * 7 + i / kBlockSize);
+      }
+      TemporaryFile image_file;
+      ASSERT_TRUE(WriteFully(image_file.fd, image.data(), image.size()));
+
+      auto hashtree =
+          BuildHashTree(image_file.fd, kOffset, block_count * kBlockSize,
+                        kBlockSize, algorithm, salt);
+      ASSERT_TRUE(IsOk(hashtree));
+
+      HashTreeBuilder builder(kBlockSize,
+                              HashTreeBuilder::HashFunction(algorithm));
+      ASSERT_TRUE(builder.Initialize(block_count * kBlockSize, salt));
+      ASSERT_TRUE(builder.Update(image.data() + kOffset,
+                                 block_count * kBlockSize));
+      ASSERT_TRUE(builder.BuildHashTree());
+      TemporaryFile tree_file;
+      ASSERT_TRUE(builder.WriteHashTreeToFd(tree_file.fd, 0));
+      std::string expected_tree;
+      ASSERT_TRUE(ReadFileToString(tree_file.path, &expected_tree));
+
+      ASSERT_EQ(expected_tree,
+                std::string(hashtree->tree.begin(), hashtree->tree.end()));
+      auto expected_digest = builder.root_hash();
+      expected_digest.resize(hashtree->root_digest.size());
+      ASSERT_EQ(expected_digest, hashtree->root_digest);
+    }
+  }
+}
+
+TEST(ApexdVerityTest, BuildHashTreeFailsOnShortImage) {
+  TemporaryFile image_file;
+  std::vector<uint8_t> image(4096);
+  ASSERT_TRUE(WriteFully(image_file.fd, image.data(), image.size()));
+  auto hashtree = BuildHashTree(image_file.fd, 0, 2 * 4096, 4096, "sha256",
+                                /* salt= */ {});
+  ASSERT_FALSE(IsOk(hashtree));
+}
+
+// Copies |name| to |dir| and flips the byte at |offset| within its payload.
+static std::string CopyAndCorruptPayload(const std::string& name,
+                                         const std::string& dir,
+                                         uint64_t offset) {
+  auto apex = ApexFile::Open(GetTestFile(name));
+  EXPECT_TRUE(IsOk(apex));
+  std::string content;
+  EXPECT_TRUE(ReadFileToString(GetTestFile(name), &content));
+  content[apex->GetImageOffset().value() + offset] ^= 0xff;
+  std::string path = dir + "/" + name;
+  EXPECT_TRUE(WriteStringToFile(content, path));
+  return path;
+}
+
+TEST(ApexdVerityTest, VerifyApexPayloadStoresHashtree) {
+  TemporaryDir td;
+
+  auto apex = ApexFile::Open(GetTestFile("apex.apexd_test_no_hashtree.apex"));
+  ASSERT_TRUE(IsOk(apex));
+  auto verity_data = apex->VerifyApexVerity(apex->GetBundledPublicKey());
+  ASSERT_TRUE(IsOk(verity_data));
+
+  auto hashtree_file = StringPrintf("%s/digest", td.path);
+  ASSERT_TRUE(IsOk(VerifyApexPayload(*apex, *verity_data, hashtree_file)));
+  ASSERT_EQ(0, access(GetHashTreeStampPath(hashtree_file).c_str(), F_OK));
+
+  // Same content as a generated hashtree, and reused as is.
+  auto generated_file = StringPrintf("%s/generated", td.path);
+  ASSERT_TRUE(IsOk(PrepareHashTree(*apex, *verity_data, generated_file)));
+  std::string stored, generated;
+  ASSERT_TRUE(ReadFileToString(hashtree_file, &stored));
+  ASSERT_TRUE(ReadFileToString(generated_file, &generated));
+  ASSERT_EQ(generated, stored);
+  auto status = PrepareHashTree(*apex, *verity_data, hashtree_file);
+  ASSERT_TRUE(IsOk(status));
+  ASSERT_EQ(kReuse, *status);
+}
+
+TEST(ApexdVerityTest, VerifyApexPayloadChecksEmbeddedHashtree) {
+  TemporaryDir td;
+
+  auto apex = ApexFile::Open(GetTestFile("apex.apexd_test.apex"));
+  ASSERT_TRUE(IsOk(apex));
+  auto verity_data = apex->VerifyApexVerity(apex->GetBundledPublicKey());
+  ASSERT_TRUE(IsOk(verity_data));
+  ASSERT_NE(0u, verity_data->desc->tree_size);
+
+  auto hashtree_file = StringPrintf("%s/hashtree", td.path);
+  ASSERT_TRUE(IsOk(VerifyApexPayload(*apex, *verity_data, hashtree_file)));
+  ASSERT_NE(0, access(hashtree_file.c_str(), F_OK));
+
+  auto corrupted_path = CopyAndCorruptPayload(
+      "apex.apexd_test.apex", td.path, verity_data->desc->tree_offset);
+  auto corrupted = ApexFile::Open(corrupted_path);
+  ASSERT_TRUE(IsOk(corrupted));
+  auto result = VerifyApexPayload(*corrupted, *verity_data, hashtree_file);
+  ASSERT_FALSE(IsOk(result));
+  ASSERT_THAT(result.error().message(),
+              ::testing::HasSubstr("embedded hashtree mismatch"));
+}
+
+TEST(ApexdVerityTest, VerifyApexPayloadRejectsCorruptedPayload) {
+  TemporaryDir td;
+
+  auto apex = ApexFile::Open(GetTestFile("apex.apexd_test_no_hashtree.apex"));
+  ASSERT_TRUE(IsOk(apex));
+  auto verity_data = apex->VerifyApexVerity(apex->GetBundledPublicKey());
+  ASSERT_TRUE(IsOk(verity_data));
+
+  auto corrupted_path =
+      CopyAndCorruptPayload("apex.apexd_test_no_hashtree.apex", td.path,
+                            verity_data->desc->image_size / 2);
+  auto corrupted = ApexFile::Open(corrupted_path);
+  ASSERT_TRUE(IsOk(corrupted));
+  auto hashtree_file = StringPrintf("%s/hashtree", td.path);
+  auto result = VerifyApexPayload(*corrupted, *verity_data, hashtree_file);
+  ASSERT_FALSE(IsOk(result));
+  ASSERT_THAT(result.error().message(),
+              ::testing::HasSubstr("root digest mismatch"));
+  ASSERT_NE(0, access(hashtree_file.c_str(), F_OK));
+}
+
+TEST(ApexdVerityTest, StoresSidecarHashTree) {
+  TemporaryDir td;
+  auto apex_path = StringPrintf("%s/apex.apex", td.path);
+  std::filesystem::copy(GetTestFile("apex.apexd_test_no_hashtree.apex"),
+                        apex_path);
+
+  auto apex = ApexFile::Open(apex_path);
+  ASSERT_TRUE(IsOk(apex));
+  auto verity_data = apex->VerifyApexVerity(apex->GetBundledPublicKey());
+  ASSERT_TRUE(IsOk(verity_data));
+  auto none = FindSidecarHashTree(*apex, *verity_data);
+  ASSERT_TRUE(IsOk(none));
+  ASSERT_FALSE(none->has_value());
+
+  auto hashtree_file = StringPrintf("%s/hashtree", td.path);
+  ASSERT_TRUE(IsOk(PrepareHashTree(*apex, *verity_data, hashtree_file)));
+  std::string expected_tree;
+  ASSERT_TRUE(ReadFileToString(hashtree_file, &expected_tree));
+
+  ASSERT_TRUE(IsOk(StoreSidecarHashTree(*apex, *verity_data)));
+  // Storing it again replaces the previous one.
+  ASSERT_TRUE(IsOk(StoreSidecarHashTree(*apex, *verity_data)));
+
+  // The APEX is still a valid zip, with the same payload.
+  auto stored_apex = ApexFile::Open(apex_path);
+  ASSERT_TRUE(IsOk(stored_apex));
+  ASSERT_EQ(apex->GetImageOffset(), stored_apex->GetImageOffset());
+  auto stored_verity_data =
+      stored_apex->VerifyApexVerity(stored_apex->GetBundledPublicKey());
+  ASSERT_TRUE(IsOk(stored_verity_data));
+
+  auto sidecar = FindSidecarHashTree(*stored_apex, *stored_verity_data);
+  ASSERT_TRUE(IsOk(sidecar));
+  ASSERT_TRUE(sidecar->has_value());
+  ASSERT_EQ(expected_tree.size(), (*sidecar)->size);
+  ASSERT_EQ(0u, ((*sidecar)->offset - *stored_apex->GetImageOffset()) %
+                    stored_verity_data->desc->hash_block_size);
+
+  std::string content;
+  ASSERT_TRUE(ReadFileToString(apex_path, &content));
+  ASSERT_EQ(expected_tree,
+            content.substr((*sidecar)->offset, (*sidecar)->size));
+}
+
+static uint16_t GetLE16(const std::string& s, size_t pos) {
+  return static_cast<uint8_t>(s[pos]) |
+         (static_cast<uint8_t>(s[pos + 1]) << 8);
+}
+
+static uint32_t GetLE32(const std::string& s, size_t pos) {
+  return GetLE16(s, pos) | (static_cast<uint32_t>(GetLE16(s, pos + 2)) << 16);
+}
+
+static uint64_t GetLE64(const std::string& s, size_t pos) {
+  return GetLE32(s, pos) | (static_cast<uint64_t>(GetLE32(s, pos + 4)) << 32);
+}
+
+// The parts of a signed zip that APK Signature Scheme v2/v3 care about.
+struct SignedZip {
+  uint64_t sig_block_offset;
+  uint64_t cd_offset;
+  uint64_t cd_size;
+  // End of central directory record, with its comment.
+  std::string eocd;
+  // Id and value of each APK Signing Block pair, in order.
+  std::vector<std::pair<uint32_t, std::string>> pairs;
+};
+
+static void ParseSignedZip(const std::string& content, SignedZip* zip) {
+  constexpr size_t kEocdSize = 22;
+  ASSERT_GE(content.size(), kEocdSize);
+  size_t eocd_pos = content.size() - kEocdSize + 1;
+  while (eocd_pos-- > 0) {
+    if (GetLE32(content, eocd_pos) == 0x06054b50 &&
+        eocd_pos + kEocdSize + GetLE16(content, eocd_pos + 20) ==
+            content.size()) {
+      break;
+    }
+  }
+  ASSERT_NE(eocd_pos, SIZE_MAX) << "No end of central directory";
+  zip->eocd = content.substr(eocd_pos);
+  zip->cd_offset = GetLE32(content, eocd_pos + 16);
+  zip->cd_size = GetLE32(content, eocd_pos + 12);
+  ASSERT_EQ(zip->cd_offset + zip->cd_size, eocd_pos);
+  ASSERT_GE(zip->cd_offset, 32u);
+  ASSERT_EQ("APK Sig Block 42", content.substr(zip->cd_offset - 16, 16));
+  const uint64_t size = GetLE64(content, zip->cd_offset - 24);
+  zip->sig_block_offset = zip->cd_offset - size - 8;
+  ASSERT_EQ(size, GetLE64(content, zip->sig_block_offset));
+  zip->pairs.clear();
+  for (uint64_t pos = zip->sig_block_offset + 8; pos < zip->cd_offset - 24;) {
+    const uint64_t len = GetLE64(content, pos);
+    zip->pairs.emplace_back(GetLE32(content, pos + 8),
+                            content.substr(pos + 12, len - 4));
+    pos += 8 + len;
+  }
+}
+
+// Returns the digest of |magic|, |size| and |data|, the way v2/v3 signatures
+// hash both the chunks and the list of chunk digests.
+static std::string DigestWithSize(const EVP_MD* md, uint8_t magic,
+                                  uint32_t size, const char* data,
+                                  size_t data_size) {
+  uint8_t prefix[5] = {magic};
+  for (int i = 0; i < 4; i++) {
+    prefix[1 + i] = size >> (8 * i);
+  }
+  uint8_t digest[EVP_MAX_MD_SIZE];
+  unsigned int digest_size = 0;
+  bssl::ScopedEVP_MD_CTX ctx;
+  EXPECT_EQ(1, EVP_DigestInit_ex(ctx.get(), md, nullptr));
+  EXPECT_EQ(1, EVP_DigestUpdate(ctx.get(), prefix, sizeof(prefix)));
+  EXPECT_EQ(1, EVP_DigestUpdate(ctx.get(), data, data_size));
+  EXPECT_EQ(1, EVP_DigestFinal_ex(ctx.get(), digest, &digest_size));
+  return std::string(reinterpret_cast<char*>(digest), digest_size);
+}
+
+// Computes the digest that v2/v3 signatures cover: 1 MiB chunks of the
+// contents before the APK Signing Block, the central directory, and the end
+// of central directory record pointing at the APK Signing Block.
+static std::string ComputeContentDigest(const std::string& content,
+                                        const SignedZip& zip,
+                                        const EVP_MD* md) {
+  std::string eocd = zip.eocd;
+  for (int i = 0; i < 4; i++) {
+    eocd[16 + i] = static_cast<char>(zip.sig_block_offset >> (8 * i));
+  }
+  const std::string sections[] = {
+      content.substr(0, zip.sig_block_offset),
+      content.substr(zip.cd_offset, zip.cd_size),
+      eocd,
+  };
+  constexpr size_t kChunkSize = 1024 * 1024;
+  std::string chunk_digests;
+  uint32_t chunk_count = 0;
+  for (const auto& section : sections) {
+    for (size_t pos = 0; pos < section.size(); pos += kChunkSize) {
+      const size_t len = std::min(kChunkSize, section.size() - pos);
+      chunk_digests += DigestWithSize(md, 0xa5, len, section.data() + pos, len);
+      chunk_count++;
+    }
+  }
+  return DigestWithSize(md, 0x5a, chunk_count, chunk_digests.data(),
+                        chunk_digests.size());
+}
+
+// Checks the content digests of every signer in a v2 or v3 signature
+// |scheme_block| against |content|. The signatures themselves sign these
+// digests, so they stay valid as long as |scheme_block| doesn't change.
+static void CheckContentDigests(const std::string& content,
+                                const SignedZip& zip,
+                                const std::string& scheme_block,
+                                int* checked) {
+  // Everything is a sequence of length-prefixed values.
+  const uint32_t signers_end = 4 + GetLE32(scheme_block, 0);
+  ASSERT_LE(signers_end, scheme_block.size());
+  for (uint32_t pos = 4; pos < signers_end;) {
+    const uint32_t signer = pos + 4;
+    pos = signer + GetLE32(scheme_block, pos);
+    const uint32_t signed_data = signer + 4;
+    const uint32_t digests = signed_data + 4;
+    const uint32_t digests_end = digests + GetLE32(scheme_block, signed_data);
+    for (uint32_t d = digests; d < digests_end;) {
+      const uint32_t entry = d + 4;
+      d = entry + GetLE32(scheme_block, d);
+      const uint32_t algorithm = GetLE32(scheme_block, entry);
+      const std::string digest = scheme_block.substr(
+          entry + 8, GetLE32(scheme_block, entry + 4));
+      const EVP_MD* md = nullptr;
+      switch (algorithm) {
+        case 0x0101:  // RSASSA-PSS with SHA2-256
+        case 0x0103:  // RSASSA-PKCS1-v1_5 with SHA2-256
+        case 0x0201:  // ECDSA with SHA2-256
+        case 0x0301:  // DSA with SHA2-256
+          md = EVP_sha256();
+          break;
+        case 0x0102:  // RSASSA-PSS with SHA2-512
+        case 0x0104:  // RSASSA-PKCS1-v1_5 with SHA2-512
+        case 0x0202:  // ECDSA with SHA2-512
+          md = EVP_sha512();
+          break;
+        default:
+          // Verity-based digests don't cover the zip the same way.
+          continue;
+      }
+      ASSERT_EQ(digest, ComputeContentDigest(content, zip, md))
+          << "Content digest mismatch for algorithm " << algorithm;
+      (*checked)++;
+    }
+  }
+}
+
+TEST(ApexdVerityTest, StoringSidecarHashTreeKeepsApkSignatures) {
+  constexpr uint32_t kV2SchemeId = 0x7109871a;
+  constexpr uint32_t kV3SchemeId = 0xf05368c0;
+  constexpr uint32_t kSidecarHashTreeId = 0x68547041;
+
+  TemporaryDir td;
+  auto apex_path = StringPrintf("%s/apex.apex", td.path);
+  std::filesystem::copy(GetTestFile("apex.apexd_test_no_hashtree.apex"),
+                        apex_path);
+  std::string original;
+  ASSERT_TRUE(ReadFileToString(apex_path, &original));
+  SignedZip original_zip;
+  ASSERT_NO_FATAL_FAILURE(ParseSignedZip(original, &original_zip));
+
+  auto apex = ApexFile::Open(apex_path);
+  ASSERT_TRUE(IsOk(apex));
+  auto verity_data = apex->VerifyApexVerity(apex->GetBundledPublicKey());
+  ASSERT_TRUE(IsOk(verity_data));
+  ASSERT_TRUE(IsOk(StoreSidecarHashTree(*apex, *verity_data)));
+
+  std::string stored;
+  ASSERT_TRUE(ReadFileToString(apex_path, &stored));
+  SignedZip stored_zip;
+  ASSERT_NO_FATAL_FAILURE(ParseSignedZip(stored, &stored_zip));
+
+  // Only the APK Signing Block grew, in place.
+  ASSERT_EQ(original_zip.sig_block_offset, stored_zip.sig_block_offset);
+  ASSERT_EQ(original.substr(0, original_zip.sig_block_offset),
+            stored.substr(0, stored_zip.sig_block_offset));
+  // The central directory and its end record are unchanged, but for the
+  // offset of the central directory, which now follows the larger block.
+  ASSERT_EQ(original.substr(original_zip.cd_offset, original_zip.cd_size),
+            stored.substr(stored_zip.cd_offset, stored_zip.cd_size));
+  ASSERT_EQ(original_zip.eocd.substr(0, 16), stored_zip.eocd.substr(0, 16));
+  ASSERT_EQ(original_zip.eocd.substr(20), stored_zip.eocd.substr(20));
+
+  // The pairs from the signer are kept as they were, and only one sidecar
+  // hashtree was added.
+  std::vector<std::pair<uint32_t, std::string>> kept;
+  int sidecars = 0;
+  for (const auto& pair : stored_zip.pairs) {
+    if (pair.first == kSidecarHashTreeId) {
+      sidecars++;
+    } else {
+      kept.push_back(pair);
+    }
+  }
+  ASSERT_EQ(1, sidecars);
+  ASSERT_EQ(original_zip.pairs, kept);
+
+  // So the content digests that the v2/v3 signatures sign still match.
+  int checked = 0;
+  for (const auto& [id, value] : stored_zip.pairs) {
+    if (id == kV2SchemeId || id == kV3SchemeId) {
+      ASSERT_NO_FATAL_FAILURE(
+          CheckContentDigests(original, original_zip, value, &checked));
+      ASSERT_NO_FATAL_FAILURE(
+          CheckContentDigests(stored, stored_zip, value, &checked));
+    }
+  }
+  ASSERT_GT(checked, 0) << "No v2/v3 content digest to check";
+
+  // The payload didn't move and is still 4K aligned, and so is the sidecar
+  // hashtree relative to it.
+  auto stored_apex = ApexFile::Open(apex_path);
+  ASSERT_TRUE(IsOk(stored_apex));
+  ASSERT_EQ(apex->GetImageOffset(), stored_apex->GetImageOffset());
+  ASSERT_EQ(0u, *stored_apex->GetImageOffset() % 4096);
+  auto sidecar = FindSidecarHashTree(*stored_apex, *verity_data);
+  ASSERT_TRUE(IsOk(sidecar));
+  ASSERT_TRUE(sidecar->has_value());
+  ASSERT_EQ(0u, ((*sidecar)->offset - *stored_apex->GetImageOffset()) % 4096);
+}
+
+TEST(ApexdVerityTest, RemoveObsoleteHashTrees) {
+  TemporaryDir td;
+  // |mtime| of 0 means now, i.e. written during this boot.
+  auto create_file = [&](const std::string& name, size_t size, time_t mtime) {
+    std::string path = StringPrintf("%s/%s", td.path, name.c_str());
+    ASSERT_TRUE(WriteStringToFile(std::string(size, 'x'), path));
+    if (mtime != 0) {
+      struct timespec times[2] = {{.tv_sec = mtime}, {.tv_sec = mtime}};
+      ASSERT_EQ(0, utimensat(AT_FDCWD, path.c_str(), times, 0));
+    }
+  };
+  // In use, kept even though it exceeds the quota on its own.
+  create_file("aa", 1000, 1000);
+  create_file("aa.stamp", 10, 1000);
+  // Not in use. Only the two most recent ones fit in the quota.
+  create_file("01", 100, 2000);
+  create_file("01.stamp", 10, 2000);
+  create_file("02", 100, 3000);
+  create_file("03", 100, 4000);
+  create_file("03.stamp", 10, 4000);
+  create_file("04", 1000, 0);
+  // Stamp without a hashtree.
+  create_file("05.stamp", 10, 1000);
+  // Named after the package id, like older versions of apexd did.
+  create_file("com.android.apex.test_package@1", 100, 1000);
+  create_file("com.android.apex.test_package@1.new", 100, 1000);
+
+  RemoveObsoleteHashTrees(td.path, {"aa"}, /* quota= */ 250);
+
+  auto files = ReadDir(td.path, [](auto /*entry*/) { return true; });
+  ASSERT_TRUE(IsOk(files));
+  std::vector<std::string> names;
+  for (const auto& path : *files) {
+    names.push_back(std::filesystem::path(path).filename());
+  }
+  ASSERT_THAT(names, ::testing::UnorderedElementsAre("aa", "aa.stamp", "02",
+                                                     "03", "03.stamp", "04"));
+}
+
 }  // namespace apex
 }  // namespace android
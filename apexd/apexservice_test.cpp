@@ -1862,10 +1862,10 @@ TEST_F(ApexServiceTest,
   ApexSessionParams params;
   params.sessionId = 83;
   ASSERT_FALSE(IsOk(service_->submitStagedSession(params, &list)));
-  std::string hashtree_file = std::string(kApexHashTreeDir) + "/" +
-                              installer.package + "@" +
-                              std::to_string(installer.version) + ".new";
-  ASSERT_FALSE(RegularFileExists(hashtree_file));
+  // The hashtree generated for the session is removed, and so is its stamp.
+  auto hashtree_files = ReadEntireDir(kApexHashTreeDir);
+  ASSERT_TRUE(IsOk(hashtree_files));
+  ASSERT_THAT(*hashtree_files, SizeIs(0));
 }
 
 class LogTestToLogcat : public ::testing::EmptyTestEventListener {
@@ -206,7 +206,7 @@ class ApexCompressionTest(unittest.TestCase):
     with open(manifest_path, 'wb') as f:
       f.write(pb.SerializeToString())
 
-  def _compress_apex(self, uncompressed_apex_fp):
+  def _compress_apex(self, uncompressed_apex_fp, extra_args=None):
     """Returns file path to compressed APEX"""
     fd, compressed_apex_fp = tempfile.mkstemp(
         prefix=self._testMethodName + '_compressed_',
@@ -217,7 +217,7 @@ class ApexCompressionTest(unittest.TestCase):
         'compress',
         '--input', uncompressed_apex_fp,
         '--output', compressed_apex_fp
-    ])
+    ] + (extra_args or []))
     return compressed_apex_fp
 
   def _decompress_apex(self, compressed_apex_fp):
@@ -319,5 +319,46 @@ class ApexCompressionTest(unittest.TestCase):
         if i in content_in_uncompressed_apex:
           self.assertEqual(zip_obj.getinfo(i).compress_type, ZIP_STORED)
 
+  def test_store_original_apex(self):
+    uncompressed_apex_fp = os.path.join(get_current_dir(), TEST_APEX + '.apex')
+    compressed_apex_fp = self._compress_apex(uncompressed_apex_fp,
+                                             ['--store_original_apex'])
+
+    # Verify type of the apex is still 'COMPRESSED'
+    self.assertEqual(self._get_type(compressed_apex_fp), 'COMPRESSED')
+
+    with ZipFile(compressed_apex_fp, 'r') as zip_obj:
+      info = zip_obj.getinfo('original_apex')
+      self.assertEqual(info.compress_type, ZIP_STORED)
+      # Data starts after the local file header, whose extra field can differ
+      # from the one in the central directory.
+      with open(compressed_apex_fp, 'rb') as f:
+        f.seek(info.header_offset + 26)
+        name_len = int.from_bytes(f.read(2), 'little')
+        extra_len = int.from_bytes(f.read(2), 'little')
+      data_offset = info.header_offset + 30 + name_len + extra_len
+      self.assertEqual(data_offset % 4096, 0)
+
+    # It still decompresses to the original APEX
+    decompressed_apex_fp = self._decompress_apex(compressed_apex_fp)
+    self.assertEqual(get_sha1sum(uncompressed_apex_fp),
+                     get_sha1sum(decompressed_apex_fp),
+                     'Decompressed APEX is not same as uncompressed APEX')
+
+  def test_zstd_compression(self):
+    uncompressed_apex_fp = os.path.join(get_current_dir(), TEST_APEX + '.apex')
+    compressed_apex_fp = self._compress_apex(uncompressed_apex_fp, ['--zstd'])
+
+    self.assertEqual(self._get_type(compressed_apex_fp), 'COMPRESSED')
+    with ZipFile(compressed_apex_fp, 'r') as zip_obj:
+      self.assertNotIn('original_apex', zip_obj.namelist())
+      self.assertEqual(zip_obj.getinfo('original_apex.zst').compress_type,
+                       ZIP_STORED)
+
+    decompressed_apex_fp = self._decompress_apex(compressed_apex_fp)
+    self.assertEqual(get_sha1sum(uncompressed_apex_fp),
+                     get_sha1sum(decompressed_apex_fp),
+                     'Decompressed APEX is not same as uncompressed APEX')
+
 if __name__ == '__main__':
   unittest.main(verbosity=2)
@@ -18,14 +18,17 @@
 
 Example:
   apex_compression_tool compress --input /apex/to/compress --output output/path
+  apex_compression_tool compress --store_original_apex --input /apex/to/compress --output output/path
   apex_compression_tool decompress --input /apex/to/decompress --output dir/
   apex_compression_tool verify-compressed --input /file/to/check
 """
 from __future__ import print_function
 
 import argparse
+import concurrent.futures
 import os
 import shutil
+import struct
 import subprocess
 import sys
 import tempfile
@@ -35,6 +38,12 @@ import apex_manifest_pb2
 
 tool_path_list = None
 
+# original_apex.zst is split into frames of this size, so that they can be
+# compressed and decompressed in parallel.
+ZSTD_FRAME_SIZE = 1024 * 1024
+ZSTD_SKIPPABLE_MAGIC = 0x184D2A5E
+ZSTD_SEEKABLE_MAGIC = 0x8F92EAB1
+
 
 def FindBinaryPath(binary):
   for path in tool_path_list:
@@ -75,9 +84,19 @@ def RunCompress(args, work_dir):
       - Duplicates of various meta files inside the input APEX, e.g
         AndroidManifest.xml, public_key
 
+  With args.store_original_apex, original_apex is stored rather than deflated
+  and aligned to 4 KB, so that apexd can mount its payload in place. This is
+  meant for APEXes whose payload is compressed by its filesystem already, e.g.
+  erofs.
+
+  With args.zstd, original_apex is replaced by original_apex.zst: the original
+  APEX compressed into a seekable zstd stream, stored uncompressed in the zip.
+
   Args:
       args.input: file path to uncompressed APEX
       args.output: file path to where compressed APEX will be placed
+      args.store_original_apex: whether to store original_apex uncompressed
+      args.zstd: whether to compress original_apex with zstd
       work_dir: file path to a temporary folder
   Returns:
       True if compression was executed successfully, otherwise False
@@ -85,8 +104,13 @@ def RunCompress(args, work_dir):
   global tool_path_list
   tool_path_list = args.apex_compression_tool_path
 
+  # When storing original_apex, soong_zip's output still needs to be aligned.
+  zip_output = args.output
+  if args.store_original_apex:
+    zip_output = os.path.join(work_dir, 'unaligned.capex')
+
   cmd = ['soong_zip']
-  cmd.extend(['-o', args.output])
+  cmd.extend(['-o', zip_output])
 
   # We want to put the input apex inside the compressed APEX with name
   # "original_apex". Originally this was done by creating a hard link
@@ -97,7 +121,13 @@ def RunCompress(args, work_dir):
   original_apex = os.path.join(work_dir, 'original_apex')
   shutil.copy2(args.input, original_apex)
   cmd.extend(['-C', work_dir])
-  cmd.extend(['-f', original_apex])
+  if args.zstd:
+    original_apex_zst = os.path.join(work_dir, 'original_apex.zst')
+    CompressZstdSeekable(original_apex, original_apex_zst, args.verbose)
+    cmd.extend(['-f', original_apex_zst])
+    cmd.extend(['-s', 'original_apex.zst'])
+  else:
+    cmd.extend(['-f', original_apex])
 
   # We also need to extract some files from inside of original_apex and zip
   # together with compressed apex
@@ -120,14 +150,65 @@ def RunCompress(args, work_dir):
   apex_manifest_path = os.path.join(extract_dir, 'apex_manifest.pb')
   assert AddOriginalApexDigestToManifest(apex_manifest_path, image_path, args.verbose)
 
-  # Don't forget to compress
-  cmd.extend(['-L', '9'])
+  if args.store_original_apex:
+    if not IsErofsImage(image_path):
+      print('Warning: payload of ' + args.input + ' is not an erofs image. '
+            'Storing it without compression might waste space.')
+    cmd.extend(['-s', 'original_apex'])
+  else:
+    # Don't forget to compress
+    cmd.extend(['-L', '9'])
 
   RunCommand(cmd, verbose=args.verbose)
 
+  if args.store_original_apex:
+    # apex_payload.img is at a 4 KB boundary inside original_apex, so aligning
+    # original_apex keeps it at a 4 KB boundary inside the compressed APEX.
+    RunCommand(['zipalign', '-f', '4096', zip_output, args.output],
+               verbose=args.verbose)
+
   return True
 
 
+def CompressZstdSeekable(input_path, output_path, verbose=False):
+  """Compresses input_path into a seekable zstd stream at output_path.
+
+  The stream is made of independent frames, compressed in parallel on all
+  cores, followed by a seek table in a skippable frame. See
+  https://github.com/facebook/zstd/blob/dev/contrib/seekable_format/zstd_seekable_compression_format.md
+  """
+  with open(input_path, 'rb') as f:
+    chunks = list(iter(lambda: f.read(ZSTD_FRAME_SIZE), b''))
+
+  zstd = FindBinaryPath('zstd')
+  def CompressChunk(chunk):
+    return subprocess.run([zstd, '-q', '-19', '-T1', '-c'], input=chunk,
+                          stdout=subprocess.PIPE, check=True).stdout
+
+  if verbose:
+    print('Compressing ' + input_path + ' into ' + str(len(chunks)) +
+          ' zstd frames')
+  with concurrent.futures.ThreadPoolExecutor(
+      max_workers=os.cpu_count()) as executor:
+    frames = list(executor.map(CompressChunk, chunks))
+
+  seek_table = b''.join(struct.pack('<II', len(frame), len(chunk))
+                        for frame, chunk in zip(frames, chunks))
+  # Number of frames, descriptor (no checksums) and magic.
+  seek_table += struct.pack('<IBI', len(frames), 0, ZSTD_SEEKABLE_MAGIC)
+  with open(output_path, 'wb') as f:
+    for frame in frames:
+      f.write(frame)
+    f.write(struct.pack('<II', ZSTD_SKIPPABLE_MAGIC, len(seek_table)))
+    f.write(seek_table)
+
+
+def IsErofsImage(image_path):
+  with open(image_path, 'rb') as f:
+    f.seek(1024)
+    return f.read(4) == b'\xe2\xe1\xf5\xe0'
+
+
 def AddOriginalApexDigestToManifest(capex_manifest_path, apex_image_path, verbose=False):
   # Retrieve the root digest of the image
   avbtool_cmd = [
@@ -164,6 +245,14 @@ def ParseArgs(argv):
                                     'compressed')
   parser_compress.add_argument('--output', type=str, required=True,
                                help='output path to compressed APEX file')
+  parser_compress.add_argument('--store_original_apex', action='store_true',
+                               help='store original_apex without deflating '
+                                    'it, so that it can be mounted in place. '
+                                    'Use with erofs-compressed payloads.')
+  parser_compress.add_argument('--zstd', action='store_true',
+                               help='compress original_apex with zstd into '
+                                    'independent frames, which can be '
+                                    'decompressed in parallel')
   apex_compression_tool_path_in_environ = \
     'APEX_COMPRESSION_TOOL_PATH' in os.environ
   parser_compress.add_argument(
@@ -192,6 +281,9 @@ class TempDirectory(object):
 
 def main(argv):
   args = ParseArgs(argv)
+  if args.cmd == 'compress' and args.zstd and args.store_original_apex:
+    print('--zstd and --store_original_apex are mutually exclusive')
+    sys.exit(1)
 
   with TempDirectory() as work_dir:
     success = args.func(args, work_dir)
@@ -264,7 +264,7 @@ def RunList(args):
   if GetType(args.apex) == ApexType.COMPRESSED:
     with tempfile.TemporaryDirectory() as temp:
       decompressed_apex = os.path.join(temp, 'temp.apex')
-      decompress(args.apex, decompressed_apex)
+      decompress(args.apex, decompressed_apex, args.zstd_path)
       args.apex = decompressed_apex
 
       RunList(args)
@@ -290,7 +290,7 @@ def RunExtract(args):
   if GetType(args.apex) == ApexType.COMPRESSED:
     with tempfile.TemporaryDirectory() as temp:
       decompressed_apex = os.path.join(temp, "temp.apex")
-      decompress(args.apex, decompressed_apex)
+      decompress(args.apex, decompressed_apex, args.zstd_path)
       args.apex = decompressed_apex
 
       RunExtract(args)
@@ -313,7 +313,8 @@ def GetType(apex_path):
   with zipfile.ZipFile(apex_path, 'r') as zip_file:
     names = zip_file.namelist()
     has_payload = 'apex_payload.img' in names
-    has_original_apex = 'original_apex' in names
+    has_original_apex = ('original_apex' in names or
+                         'original_apex.zst' in names)
     if has_payload and has_original_apex:
       return ApexType.INVALID
     if has_payload:
@@ -348,14 +349,25 @@ def RunDecompress(args):
   """
   compressed_apex_fp = args.input
   decompressed_apex_fp = args.output
-  return decompress(compressed_apex_fp, decompressed_apex_fp)
+  return decompress(compressed_apex_fp, decompressed_apex_fp, args.zstd_path)
 
-def decompress(compressed_apex_fp, decompressed_apex_fp):
+def decompress(compressed_apex_fp, decompressed_apex_fp, zstd_path=None):
   if os.path.exists(decompressed_apex_fp):
     print("Output path '" + decompressed_apex_fp + "' already exists")
     sys.exit(1)
 
   with zipfile.ZipFile(compressed_apex_fp, 'r') as zip_obj:
+    if 'original_apex.zst' in zip_obj.namelist():
+      # A seekable zstd stream is a regular zstd stream whose seek table is in
+      # a skippable frame, so zstd can decompress it as is.
+      if not zstd_path:
+        print('Cannot find zstd, --zstd_path must be set', file=sys.stderr)
+        sys.exit(1)
+      with zip_obj.open('original_apex.zst') as src, \
+          open(decompressed_apex_fp, 'wb') as dest:
+        subprocess.run([zstd_path, '-q', '-d', '-c'], stdin=src, stdout=dest,
+                       check=True)
+      return
     if 'original_apex' not in zip_obj.namelist():
       print(compressed_apex_fp + ' is not a compressed APEX. Missing '
                                  "'original_apex' file inside it.")
@@ -374,13 +386,16 @@ def main(argv):
   debugfs_default = None
   fsckerofs_default = None
   blkid_default = None
+  zstd_default = shutil.which('zstd')
   if 'ANDROID_HOST_OUT' in os.environ:
     debugfs_default = '%s/bin/debugfs_static' % os.environ['ANDROID_HOST_OUT']
     fsckerofs_default = '%s/bin/fsck.erofs' % os.environ['ANDROID_HOST_OUT']
     blkid_default = '%s/bin/blkid_static' % os.environ['ANDROID_HOST_OUT']
+    zstd_default = '%s/bin/zstd' % os.environ['ANDROID_HOST_OUT']
   parser.add_argument('--debugfs_path', help='The path to debugfs binary', default=debugfs_default)
   parser.add_argument('--fsckerofs_path', help='The path to fsck.erofs binary', default=fsckerofs_default)
   parser.add_argument('--blkid_path', help='The path to blkid binary', default=blkid_default)
+  parser.add_argument('--zstd_path', help='The path to zstd binary', default=zstd_default)
 
   subparsers = parser.add_subparsers(required=True, dest='cmd')
 